@@ -145,16 +145,16 @@ static const UInt8 PS2ToADBMap[0x80] =
     0x36,  // 71  Right Window
     0x6e,  // 72  Applications
     DEADKEY,  // 73
-    DEADKEY,  // 74
-    DEADKEY,  // 75
+    DEADKEY,  // 74 Sleep (a system action)
+    0x48,  // 75 Volume Up
     DEADKEY,  // 76
     DEADKEY,  // 77
     DEADKEY,  // 78
     DEADKEY,  // 79
     DEADKEY,  // 7a
     DEADKEY,  // 7b
-    0x7f,  // 7c
-    0x48,  // 7d Volume Up
+    0x7f,  // 7c Power
+    DEADKEY,  // 7d
     0x49,  // 7e Volume Down
     0x4a   // 7f Volume Mute
 };
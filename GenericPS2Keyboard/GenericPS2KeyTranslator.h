@@ -0,0 +1,423 @@
+#ifndef _GENERICPS2KEYTRANSLATOR_H
+#define _GENERICPS2KEYTRANSLATOR_H
+
+#include "GenericPS2ScancodeDecoder.h"
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Key state.  The up/down state of every key code is kept in a bit set, a
+// bit per key, set while the key is down.  Iterating over the keys that are
+// down skips whole words at a time, so finding the held keys among the 128
+// costs a handful of instructions, not a loop over every key.
+//
+
+#define KBV_NUM_KEYCODES        128
+
+class KeyStateSet
+{
+    enum { kBitsPerWord = 32, kWords = KBV_NUM_KEYCODES / kBitsPerWord };
+
+public:
+    void clear()
+    {
+        for (int index = 0; index < kWords; index++)  _words[index] = 0;
+    }
+
+    void add(UInt32 keyCode)       { _words[keyCode / kBitsPerWord] |=  bit(keyCode); }
+    void remove(UInt32 keyCode)    { _words[keyCode / kBitsPerWord] &= ~bit(keyCode); }
+    bool contains(UInt32 keyCode) const
+    {
+        return (_words[keyCode / kBitsPerWord] & bit(keyCode)) != 0;
+    }
+
+    //
+    // Returns the lowest key code in the set that is at least keyCode, or
+    // KBV_NUM_KEYCODES if there is none.  To visit every key that is down:
+    //
+    //   for (k = set.next(0); k < KBV_NUM_KEYCODES; k = set.next(k + 1))
+    //
+
+    UInt32 next(UInt32 keyCode) const
+    {
+        UInt32 index = keyCode / kBitsPerWord;
+        UInt32 word;
+
+        if (index >= kWords)  return KBV_NUM_KEYCODES;
+
+        word = _words[index] & ~(bit(keyCode) - 1);
+        while (!word)
+        {
+            if (++index == kWords)  return KBV_NUM_KEYCODES;
+            word = _words[index];
+        }
+        return index * kBitsPerWord + __builtin_ctz(word);
+    }
+
+private:
+    static UInt32 bit(UInt32 keyCode)  { return 1U << (keyCode % kBitsPerWord); }
+
+    UInt32 _words[kWords];
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Key translation.  start() compiles PS2ToADBMap, the alt/windows swap, the
+// capslock override, the function key remapping and the "Key remaps"
+// dictionary into one table indexed by key code (the decoder's folded
+// extended flag + scan code), so that translating a key is a single lookup.
+//
+// Keymap layers.  Layer 0 is the table above; every other layer is a copy
+// of it with that layer's overrides applied, so resolving a key is one lookup
+// in the highest active layer.  Layers are activated by layer keys, either
+// while held (momentary) or until pressed again (toggle).  The emulated 'fn'
+// key (Insert/Application with "Remap function keys") is a momentary layer.
+//
+
+typedef UInt16 KeyTranslation;
+
+#define kKeyTranslateADBMask            0x00FF  // ADB key code, or layer number
+#define kKeyTranslateMacro              0x0100  // macro, by index
+#define kKeyTranslateLayerMomentary     0x0200  // layer key, active while held
+#define kKeyTranslateLayerToggle        0x0400  // layer key, toggles on press
+#define kKeyTranslateTapHold            0x0800  // dual-role key, by index
+#define kKeyTranslateSystem             0x1000  // system action, by number
+#define kKeyTranslateSpecialMask        0x1F00
+
+#define KEY_TRANSLATE_ADB(t)            ((t) & kKeyTranslateADBMask)
+
+#define kKeymapMaxLayers                32      // bits in the active layer mask
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Key macros.  A key can be translated into a macro: a sequence of ADB key
+// events dispatched when the key is pressed, and another when it is released,
+// all with the key's own timestamp.  Every macro of a configuration lives in
+// one fixed-size arena, so running one never allocates or follows more than
+// one level of indirection.  A step is an ADB key code, with kMacroStepUp set
+// for a release.
+//
+// Macro 0 is built in: F3's Mission Control, ie. right control + up arrow.
+//
+
+#define kMacroMax                       64
+#define kMacroMaxSteps                  512     // in the arena
+#define kMacroMaxSequence               32      // on press, or on release
+#define kMacroStepUp                    0x100
+#define kMacroMissionControl            0
+
+struct KeyMacro
+{
+    UInt16 start[2];    // first step, on press [0] and on release [1]
+    UInt16 count[2];
+};
+
+struct KeyMacroArena
+{
+    UInt32   macroCount;
+    UInt32   stepCount;
+    KeyMacro macros[kMacroMax];
+    UInt16   steps[kMacroMaxSteps];
+
+    void reset()
+    {
+        macroCount = 0;
+        stepCount  = 0;
+    }
+
+    //
+    // Adds a macro, copying its steps into the arena.  Returns its index, or
+    // -1 if the arena is full.
+    //
+
+    int add(const UInt16 * down, UInt32 downCount, const UInt16 * up, UInt32 upCount)
+    {
+        if (macroCount == kMacroMax || kMacroMaxSteps - stepCount < downCount + upCount)
+            return -1;
+
+        KeyMacro & macro = macros[macroCount];
+
+        macro.start[0] = stepCount;
+        macro.count[0] = downCount;
+        for (UInt32 index = 0; index < downCount; index++)  steps[stepCount++] = down[index];
+        macro.start[1] = stepCount;
+        macro.count[1] = upCount;
+        for (UInt32 index = 0; index < upCount; index++)  steps[stepCount++] = up[index];
+
+        return macroCount++;
+    }
+
+    //
+    // Returns the steps to run for the given macro, or 0 if there is no such
+    // macro.
+    //
+
+    const UInt16 * sequence(UInt32 index, bool goingDown, UInt32 * count) const
+    {
+        if (index >= macroCount)  return 0;
+        *count = macros[index].count[goingDown ? 0 : 1];
+        return &steps[macros[index].start[goingDown ? 0 : 1]];
+    }
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Key translator.
+//
+// Everything between a raw scan code byte and the key event to dispatch: the
+// decoder, the debounce filter, the key up/down state, autorepeat detection
+// and the keymap layers.  It knows nothing of IOHIKeyboard or the hardware,
+// and doesn't own the translation tables, so it builds on any host with a
+// GCC-compatible compiler and can be driven from a recorded scan code stream.
+//
+// Debouncing.  Worn key switches chatter: a keystroke comes out as make,
+// break, make, break within a few milliseconds.  Each key may have a
+// debounce window; a press of the key within its window of the key's last
+// release is dropped.  Releases of keys that are down are never dropped,
+// since a key left down would autorepeat until pressed again; the trailing
+// break of a chattered keystroke arrives for a key that is already up, and
+// is ignored, but still restarts the window.  Typematic repeats aren't presses, and aren't filtered.  Times and windows
+// are in any one unit the caller likes; a window of 0 turns the filter off
+// for the key.
+//
+
+enum
+{
+    kKeyEventNone,      // prefix or ignored byte; nothing to do
+    kKeyEventKey,       // dispatch event.translation
+    kKeyEventRepeat,    // typematic repeat of a key that is already down
+    kKeyEventLayer,     // layer key, already applied to the active layers
+    kKeyEventUnknown,   // extended code we don't know; ignored
+    kKeyEventChatter    // press inside the key's debounce window; ignored
+};
+
+struct KeyEvent
+{
+    UInt8          keyCode;
+    bool           goingDown;
+    KeyTranslation translation;
+};
+
+class KeyTranslator
+{
+public:
+    void reset()
+    {
+        _tables     = 0;
+        _layerCount = 0;
+        _debounce   = 0;
+        _decoderRow = kDecodeRowIdle;
+        _keysDown.clear();
+        for (int index = 0; index < KBV_NUM_KEYCODES; index++)  _pressedTranslation[index] = 0;
+        for (int index = 0; index < KBV_NUM_KEYCODES; index++)  _lastRelease[index] = 0;
+        resetLayers();
+    }
+
+    //
+    // Switches to new translation tables, layerCount tables of
+    // KBV_NUM_KEYCODES entries each, and debounce windows, one per key code
+    // (or 0 for none at all).  Toggled layers the new tables still have stay
+    // on; momentary layers are let go of, so the keys holding them should be
+    // flushed first.  A partial sequence carries on with the new tables.
+    //
+
+    void setTables(const KeyTranslation * tables, UInt32 layerCount, const UInt32 * debounce)
+    {
+        UInt32 toggled = _layersToggled;
+
+        _tables     = tables;
+        _layerCount = layerCount;
+        _debounce   = debounce;
+        resetLayers();
+        if (layerCount < kKeymapMaxLayers)  toggled &= ((UInt32)1 << layerCount) - 1;
+        _layersToggled = toggled;
+    }
+
+    bool sequenceIdle() const       { return _decoderRow == kDecodeRowIdle; }
+    void abandonSequence()          { _decoderRow = kDecodeRowIdle; }
+    bool isKeyDown(UInt8 keyCode) const
+    {
+        return _keysDown.contains(keyCode);
+    }
+
+    //
+    // Runs one byte, which arrived at the given time, through the decoder,
+    // and translates the key it finishes, if any.  Returns one of the
+    // kKeyEvent constants; event is filled in for kKeyEventKey,
+    // kKeyEventRepeat and kKeyEventLayer, and its keyCode and goingDown for
+    // kKeyEventChatter.
+    //
+
+    UInt32 translate(UInt8 scanCode, UInt64 time, KeyEvent * event)
+    {
+        return _debounce ? translate<true>(scanCode, time, event)
+                         : translate<false>(scanCode, time, event);
+    }
+
+    //
+    // The same, specialised for whether the current tables have debounce
+    // windows, for callers that can decide once for many bytes.  Debounced
+    // must match the tables.
+    //
+
+    template <bool Debounced>
+    UInt32 translate(UInt8 scanCode, UInt64 time, KeyEvent * event)
+    {
+        return translateTransition<Debounced>(decodeScancode(&_decoderRow, scanCode), time, event);
+    }
+
+    //
+    // The same in two steps, for whole buffers of bytes: decode runs them all
+    // through the decoder at once, and translateTransition then translates
+    // each of the transitions, in order, before the next buffer is decoded.
+    //
+
+    void decode(const UInt8 * scanCodes, UInt32 count, ScancodeTransition * transitions)
+    {
+        decodeScancodes(&_decoderRow, scanCodes, count, transitions);
+    }
+
+    template <bool Debounced>
+    UInt32 translateTransition(ScancodeTransition transition, UInt64 time, KeyEvent * event)
+    {
+        UInt8 keyCode;
+
+        //
+        // Prefix bytes (E0, E1) and the useless or fake-shift bytes of a
+        // sequence only move the decoder to another state; we'll finish the
+        // sequence when the next byte arrives.
+        //
+
+        switch (DECODE_ACTION(transition))
+        {
+            case kDecodeActionKey:      break;
+            case kDecodeActionUnknown:  return kKeyEventUnknown;
+            default:                    return kKeyEventNone;
+        }
+
+        keyCode = DECODE_KEYCODE(transition);
+        event->keyCode   = keyCode;
+        event->goingDown = DECODE_GOING_DOWN(transition);
+
+        if (Debounced && event->goingDown && _debounce[keyCode] && _lastRelease[keyCode] &&
+            time - _lastRelease[keyCode] < _debounce[keyCode] && !_keysDown.contains(keyCode))
+            return kKeyEventChatter;
+
+        //
+        // Update our key state, which maintains the up/down status of all
+        // keys, and translate the key in the highest active layer.
+        // Releases use whatever the key translated to when it was pressed, so
+        // that keys don't get stuck when the active layers change while they
+        // are held.  A release of a key that isn't down (it was flushed, or
+        // its press was dropped) has nothing to undo, and is ignored.
+        //
+
+        if (event->goingDown)
+        {
+            //
+            // Verify that this is not an autorepeated key.
+            //
+
+            if (_keysDown.contains(keyCode))
+            {
+                event->translation = _pressedTranslation[keyCode];
+                return kKeyEventRepeat;
+            }
+
+            _keysDown.add(keyCode);
+
+            UInt32 layer = 31 - __builtin_clz(_layersHeld | _layersToggled | 1);
+            event->translation = _tables[layer * KBV_NUM_KEYCODES + keyCode];
+            _pressedTranslation[keyCode] = event->translation;
+        }
+        else
+        {
+            if (Debounced)  _lastRelease[keyCode] = time;
+            if (!_keysDown.contains(keyCode))  return kKeyEventNone;
+
+            _keysDown.remove(keyCode);
+            event->translation = _pressedTranslation[keyCode];
+        }
+
+        if (event->translation & (kKeyTranslateLayerMomentary | kKeyTranslateLayerToggle))
+        {
+            applyLayerKey(event->translation, event->goingDown);
+            return kKeyEventLayer;
+        }
+
+        return kKeyEventKey;
+    }
+
+    //
+    // Releases the lowest key that is down, for when the keyboard can't be
+    // trusted to send the key up (it was powered down or reset, or bytes were
+    // lost), or before switching tables.  Returns kKeyEventKey or
+    // kKeyEventLayer, with event filled in as for a real release, or
+    // kKeyEventNone once no keys are down.
+    //
+
+    UInt32 flush(KeyEvent * event)
+    {
+        UInt32 keyCode = _keysDown.next(0);
+
+        if (keyCode == KBV_NUM_KEYCODES)  return kKeyEventNone;
+
+        _keysDown.remove(keyCode);
+        event->keyCode               = keyCode;
+        event->goingDown             = false;
+        event->translation           = _pressedTranslation[keyCode];
+        _pressedTranslation[keyCode] = 0;
+
+        if (event->translation & (kKeyTranslateLayerMomentary | kKeyTranslateLayerToggle))
+        {
+            applyLayerKey(event->translation, false);
+            return kKeyEventLayer;
+        }
+
+        return kKeyEventKey;
+    }
+
+private:
+    void resetLayers()
+    {
+        _layersHeld    = 0;
+        _layersToggled = 0;
+        for (int index = 0; index < kKeymapMaxLayers; index++)  _layerHoldCount[index] = 0;
+    }
+
+    void applyLayerKey(KeyTranslation translation, bool goingDown)
+    {
+        //
+        // Updates the active layers for a layer key.  Several momentary keys
+        // may hold the same layer, so the layer stays active until all are
+        // released.
+        //
+
+        UInt32 layer = KEY_TRANSLATE_ADB(translation);
+        UInt32 bit   = (UInt32)1 << layer;
+
+        if (translation & kKeyTranslateLayerToggle)
+        {
+            if (goingDown)  _layersToggled ^= bit;
+            return;
+        }
+
+        if (goingDown)
+            _layerHoldCount[layer]++;
+        else if (_layerHoldCount[layer])
+            _layerHoldCount[layer]--;
+
+        if (_layerHoldCount[layer])
+            _layersHeld |= bit;
+        else
+            _layersHeld &= ~bit;
+    }
+
+    const KeyTranslation * _tables;
+    UInt32                 _layerCount;
+    const UInt32 *         _debounce;
+    UInt32                 _layersHeld;
+    UInt32                 _layersToggled;
+    UInt8                  _layerHoldCount[kKeymapMaxLayers];
+    UInt16                 _decoderRow;
+    KeyStateSet            _keysDown;
+    KeyTranslation         _pressedTranslation[KBV_NUM_KEYCODES];
+    UInt64                 _lastRelease[KBV_NUM_KEYCODES];     // 0 if never
+};
+
+#endif /* !_GENERICPS2KEYTRANSLATOR_H */
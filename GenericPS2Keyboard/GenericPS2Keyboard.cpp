@@ -27,9 +27,11 @@
 #include <IOKit/hidsystem/IOLLEvent.h>
 #include <IOKit/pwr_mgt/IOPM.h>
 #include <IOKit/pwr_mgt/RootDomain.h>
+#include <libkern/libkern.h>
 #include "GenericPS2Keyboard.h"
 #include "ApplePS2KeyboardDevice.h"
 #include "ApplePS2ToADBMap.h"
+#include "GenericPS2Keymap.h"
 
 // =============================================================================
 // GenericPS2Keyboard Class Implementation
@@ -38,16 +40,147 @@
 #define super IOHIKeyboard
 #define APPLEPS2KEYBOARD_DEVICE_TYPE	0x1B
 
-// I just made these up (after checking they weren't in the main map).
-#define kSpecialPrevious 0xa1
-#define kSpecialPlay 0xa2
-#define kSpecialNext 0xa3
+//
+// Keyboard layouts, chosen with the "Keyboard layout" property.  The device
+// type tells the system which physical layout to expect, eg. to swap the keys
+// either side of the ISO key; 41 and 42 are the generic ISO and JIS types.
+// The layout's keys override PS2ToADBMap in the base translation table.  The
+// ISO keys (29 and 56) are already where PS2ToADBMap puts them; JIS adds yen,
+// ro and the keypad comma, and sends henkan and muhenkan as kana and eisu.
+//
+
+struct LayoutKey
+{
+    UInt8 keyCode;
+    UInt8 adbKeyCode;
+};
+
+static const LayoutKey KeysJIS[] =
+{
+    { 0x7d, 0x5d },     // yen
+    { 0x73, 0x5e },     // ro
+    { 0x5c, 0x5f },     // keypad ,
+    { 0x79, 0x68 },     // henkan -> kana
+    { 0x7b, 0x66 }      // muhenkan -> eisu
+};
+
+struct KeyboardLayout
+{
+    const char *          name;
+    const unsigned char * keymap;
+    UInt32                keymapLength;
+    UInt32                deviceType;
+    const LayoutKey *     keys;
+    UInt32                keyCount;
+};
+
+static const KeyboardLayout KeyboardLayouts[] =
+{
+    { "ANSI", KeymapANSI, sizeof(KeymapANSI), APPLEPS2KEYBOARD_DEVICE_TYPE, 0, 0 },
+    { "ISO",  KeymapISO,  sizeof(KeymapISO),  41, 0, 0 },
+    { "JIS",  KeymapJIS,  sizeof(KeymapJIS),  42, KeysJIS, sizeof(KeysJIS) / sizeof(KeysJIS[0]) }
+};
+
+//
+// Anomaly names, for the log and the "Anomalies" property.
+//
+
+static const char * const kAnomalyNames[kAnomalyCount] =
+{
+    "Unexpected acknowledges",
+    "Unexpected resend requests",
+    "Overruns",
+    "Keyboard resets",
+    "Unknown extended codes",
+    "Scan code ring overflows",
+    "Commands cut short"
+};
+
+//
+// System actions, by kSystemAction number.  The names are what "Key remaps"
+// entries use to map a key to an action, and label the "System actions"
+// statistics.  A press within debounceMS of the last time the action fired
+// is ignored.
+//
+
+struct SystemAction
+{
+    const char * name;
+    UInt32       debounceMS;
+};
 
-#define kRemappedDeadKey 0xa4
+static const SystemAction kSystemActions[kSystemActionCount] =
+{
+    { "Sleep",         2000 },
+    { "Display sleep", 1000 },
+    { "Power",         1000 },
+    { "Lock",          1000 }
+};
+
+static int systemActionNamed(OSString * name)
+{
+    for (int action = 0; name && action < kSystemActionCount; action++)
+        if (name->isEqualTo(kSystemActions[action].name))  return action;
+    return -1;
+}
 
 OSDefineMetaClassAndStructors(GenericPS2Keyboard, IOHIKeyboard);
 
-UInt32 GenericPS2Keyboard::deviceType()  { return APPLEPS2KEYBOARD_DEVICE_TYPE; };
+//
+// Command templates, copied into requests as they are submitted.  Variable
+// bytes (eg. the LED state) are zero here and filled in by the caller.
+//
+
+static const PS2Command kTestEchoCommands[] =
+{
+    { kPS2C_WriteDataPort,          kDP_TestKeyboardEcho },
+    { kPS2C_ReadDataPortAndCompare, 0xEE },
+};
+
+static const PS2Command kGetCommandByteCommands[] =
+{
+    { kPS2C_WriteCommandPort,       kCP_GetCommandByte },
+    { kPS2C_ReadDataPort,           0 },                    // command byte
+};
+
+static const PS2Command kSetLEDsCommands[] =
+{
+    { kPS2C_WriteDataPort,          kDP_SetKeyboardLEDs },
+    { kPS2C_ReadDataPortAndCompare, kSC_Acknowledge },
+    { kPS2C_WriteDataPort,          0 },                    // LED state
+    { kPS2C_ReadDataPortAndCompare, kSC_Acknowledge },
+};
+
+static const PS2Command kSetTypematicCommands[] =
+{
+    { kPS2C_WriteDataPort,          kDP_SetKeyboardTypematic },
+    { kPS2C_ReadDataPortAndCompare, kSC_Acknowledge },
+    { kPS2C_WriteDataPort,          0 },                    // rate and delay
+    { kPS2C_ReadDataPortAndCompare, kSC_Acknowledge },
+};
+
+static const PS2Command kEnableCommands[] =
+{
+    { kPS2C_WriteDataPort,          kDP_Enable },
+    { kPS2C_ReadDataPortAndCompare, kSC_Acknowledge },
+};
+
+static const PS2Command kDisableCommands[] =
+{
+    { kPS2C_WriteDataPort,          kDP_SetDefaultsAndDisable },
+    { kPS2C_ReadDataPortAndCompare, kSC_Acknowledge },
+};
+
+#define COMMAND_COUNT(commands) (sizeof(commands) / sizeof(commands[0]))
+
+//
+// Command byte bits set and cleared while the keyboard is running.
+//
+
+#define kCommandByteRunningSet   (kCB_EnableKeyboardIRQ | kCB_TranslateMode)
+#define kCommandByteRunningClear (kCB_DisableKeyboardClock)
+
+UInt32 GenericPS2Keyboard::deviceType()  { return KeyboardLayouts[_layout].deviceType; };
 UInt32 GenericPS2Keyboard::interfaceID() { return NX_EVS_DEVICE_INTERFACE_ACE; };
 
 UInt32 GenericPS2Keyboard::maxKeyCodes() { return KBV_NUM_KEYCODES; };
@@ -64,13 +197,142 @@ bool GenericPS2Keyboard::init(OSDictionary * properties)
     if (!super::init(properties))  return false;
     
     _device                    = 0;
-    _extendCount               = 0;
+    _workLoop                  = 0;
+    _scancodeSource            = 0;
+    _startTimer                = 0;
+    _tapHoldTimer              = 0;
+    _anomalyTimer              = 0;
+    _anomalyLogArmed           = 0;
+    _systemActionSource        = 0;
+    _systemActionsPending      = 0;
+    _tapHoldKey                = KBV_NUM_KEYCODES;
+    _tapHoldPressed            = 0;
+    _taps                      = 0;
+    _holdsByTime               = 0;
+    _holdsByKey                = 0;
+    _tapHoldLatency.reset();
+    _startState                = kStartStateIdle;
+    _startRetries              = 0;
+    _startTime                 = 0;
+    _startBlocked              = 0;
+    _startDuration             = 0;
+    _capture                   = 0;
+    _captureEnabled            = false;
+    _sequenceStart             = 0;
+    _lastEventTime             = 0;
+    _sequenceLatency.reset();
+    _dispatchLatency.reset();
     _interruptHandlerInstalled = false;
     _ledState                  = 0;
+    _requestPoolFree           = 0;
+    _requestPoolMisses         = 0;
+    _requestsDeferred          = 0;
+    _deferredEnable            = false;
+    _deferredTypematic         = 0;
+    _ledDeferred               = 0;
+    _ledRequestInFlight        = false;
+    _ledPendingValid           = false;
+    _ledPending                = 0;
+    _ledRequestsSent           = 0;
+    _ledRequestsElided         = 0;
+    _commandByte               = 0;
+    _commandByteValid          = false;
+    _resumeSendsLEDs           = false;
+    _wakesBatched              = 0;
+    _wakesFallenBack           = 0;
+    _wakeLatency.reset();
+    _requestsSubmitted         = 0;
+    _commandsSubmitted         = 0;
+    _requestsBlocking          = 0;
+    _requestsBlockingTruncated = 0;
+    _commandByteRetries        = 0;
+    _blockingLatency.reset();
+    
+    for (int index = 0; index < kRequestPoolSize; index++)  _requestPool[index] = 0;
+    for (int index = 0; index < KBV_NUM_KEYCODES; index++)  _keyDownTime[index] = 0;
+    for (int index = 0; index < KBV_NUM_KEYCODES; index++)  _keyPresses[index] = 0;
+    for (int index = 0; index < KBV_NUM_KEYCODES; index++)  _keyHeld[index] = 0;
+    for (int index = 0; index < KBV_NUM_KEYCODES; index++)  _tapHoldHolding[index] = 0;
+    for (int index = 0; index < kAnomalyCount; index++)     _anomalies[index] = 0;
+    for (int index = 0; index < kAnomalyCount; index++)     _anomaliesLogged[index] = 0;
+    for (int index = 0; index < kSystemActionCount; index++)
+    {
+        _systemActionTime[index]        = 0;
+        _systemActionsFired[index]      = 0;
+        _systemActionsSuppressed[index] = 0;
+    }
+    for (int index = 0; index < KBV_NUM_KEYCODES; index++)  _chatterSuppressed[index] = 0;
+    _keyFlushes    = 0;
+    _keysFlushed   = 0;
+    _chatterTotal  = 0;
+    _resetExpected = 0;
     
-    for (int index = 0; index < KBV_NUNITS; index++)  _keyBitVector[index] = 0;
+    _suppressTypematic   = false;
+    _typematicSuppressed = false;
+    _repeatsDiscarded    = 0;
+    _repeatsAvoided      = 0;
     
-    return true;
+    _config         = 0;
+    _pendingConfig  = 0;
+    _configsApplied = 0;
+    _configLayers   = 0;
+    _translator.reset();
+    
+    //
+    // IOHIKeyboard asks for the keymap as it starts, so the layout is chosen
+    // once, here; choosing one is just picking which compiled keymap to hand
+    // out.
+    //
+    
+    _layout = 0;
+    OSString * layout = OSDynamicCast(OSString, getProperty("Keyboard layout"));
+    if (layout)
+    {
+        while (_layout < sizeof(KeyboardLayouts) / sizeof(KeyboardLayouts[0]) &&
+               !layout->isEqualTo(KeyboardLayouts[_layout].name))
+            _layout++;
+        
+        if (_layout == sizeof(KeyboardLayouts) / sizeof(KeyboardLayouts[0]))
+        {
+            IOLog("%s: Unknown keyboard layout %s, using ANSI.\n", getName(), layout->getCStringNoCopy());
+            _layout = 0;
+        }
+    }
+    
+    _ledLock = IOSimpleLockAlloc();
+    
+    return (_ledLock != 0);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void GenericPS2Keyboard::free()
+{
+    if (_config)
+    {
+        IOFree(_config, _config->size);
+        _config = 0;
+    }
+    
+    if (_pendingConfig)
+    {
+        IOFree(_pendingConfig, _pendingConfig->size);
+        _pendingConfig = 0;
+    }
+    
+    if (_capture)
+    {
+        IOFree(_capture, sizeof(KeyboardCapture));
+        _capture = 0;
+    }
+    
+    if (_ledLock)
+    {
+        IOSimpleLockFree(_ledLock);
+        _ledLock = 0;
+    }
+    
+    super::free();
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -79,48 +341,424 @@ GenericPS2Keyboard * GenericPS2Keyboard::probe(IOService * provider, SInt32 * sc
 {
     //
     // The driver has been instructed to verify the presence of the actual
-    // hardware we represent. We are guaranteed by the controller that the
-    // keyboard clock is enabled and the keyboard itself is disabled (thus
-    // it won't send any asynchronous scan codes that may mess up the
-    // responses expected by the commands we send it).  This is invoked
+    // hardware we represent.  We used to send the keyboard a diagnostic echo
+    // here and wait for it; that is now the first step of the asynchronous
+    // bring-up started by start(), which terminates the driver if the echo
+    // fails, so that probing doesn't hold up the boot.  This is invoked
     // after the init.
     //
     
-    ApplePS2KeyboardDevice * device  = (ApplePS2KeyboardDevice *)provider;
-    PS2Request *             request = device->allocateRequest();
-    bool                     success;
-    
     if (!super::probe(provider, score))  return 0;
     
+    return this;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool GenericPS2Keyboard::serializeProperties(OSSerialize * serialize) const
+{
     //
-    // Check to see if the keyboard responds to a basic diagnostic echo.
+    // Refresh our statistics properties whenever someone asks for all of our
+    // properties (eg. ioreg), rather than maintaining them on the hot path.
     //
     
-    // (diagnostic echo command)
-    request->commands[0].command = kPS2C_WriteDataPort;
-    request->commands[0].inOrOut = kDP_TestKeyboardEcho;
-    request->commands[1].command = kPS2C_ReadDataPortAndCompare;
-    request->commands[1].inOrOut = 0xEE;
-    request->commandsCount = 2;
-    device->submitRequestAndBlock(request);
+    const_cast<GenericPS2Keyboard *>(this)->publishStatistics();
+    return super::serializeProperties(serialize);
+}
+
+static void setStatistic(OSDictionary * dictionary, const char * key, UInt64 value)
+{
+    OSNumber * number = OSNumber::withNumber(value, 64);
+    if (number)
+    {
+        dictionary->setObject(key, number);
+        number->release();
+    }
+}
+
+static void appendStatistic(OSArray * array, UInt64 value)
+{
+    OSNumber * number = OSNumber::withNumber(value, 64);
+    if (number)
+    {
+        array->setObject(number);
+        number->release();
+    }
+}
+
+static OSArray * histogramArray(const LatencyHistogram & histogram)
+{
+    OSArray * array = OSArray::withCapacity(kLatencyBuckets);
+    
+    for (int index = 0; array && index < kLatencyBuckets; index++)
+        appendStatistic(array, histogram.buckets[index]);
+    
+    return array;
+}
+
+void GenericPS2Keyboard::publishStatistics()
+{
+    //
+    // Snapshots the counters maintained by the work loop into properties.
+    // The counters are only ever incremented, so a slightly stale snapshot is
+    // harmless and we don't need to stop the input path to take it.
+    //
+    
+    OSDictionary * typematic = OSDictionary::withCapacity(3);
+    if (typematic)
+    {
+        typematic->setObject("Suppressed", _typematicSuppressed ? kOSBooleanTrue : kOSBooleanFalse);
+        setStatistic(typematic, "Repeats discarded", _repeatsDiscarded);
+        setStatistic(typematic, "Repeats avoided (estimated)", _repeatsAvoided);
+        setProperty("Typematic", typematic);
+        typematic->release();
+    }
+    
+    OSDictionary * flushes = OSDictionary::withCapacity(2);
+    if (flushes)
+    {
+        setStatistic(flushes, "Flushes", _keyFlushes);
+        setStatistic(flushes, "Keys released", _keysFlushed);
+        setProperty("Held keys released", flushes);
+        flushes->release();
+    }
+    
+    OSDictionary * config = OSDictionary::withCapacity(2);
+    if (config)
+    {
+        setStatistic(config, "Applied", _configsApplied);
+        setStatistic(config, "Layers", _configLayers);
+        setProperty("Configuration", config);
+        config->release();
+    }
+    
+    OSDictionary * tapHold  = OSDictionary::withCapacity(4);
+    OSArray *      decision = histogramArray(_tapHoldLatency);
+    if (tapHold && decision)
+    {
+        setStatistic(tapHold, "Taps", _taps);
+        setStatistic(tapHold, "Holds (timed out)", _holdsByTime);
+        setStatistic(tapHold, "Holds (other key pressed)", _holdsByKey);
+        tapHold->setObject("Decision latency", decision);
+        setProperty("Tap/hold", tapHold);
+    }
+    if (tapHold)   tapHold->release();
+    if (decision)  decision->release();
+    
+    OSDictionary * anomalies = OSDictionary::withCapacity(kAnomalyCount);
+    if (anomalies)
+    {
+        for (int index = 0; index < kAnomalyCount; index++)
+            setStatistic(anomalies, kAnomalyNames[index], (UInt32)_anomalies[index]);
+        setProperty("Anomalies", anomalies);
+        anomalies->release();
+    }
+    
+    OSDictionary * debounce = OSDictionary::withCapacity(2);
+    OSDictionary * byKey    = OSDictionary::withCapacity(8);
+    if (debounce && byKey)
+    {
+        char name[8];
+        
+        for (int index = 0; index < KBV_NUM_KEYCODES; index++)
+        {
+            if (!_chatterSuppressed[index])  continue;
+            snprintf(name, sizeof(name), "0x%02x", index);
+            setStatistic(byKey, name, _chatterSuppressed[index]);
+        }
+        setStatistic(debounce, "Suppressed", _chatterTotal);
+        debounce->setObject("Suppressed by key", byKey);
+        setProperty("Debounce", debounce);
+    }
+    if (debounce)  debounce->release();
+    if (byKey)     byKey->release();
+    
+    OSDictionary * actions = OSDictionary::withCapacity(kSystemActionCount);
+    for (int index = 0; actions && index < kSystemActionCount; index++)
+    {
+        OSDictionary * action = OSDictionary::withCapacity(2);
+        if (!action)  continue;
+        setStatistic(action, "Fired", _systemActionsFired[index]);
+        setStatistic(action, "Suppressed", _systemActionsSuppressed[index]);
+        actions->setObject(kSystemActions[index].name, action);
+        action->release();
+    }
+    if (actions)
+    {
+        setProperty("System actions", actions);
+        actions->release();
+    }
     
-    // (free the request)
-    success = (request->commandsCount == 2);
-    device->freeRequest(request);
+    OSDictionary * leds = OSDictionary::withCapacity(2);
+    if (leds)
+    {
+        setStatistic(leds, "Requests sent", _ledRequestsSent);
+        setStatistic(leds, "Requests elided", _ledRequestsElided);
+        setStatistic(leds, "Request pool misses", (UInt32)_requestPoolMisses);
+        setProperty("LED updates", leds);
+        leds->release();
+    }
+    
+    OSDictionary * start = OSDictionary::withCapacity(4);
+    if (start)
+    {
+        UInt64 nanoseconds;
+        
+        start->setObject("Running", (_startState == kStartStateRunning) ? kOSBooleanTrue : kOSBooleanFalse);
+        absolutetime_to_nanoseconds(_startBlocked, &nanoseconds);
+        setStatistic(start, "Blocked in start (us)", nanoseconds / 1000);
+        absolutetime_to_nanoseconds(_startDuration, &nanoseconds);
+        setStatistic(start, "Start to running (us)", nanoseconds / 1000);
+        setStatistic(start, "Command byte retries", _startRetries);
+        setProperty("Start", start);
+        start->release();
+    }
+    
+    OSDictionary * commands = OSDictionary::withCapacity(6);
+    OSArray *      blocking = histogramArray(_blockingLatency);
+    if (commands && blocking)
+    {
+        setStatistic(commands, "Requests", (UInt32)_requestsSubmitted);
+        setStatistic(commands, "Commands", (UInt32)_commandsSubmitted);
+        setStatistic(commands, "Blocking requests", _requestsBlocking);
+        setStatistic(commands, "Blocking requests cut short", _requestsBlockingTruncated);
+        setStatistic(commands, "Command byte test-and-set retries", _commandByteRetries);
+        commands->setObject("Blocking request duration", blocking);
+        setProperty("Command path", commands);
+    }
+    if (commands)  commands->release();
+    if (blocking)  blocking->release();
+    
+    OSDictionary * wake = OSDictionary::withCapacity(3);
+    OSArray *      duration = histogramArray(_wakeLatency);
+    if (wake && duration)
+    {
+        setStatistic(wake, "Single request", _wakesBatched);
+        setStatistic(wake, "Separate requests", _wakesFallenBack);
+        wake->setObject("Duration", duration);
+        setProperty("Resume", wake);
+    }
+    if (wake)      wake->release();
+    if (duration)  duration->release();
+    
+    OSDictionary * latency = OSDictionary::withCapacity(3);
+    OSArray *      sequence = histogramArray(_sequenceLatency);
+    OSArray *      dispatch = histogramArray(_dispatchLatency);
+    if (latency && sequence && dispatch)
+    {
+        OSString * units = OSString::withCString("log2 microseconds");
+        if (units)
+        {
+            latency->setObject("Buckets", units);
+            units->release();
+        }
+        latency->setObject("First byte to last byte", sequence);
+        latency->setObject("Last byte to dispatch", dispatch);
+        setProperty("Latency", latency);
+    }
+    if (latency)   latency->release();
+    if (sequence)  sequence->release();
+    if (dispatch)  dispatch->release();
+    
+    publishKeyUsage();
+    if (_capture)  publishCapture();
+}
+
+void GenericPS2Keyboard::setCaptureEnabled(bool enable)
+{
+    //
+    // Starts or stops capturing.  The capture buffer is only allocated the
+    // first time capturing starts, and then kept (with its contents) until
+    // we are freed, so that the interrupt action never sees it go away.
+    //
+    
+    if (enable && !_capture)
+    {
+        _capture = (KeyboardCapture *)IOMalloc(sizeof(KeyboardCapture));
+        if (!_capture)  return;
+        _capture->reset();
+        __sync_synchronize();
+    }
+    
+    _captureEnabled = enable;
+    setProperty("Capture scan codes", enable ? kOSBooleanTrue : kOSBooleanFalse);
+}
+
+void GenericPS2Keyboard::publishCapture()
+{
+    //
+    // Encodes a snapshot of the capture into the "Scan code trace" property.
+    // Capturing carries on meanwhile.
+    //
     
-    return (success) ? this : 0;
+    UInt32              traceSize = kScancodeTraceHeaderSize + kCaptureSize * kScancodeTraceMaxRecordSize;
+    ScancodeRingEntry * entries   = (ScancodeRingEntry *)IOMalloc(kCaptureSize * sizeof(ScancodeRingEntry));
+    UInt8 *             trace     = (UInt8 *)IOMalloc(traceSize);
+    ScancodeTraceWriter writer;
+    
+    if (entries && trace && writer.begin(trace, traceSize))
+    {
+        UInt32 count = _capture->snapshot(entries);
+        
+        for (UInt32 index = 0; index < count; index++)
+        {
+            UInt64 nanoseconds;
+            
+            absolutetime_to_nanoseconds(entries[index].time, &nanoseconds);
+            writer.append(nanoseconds, entries[index].scanCode);
+        }
+        
+        OSData * data = OSData::withBytes(trace, writer.length());
+        if (data)
+        {
+            setProperty("Scan code trace", data);
+            data->release();
+        }
+    }
+    
+    if (entries)  IOFree(entries, kCaptureSize * sizeof(ScancodeRingEntry));
+    if (trace)    IOFree(trace, traceSize);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static const char * const kRemapSettings[] =
+{
+    "Swap alt and windows key",
+    "Remap function keys",
+    "Map capslock to keycode",
+    "Key remaps",
+    "Layers",
+    "Debounce (ms)",
+    "Debounce keys",
+};
+
+IOReturn GenericPS2Keyboard::validateSettings(OSDictionary * settings)
+{
+    //
+    // Checks the types of any remap settings, before we take any of them, so
+    // that a bad request changes nothing.  The contents of "Key remaps" and
+    // "Layers" are checked entry by entry as they are compiled, as at start.
+    //
+    
+    OSObject * value;
+    
+    if ((value = settings->getObject("Swap alt and windows key")) && !OSDynamicCast(OSBoolean, value))
+        return kIOReturnBadArgument;
+    if ((value = settings->getObject("Remap function keys")) && !OSDynamicCast(OSBoolean, value))
+        return kIOReturnBadArgument;
+    if ((value = settings->getObject("Suppress typematic repeat")) && !OSDynamicCast(OSBoolean, value))
+        return kIOReturnBadArgument;
+    if ((value = settings->getObject("Map capslock to keycode")) &&
+        (!OSDynamicCast(OSNumber, value) ||
+         ((OSNumber *)value)->unsigned32BitValue() > kKeyTranslateADBMask))
+        return kIOReturnBadArgument;
+    if ((value = settings->getObject("Key remaps")) && !OSDynamicCast(OSDictionary, value))
+        return kIOReturnBadArgument;
+    if ((value = settings->getObject("Layers")) && !OSDynamicCast(OSArray, value))
+        return kIOReturnBadArgument;
+    if ((value = settings->getObject("Debounce (ms)")) &&
+        (!OSDynamicCast(OSNumber, value) ||
+         ((OSNumber *)value)->unsigned32BitValue() > kDebounceMaxMS))
+        return kIOReturnBadArgument;
+    if ((value = settings->getObject("Debounce keys")) && !OSDynamicCast(OSDictionary, value))
+        return kIOReturnBadArgument;
+    
+    return kIOReturnSuccess;
 }
 
 IOReturn GenericPS2Keyboard::setProperties(OSObject * properties) {
+    OSDictionary *   dict     = OSDynamicCast(OSDictionary, properties);
+    OSBoolean *      capture  = dict ? OSDynamicCast(OSBoolean, dict->getObject("Capture scan codes")) : 0;
+    OSBoolean *      suppress;
+    bool             remapped = false;
+    KeyboardConfig * config   = 0;
+    
+    if (dict && validateSettings(dict) != kIOReturnSuccess)
+        return kIOReturnBadArgument;
+    
+    //
+    // Recompile the translation tables from the whole set of remap settings,
+    // with any new ones, before taking anything; if that fails, nothing
+    // changes.
+    //
+    
+    for (unsigned index = 0; dict && index < sizeof(kRemapSettings) / sizeof(kRemapSettings[0]); index++)
+        if (dict->getObject(kRemapSettings[index]))  remapped = true;
+    
+    if (remapped && _device)
+    {
+        config = buildConfig(dict);
+        if (!config)  return kIOReturnNoMemory;
+    }
+    
+    if (capture)  setCaptureEnabled(capture->isTrue());
+    
+    for (unsigned index = 0; remapped && index < sizeof(kRemapSettings) / sizeof(kRemapSettings[0]); index++)
+    {
+        OSObject * value = dict->getObject(kRemapSettings[index]);
+        if (value)  setProperty(kRemapSettings[index], value);
+    }
+    if (config)  publishConfig(config);
+    
+    suppress = dict ? OSDynamicCast(OSBoolean, dict->getObject("Suppress typematic repeat")) : 0;
+    if (suppress)
+    {
+        setProperty("Suppress typematic repeat", suppress);
+        if (_device && _suppressTypematic != suppress->isTrue())
+        {
+            _suppressTypematic = suppress->isTrue();
+            setKeyboardTypematic(_suppressTypematic ? kTypematicSlowest : kTypematicDefault);
+        }
+    }
+    
+    if (dict && dict->getObject("Release all keys") && _workLoop)
+        _workLoop->runAction(OSMemberFunctionCast(IOWorkLoop::Action, this,
+                                                  &GenericPS2Keyboard::releaseAllKeysGated),
+                             this, (void *)"requested");
+    
     super::setProperties(properties);
-    setProperty(kIOHIDVendorIDKey, OSNumber::withNumber((unsigned long long) 0, 16));
-    setProperty(kIOHIDProductIDKey, OSNumber::withNumber((unsigned long long) 0, 16));
-    setProperty(kIOHIDManufacturerKey, OSString::withCString("Generic"));
-    setProperty(kIOHIDProductKey, OSString::withCString("Generic PS/2 Keyboard"));
+    setProperty(kIOHIDVendorIDKey, (unsigned long long) 0, 16);
+    setProperty(kIOHIDProductIDKey, (unsigned long long) 0, 16);
+    setProperty(kIOHIDManufacturerKey, "Generic");
+    setProperty(kIOHIDProductKey, "Generic PS/2 Keyboard");
     return kIOReturnSuccess;
 }
 
 
+void GenericPS2Keyboard::publishKeyUsage()
+{
+    //
+    // Copies the key usage counters into the "Key usage" property.  They
+    // are single aligned words, only ever written by the work loop, so the
+    // copy is just slightly stale, never torn, and the work loop never waits
+    // for it.
+    //
+    
+    KeyUsageSnapshot * usage = (KeyUsageSnapshot *)IOMalloc(sizeof(KeyUsageSnapshot));
+    if (!usage)  return;
+    
+    usage->magic[0] = 'P';
+    usage->magic[1] = 'S';
+    usage->magic[2] = '2';
+    usage->magic[3] = 'U';
+    usage->version  = kKeyUsageVersion;
+    usage->keyCount = KBV_NUM_KEYCODES;
+    for (int index = 0; index < KBV_NUM_KEYCODES; index++)
+    {
+        usage->presses[index] = _keyPresses[index];
+        absolutetime_to_nanoseconds(_keyHeld[index], &usage->heldNanoseconds[index]);
+    }
+    
+    OSData * data = OSData::withBytes(usage, sizeof(KeyUsageSnapshot));
+    if (data)
+    {
+        setProperty("Key usage", data);
+        data->release();
+    }
+    IOFree(usage, sizeof(KeyUsageSnapshot));
+}
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 bool GenericPS2Keyboard::start(IOService * provider)
@@ -140,16 +778,68 @@ bool GenericPS2Keyboard::start(IOService * provider)
     _device = (ApplePS2KeyboardDevice *)provider;
     _device->retain();
     
+    _suppressTypematic = (kOSBooleanTrue == getProperty("Suppress typematic repeat"));
+    setCaptureEnabled(kOSBooleanTrue == getProperty("Capture scan codes"));
+    
+    //
+    // Compile the re-mapping settings into the key translation tables.
+    //
+    _config = buildConfig(0);
+    if (!_config)
+    {
+        _device->release();
+        _device = 0;
+        return false;
+    }
+    _translator.setTables(_config->tables, _config->layerCount,
+                          _config->debounced ? _config->debounce : 0);
+    _configLayers = _config->layerCount;
+    _configsApplied++;
+    
+    //
+    // Create the work loop that consumes the scan codes our interrupt handler
+    // queues.
+    //
+    
+    _scancodeRing.reset();
+    _workLoop       = IOWorkLoop::workLoop();
+    _scancodeSource = IOInterruptEventSource::interruptEventSource(this,
+                          OSMemberFunctionCast(IOInterruptEventSource::Action, this, &GenericPS2Keyboard::scancodesAvailable));
+    
+    _startTimer     = IOTimerEventSource::timerEventSource(this,
+                          OSMemberFunctionCast(IOTimerEventSource::Action, this, &GenericPS2Keyboard::startTimerFired));
+    _tapHoldTimer   = IOTimerEventSource::timerEventSource(this,
+                          OSMemberFunctionCast(IOTimerEventSource::Action, this, &GenericPS2Keyboard::tapHoldTimerFired));
+    _anomalyTimer   = IOTimerEventSource::timerEventSource(this,
+                          OSMemberFunctionCast(IOTimerEventSource::Action, this, &GenericPS2Keyboard::anomalyTimerFired));
+    _systemActionSource = IOInterruptEventSource::interruptEventSource(this,
+                          OSMemberFunctionCast(IOInterruptEventSource::Action, this, &GenericPS2Keyboard::systemActionsPending));
+    
+    if (!_workLoop || !_scancodeSource || !_startTimer || !_tapHoldTimer || !_anomalyTimer ||
+        !_systemActionSource ||
+        _workLoop->addEventSource(_scancodeSource) != kIOReturnSuccess ||
+        _workLoop->addEventSource(_startTimer) != kIOReturnSuccess ||
+        _workLoop->addEventSource(_tapHoldTimer) != kIOReturnSuccess ||
+        _workLoop->addEventSource(_anomalyTimer) != kIOReturnSuccess ||
+        _workLoop->addEventSource(_systemActionSource) != kIOReturnSuccess)
+    {
+        releaseWorkLoop();
+        _device->release();
+        _device = 0;
+        return false;
+    }
+    _scancodeSource->enable();
+    _systemActionSource->enable();
+    
     //
-    // Fetch some re-mapping settings.
+    // Preallocate the requests for our asynchronous commands.
     //
-    _capslockKeyCode = OSDynamicCast(OSNumber, getProperty("Map capslock to keycode"))->unsigned32BitValue();
-    _windowsAltSwap = (kOSBooleanTrue == getProperty("Swap alt and windows key"));
-    _remapFunctionKeys = (kOSBooleanTrue == getProperty("Remap function keys"));
     
-    // Keep track of these to emulate 'fn' keys.
-    _insertKeyDown = false;
-    _applicationKeyDown = false;
+    for (int index = 0; index < kRequestPoolSize; index++)
+    {
+        _requestPool[index] = _device->allocateRequest();
+        if (_requestPool[index])  _requestPoolFree |= 1 << index;
+    }
     
     //
     // Install our driver's interrupt handler, for asynchronous data delivery.
@@ -159,24 +849,11 @@ bool GenericPS2Keyboard::start(IOService * provider)
     _interruptHandlerInstalled = true;
     
     //
-    // Initialize the keyboard LED state.
+    // Check for the keyboard, set up the LEDs, typematic rate and controller,
+    // and enable the keyboard, without waiting for any of it.
     //
     
-    setLEDs(_ledState);
-    
-    //
-    // Enable the keyboard clock (should already be so), the keyboard IRQ line,
-    // and the keyboard Kscan -> scan code translation mode.
-    //
-    
-    setCommandByte(kCB_EnableKeyboardIRQ | kCB_TranslateMode,
-                   kCB_DisableKeyboardClock);
-    
-    //
-    // Finally, we enable the keyboard itself, so that it may start reporting
-    // key events.
-    //
-    setKeyboardEnable(true);
+    startKeyboard();
     
     //
     // Install our power control handler.
@@ -202,6 +879,12 @@ void GenericPS2Keyboard::stop(IOService * provider)
     
     assert(_device == provider);
     
+    //
+    // Abandon the bring-up sequence, if it is still going.
+    //
+    
+    _startState = kStartStateStopped;
+    
     //
     // Disable the keyboard itself, so that it may stop reporting key events.
     //
@@ -228,6 +911,41 @@ void GenericPS2Keyboard::stop(IOService * provider)
     if ( _powerControlHandlerInstalled ) _device->uninstallPowerControlAction();
     _powerControlHandlerInstalled = false;
     
+    //
+    // Tear down the scan code consumer, now that nothing can queue to it.
+    //
+    
+    releaseWorkLoop();
+    
+    //
+    // Free the request pool.  The blocking setCommandByte above queues behind
+    // our asynchronous requests, so normally all are back in the pool; give
+    // any stragglers (eg. an LED update resubmitted by its completion) a
+    // moment to come home.  One that never does is leaked rather than freed
+    // under the controller's feet.  Deferred commands are dropped; the
+    // keyboard is going away.
+    //
+    
+    UInt32 poolFull = 0;
+    
+    for (int index = 0; index < kRequestPoolSize; index++)
+        if (_requestPool[index])  poolFull |= 1 << index;
+    
+    _requestsDeferred = 0;
+    for (int wait = 0; wait < 50 && _requestPoolFree != poolFull; wait++)
+        IOSleep(2);
+    
+    if (_requestPoolFree != poolFull)
+        IOLog("%s: request still outstanding at stop\n", getName());
+    
+    for (int index = 0; index < kRequestPoolSize; index++)
+    {
+        if (_requestPoolFree & (1 << index))  _device->freeRequest(_requestPool[index]);
+        _requestPool[index] = 0;
+    }
+    _requestPoolFree  = 0;
+    _requestsDeferred = 0;
+    
     //
     // Release the pointer to the provider object.
     //
@@ -240,242 +958,1180 @@ void GenericPS2Keyboard::stop(IOService * provider)
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-void GenericPS2Keyboard::interruptOccurred(UInt8 scanCode)   // PS2InterruptAction
+void GenericPS2Keyboard::releaseWorkLoop()
 {
-    //
-    // This will be invoked automatically from our device when asynchronous
-    // keyboard data needs to be delivered.  Process the keyboard data.  Do
-    // NOT send any BLOCKING commands to our device in this context.
-    //
+    if (_systemActionSource)
+    {
+        _systemActionSource->disable();
+        if (_workLoop)  _workLoop->removeEventSource(_systemActionSource);
+        _systemActionSource->release();
+        _systemActionSource = 0;
+    }
     
-    if (scanCode == kSC_Acknowledge)
-        IOLog("%s: Unexpected acknowledge from PS/2 controller.\n", getName());
-    else if (scanCode == kSC_Resend)
-        IOLog("%s: Unexpected resend request from PS/2 controller.\n", getName());
-    else
-        dispatchKeyboardEventWithScancode(scanCode);
+    if (_anomalyTimer)
+    {
+        //
+        // Leave it armed for good, so that late completions don't touch it.
+        //
+        
+        _anomalyLogArmed = 1;
+        __sync_synchronize();
+        _anomalyTimer->cancelTimeout();
+        if (_workLoop)  _workLoop->removeEventSource(_anomalyTimer);
+        _anomalyTimer->release();
+        _anomalyTimer = 0;
+    }
+    
+    if (_tapHoldTimer)
+    {
+        _tapHoldTimer->cancelTimeout();
+        if (_workLoop)  _workLoop->removeEventSource(_tapHoldTimer);
+        _tapHoldTimer->release();
+        _tapHoldTimer = 0;
+    }
+    
+    if (_startTimer)
+    {
+        _startTimer->cancelTimeout();
+        if (_workLoop)  _workLoop->removeEventSource(_startTimer);
+        _startTimer->release();
+        _startTimer = 0;
+    }
+    
+    if (_scancodeSource)
+    {
+        _scancodeSource->disable();
+        if (_workLoop)  _workLoop->removeEventSource(_scancodeSource);
+        _scancodeSource->release();
+        _scancodeSource = 0;
+    }
+    
+    if (_workLoop)
+    {
+        _workLoop->release();
+        _workLoop = 0;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void GenericPS2Keyboard::noteAnomaly(UInt32 anomaly)
+{
+    //
+    // Counts an anomaly, and makes sure a summary will be logged.  Safe from
+    // any context but the interrupt action, which only increments the count.
+    //
+    
+    OSIncrementAtomic(&_anomalies[anomaly]);
+    armAnomalyLog();
+}
+
+void GenericPS2Keyboard::armAnomalyLog()
+{
+    if (OSCompareAndSwap(0, 1, &_anomalyLogArmed))
+        _anomalyTimer->setTimeoutMS(kAnomalyLogDelayMS);
+}
+
+void GenericPS2Keyboard::anomalyTimerFired(IOTimerEventSource *)
+{
+    //
+    // Logs the anomalies counted since the last summary, if any, and waits
+    // out the rest of the interval before the next one.  Once an interval
+    // passes without any, the timer is disarmed until the next anomaly.
+    //
+    
+    char   summary[256];
+    UInt32 length = 0;
+    
+    for (int index = 0; index < kAnomalyCount; index++)
+    {
+        UInt32 count = (UInt32)_anomalies[index] - _anomaliesLogged[index];
+        
+        if (!count)  continue;
+        _anomaliesLogged[index] += count;
+        if (length < sizeof(summary))
+            length += snprintf(summary + length, sizeof(summary) - length, "%s%s %u",
+                               length ? ", " : "", kAnomalyNames[index], (unsigned)count);
+    }
+    
+    if (length)
+    {
+        IOLog("%s: %s.\n", getName(), summary);
+        _anomalyTimer->setTimeoutMS(kAnomalyLogIntervalMS);
+        return;
+    }
+    
+    //
+    // Anything counted after we looked, but before we disarmed, saw us still
+    // armed; look again.
+    //
+    
+    _anomalyLogArmed = 0;
+    __sync_synchronize();
+    for (int index = 0; index < kAnomalyCount; index++)
+    {
+        if ((UInt32)_anomalies[index] != _anomaliesLogged[index])
+        {
+            armAnomalyLog();
+            break;
+        }
+    }
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-bool GenericPS2Keyboard::dispatchKeyboardEventWithScancode(UInt8 scanCode)
+void GenericPS2Keyboard::interruptOccurred(UInt8 scanCode)   // PS2InterruptAction
+{
+    //
+    // This will be invoked automatically from our device when asynchronous
+    // keyboard data needs to be delivered.  Do NOT send any BLOCKING commands
+    // to our device in this context.
+    //
+    // All we do here is note when the byte arrived and queue it; the work
+    // loop does the rest in scancodesAvailable.
+    //
+    
+    UInt64 now;
+    
+    clock_get_uptime(&now);
+    if (_captureEnabled)
+        _capture->record(scanCode, now);
+    if (!_scancodeRing.push(scanCode, now))
+        OSIncrementAtomic(&_anomalies[kAnomalyRingOverflow]);
+    _scancodeSource->interruptOccurred(0, 0, 0);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void GenericPS2Keyboard::scancodesAvailable(IOInterruptEventSource *, int)
+{
+    //
+    // Drains the scan code ring, a batch at a time, on our work loop.  The
+    // per-byte path is specialised for the settings it would otherwise test
+    // on every byte; we pick the specialisation for the configuration once,
+    // and it only changes here, between batches.
+    //
+    
+    ScancodeRingEntry batch[kScancodeBatchSize];
+    UInt32            count;
+    
+    if (_pendingConfig)  adoptPendingConfig();
+    
+    while ((count = _scancodeRing.pop(batch, kScancodeBatchSize)))
+    {
+        if (_config->debounced)
+            dispatchScancodes<true>(batch, count);
+        else
+            dispatchScancodes<false>(batch, count);
+    }
+    
+    //
+    // The interrupt action can't arm the log timer itself.
+    //
+    
+    if ((UInt32)_anomalies[kAnomalyRingOverflow] != _anomaliesLogged[kAnomalyRingOverflow])
+        armAnomalyLog();
+}
+
+template <bool Debounced>
+void GenericPS2Keyboard::dispatchScancodes(const ScancodeRingEntry * batch, UInt32 count)
+{
+    for (UInt32 index = 0; index < count; index++)
+    {
+        //
+        // The next byte, whatever it is, consumes a reset expected by a
+        // command completion; an exchange, since a completion may set it
+        // again at any time.  Only bytes that find it set pay for that.
+        //
+        
+        UInt8 scanCode      = batch[index].scanCode;
+        bool  resetExpected = _resetExpected && OSCompareAndSwap(1, 0, &_resetExpected);
+        
+        if (scanCode == kSC_Acknowledge)
+            noteAnomaly(kAnomalyAcknowledge);
+        else if (scanCode == kSC_Resend)
+            noteAnomaly(kAnomalyResend);
+        else if (scanCode == kSC_Overrun || scanCode == kSC_OverrunSet1)
+        {
+            noteAnomaly(kAnomalyOverrun);
+            releaseAllKeys(0);
+            _resetExpected = 1;
+        }
+        else if (scanCode == kSC_Reset && resetExpected && _translator.sequenceIdle() &&
+                 !_translator.isKeyDown(kSC_ShiftLeft))
+        {
+            //
+            // AA is also a left shift release, so we only take it for the
+            // keyboard resetting itself straight after an overrun or a
+            // command it didn't acknowledge, outside a sequence and with
+            // left shift up.  It has lost its LED and typematic settings,
+            // as well as our keys.
+            //
+            
+            noteAnomaly(kAnomalyReset);
+            releaseAllKeys(0);
+            setLEDs(_ledState);
+            if (_suppressTypematic)  setKeyboardTypematic(kTypematicSlowest);
+        }
+        else
+            dispatchKeyboardEventWithScancode<Debounced>(scanCode, *(AbsoluteTime *)&batch[index].time);
+    }
+}
+
+template <bool Debounced>
+bool GenericPS2Keyboard::dispatchKeyboardEventWithScancode(UInt8 scanCode, AbsoluteTime arrival)
 {
     //
     // Parses the given scan code, updating all necessary internal state, and
     // should a new key be detected, the key event is dispatched.
     //
+    // The arrival time is when the byte arrived from the keyboard.  Events
+    // are time stamped with the arrival of the first byte of their sequence.
+    //
     // Returns true if a key event was indeed dispatched.
     //
     
-    unsigned int keyCode;
-    bool         goingDown;
-    AbsoluteTime now;
+    KeyEvent           event;
+    AbsoluteTime       now;
+    UInt64             dispatched;
+    UInt32             type;
+    
+    if (_translator.sequenceIdle())
+        _sequenceStart = *(UInt64 *)&arrival;
+    
+    switch ((type = _translator.translate<Debounced>(scanCode, *(UInt64 *)&arrival, &event)))
+    {
+        case kKeyEventKey:
+        case kKeyEventLayer:
+            break;
+            
+        case kKeyEventRepeat:
+            _repeatsDiscarded++;
+            return false;
+            
+        case kKeyEventUnknown:
+            noteAnomaly(kAnomalyUnknownExtended);
+            return false;
+            
+        case kKeyEventChatter:
+            _chatterSuppressed[event.keyCode]++;
+            _chatterTotal++;
+            return false;
+            
+        default:
+            return false;
+    }
+    
+    *(UInt64 *)&now = _sequenceStart;
     
     //
-    // See if this scan code introduces an extended key sequence.  If so, note
-    // it and then return.  Next time we get a key we'll finish the sequence.
+    // Count the key's use, layer keys included.  The translator only passes
+    // on releases of keys that are down, and a flush clears the key's press
+    // time.
     //
     
-    if (scanCode == kSC_Extend)
+    if (event.goingDown)
     {
-        _extendCount = 1;
-        return false;
+        _keyDownTime[event.keyCode] = _sequenceStart;
+        _keyPresses[event.keyCode]++;
+    }
+    else if (_keyDownTime[event.keyCode])
+    {
+        UInt64 held = _sequenceStart - _keyDownTime[event.keyCode];
+        
+        _keyHeld[event.keyCode]    += held;
+        _keyDownTime[event.keyCode] = 0;
+        if (_typematicSuppressed)  countAvoidedRepeats(held);
     }
     
     //
-    // See if this scan code introduces an extended key sequence for the Pause
-    // Key.  If so, note it and then return.  The next time we get a key, drop
-    // it.  The next key we get after that finishes the Pause Key sequence.
+    // A layer key has already changed the layers; there is nothing for our
+    // superclass.
     //
-    // The sequence actually sent to us by the keyboard for the Pause Key is:
+    
+    if (type == kKeyEventLayer)  return true;
+    
     //
-    // 1. E1  Extended Sequence for Pause Key
-    // 2. 1D  Useless Data, with Up Bit Cleared
-    // 3. 45  Pause Key, with Up Bit Cleared
-    // 4. E1  Extended Sequence for Pause Key
-    // 5. 9D  Useless Data, with Up Bit Set
-    // 6. C5  Pause Key, with Up Bit Set
+    // We have a valid key event -- dispatch it to our superclass.
     //
-    // The reason items 4 through 6 are sent with the Pause Key is because the
-    // keyboard hardware never generates a release code for the Pause Key and
-    // the designers are being smart about it.  The sequence above translates
-    // to this parser as two separate events, as it should be -- one down key
-    // event and one up key event (for the Pause Key).
+    
+    clock_get_uptime(&dispatched);
+    _sequenceLatency.record(*(UInt64 *)&arrival - _sequenceStart);
+    _dispatchLatency.record(dispatched - *(UInt64 *)&arrival);
+    
+    dispatchKey(event, now, false);
+    
+    return true;
+}
+
+void GenericPS2Keyboard::dispatchKey(const KeyEvent & event, AbsoluteTime time, bool flushing)
+{
     //
+    // Decides dual-role keys, then dispatches.  A dual-role key sends nothing
+    // when pressed; we wait to see whether it is a tap or a hold.  Releases
+    // while flushing can't be taps, since the key may still be down.
+    //
+    
+    UInt64 now = *(UInt64 *)&time;
     
-    if (scanCode == kSC_Pause)
+    if (event.translation & kKeyTranslateTapHold)
     {
-        _extendCount = 2;
-        return false;
+        if (event.goingDown)
+        {
+            UInt32 index = KEY_TRANSLATE_ADB(event.translation);
+            
+            if (_tapHoldKey != KBV_NUM_KEYCODES)
+            {
+                _holdsByKey++;
+                resolveTapHold(true, now);
+            }
+            if (index >= _config->tapHoldCount)  return;
+            
+            UInt64 deadline;
+            
+            _tapHoldKey     = event.keyCode;
+            _tapHold        = _config->tapHolds[index];
+            _tapHoldPressed = now;
+            deadline        = now + _tapHold.holdAfter;
+            _tapHoldTimer->wakeAtTime(*(AbsoluteTime *)&deadline);
+        }
+        else if (_tapHoldKey == event.keyCode)
+        {
+            if (flushing)
+            {
+                _tapHoldTimer->cancelTimeout();
+                _tapHoldKey = KBV_NUM_KEYCODES;
+            }
+            else
+            {
+                resolveTapHold(false, now);
+            }
+        }
+        else if (_tapHoldHolding[event.keyCode])
+        {
+            dispatchTranslatedKey(_tapHoldHolding[event.keyCode], false, time);
+            _tapHoldHolding[event.keyCode] = 0;
+        }
+        return;
     }
     
     //
-    // Convert the scan code into a key code.
+    // Pressing another key decides the undecided dual-role key as held,
+    // however briefly it has been down.
     //
     
-    if (_extendCount == 0)
+    if (event.goingDown && _tapHoldKey != KBV_NUM_KEYCODES)
     {
-        keyCode = scanCode & ~ kSC_UpBit;
-        switch (keyCode) {
-            case 0x38: if (_windowsAltSwap) { keyCode = 0x70; }; break; // left alt -> left command
-            case 0x6a: if (_windowsAltSwap) { keyCode = 0x71; }; break; // right alt -> right command
-        }
+        _holdsByKey++;
+        resolveTapHold(true, now);
+    }
+    
+    dispatchTranslatedKey(event.translation, event.goingDown, time);
+}
+
+void GenericPS2Keyboard::resolveTapHold(bool hold, UInt64 now)
+{
+    //
+    // Decides the undecided dual-role key.  A hold presses the hold key, as of
+    // when the dual-role key was pressed; it is released along with it.  A tap
+    // (at release) presses and releases the tap key.
+    //
+    
+    _tapHoldTimer->cancelTimeout();
+    _tapHoldLatency.record(now - _tapHoldPressed);
+    
+    if (hold)
+    {
+        _tapHoldHolding[_tapHoldKey] = _tapHold.hold;
+        dispatchTranslatedKey(_tapHold.hold, true, *(AbsoluteTime *)&_tapHoldPressed);
     }
     else
     {
-        _extendCount--;
-        if (_extendCount)  return false;
+        _taps++;
+        dispatchTranslatedKey(_tapHold.tap, true, *(AbsoluteTime *)&_tapHoldPressed);
+        dispatchTranslatedKey(_tapHold.tap, false, *(AbsoluteTime *)&now);
+    }
+    
+    _tapHoldKey = KBV_NUM_KEYCODES;
+}
+
+void GenericPS2Keyboard::tapHoldTimerFired(IOTimerEventSource *)
+{
+    //
+    // The undecided dual-role key has been down long enough to be a hold.
+    //
+    
+    UInt64 now;
+    
+    if (_tapHoldKey == KBV_NUM_KEYCODES)  return;
+    
+    clock_get_uptime((AbsoluteTime *)&now);
+    _holdsByTime++;
+    resolveTapHold(true, now);
+}
+
+void GenericPS2Keyboard::dispatchTranslatedKey(KeyTranslation translation, bool goingDown,
+                                               AbsoluteTime time)
+{
+    //
+    // Keep event times monotonic, even when a flush (stamped with the current
+    // time) overtakes key events still waiting in the ring.
+    //
+    
+    if (*(UInt64 *)&time < _lastEventTime)
+        *(UInt64 *)&time = _lastEventTime;
+    _lastEventTime = *(UInt64 *)&time;
+    
+    if (translation & kKeyTranslateSystem)
+    {
+        if (goingDown)  queueSystemAction(KEY_TRANSLATE_ADB(translation), _lastEventTime);
+        return;
+    }
+    
+    if (translation & kKeyTranslateMacro)
+    {
+        UInt32         count;
+        const UInt16 * step = _config->macros.sequence(KEY_TRANSLATE_ADB(translation), goingDown, &count);
         
-        //
-        // Convert certain extended codes on the PC keyboard into single scancodes.
-        // Refer to the conversion table in defaultKeymapOfLength.
-        //
-        switch (scanCode & ~kSC_UpBit)
-        {
-            case 0x1D: keyCode = 0x60; break;            // ctrl
-            case 0x38: keyCode = 0x61; break;            // right alt (may become right command)
-            case 0x1C: keyCode = 0x62; break;            // enter
-            case 0x35: keyCode = 0x63; break;            // /
-            case 0x48: keyCode = 0x64; break;            // up arrow
-            case 0x50: keyCode = 0x65; break;            // down arrow
-            case 0x4B: keyCode = 0x66; break;            // left arrow
-            case 0x4D: keyCode = 0x67; break;            // right arrow
-            case 0x52: keyCode = 0x68; break;            // insert
-            case 0x53: keyCode = 0x69; break;            // delete
-            case 0x49: keyCode = 0x6A; break;            // page up
-            case 0x51: keyCode = 0x6B; break;            // page down
-            case 0x47: keyCode = 0x6C; break;            // home
-            case 0x4F: keyCode = 0x6D; break;            // end
-            case 0x37: keyCode = 0x6E; break;            // PrintScreen
-            case 0x45: keyCode = 0x6F; break;            // Pause
-            case 0x5D: keyCode = 0x72; break;            // Application
-            case 0x5B: // Left Windows/Command
-                if (_windowsAltSwap)
-                {
-                    keyCode = 0x38; // left alt
-                } else {
-                    keyCode = 0x70; // left command
-                }
-                break;
-            case 0x5c: // Right Windows/Command
-                if (_windowsAltSwap)
-                {
-                    keyCode = 0x6a; // right alt
-                } else {
-                    keyCode = 0x71; // right command
-                }
-                break;
-            // scancodes from running showkey -s (under Linux) for extra keys on keyboard
-            case 0x30: keyCode = 0x7d; break;		     // E030 = volume up
-            case 0x2e: keyCode = 0x7e; break;		     // E02E = volume down
-            case 0x20: keyCode = 0x7f; break;		     // E020 = volume mute
-            case 0x5e: keyCode = 0x7c; break;            // E05E = power
-            case 0x5f:                                   // E05F = sleep
-                keyCode = 0;
-                if (!(scanCode & kSC_UpBit))
-                {
-                    IOPMrootDomain * rootDomain = getPMRootDomain();
-                    if (rootDomain)
-                        rootDomain->receivePowerNotification( kIOPMSleepNow );
-                }
-                break;
-
-            case 0x2A:             // header or trailer for PrintScreen
-            default: return false;
-        }
+        for (UInt32 index = 0; step && index < count; index++)
+            dispatchKeyboardEvent(step[index] & kKeyTranslateADBMask,
+                                  !(step[index] & kMacroStepUp), time);
+        return;
+    }
+    
+    dispatchKeyboardEvent( KEY_TRANSLATE_ADB(translation),
+                          /*direction*/ goingDown,
+                          /*timeStamp*/ time );
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void GenericPS2Keyboard::queueSystemAction(UInt32 action, UInt64 time)
+{
+    //
+    // Queues a system action pressed at the given time, unless it fired too
+    // recently.  Nothing is done here, in the middle of dispatching scan
+    // codes; the action runs once its event source gets the work loop.
+    //
+    
+    UInt64 debounce;
+    
+    if (action >= kSystemActionCount)  return;
+    
+    nanoseconds_to_absolutetime(kSystemActions[action].debounceMS * 1000000ULL, &debounce);
+    if (_systemActionTime[action] && time - _systemActionTime[action] < debounce)
+    {
+        _systemActionsSuppressed[action]++;
+        return;
     }
+    _systemActionTime[action] = time;
     
-    if (keyCode == 0)  return false;
+    OSBitOrAtomic(1 << action, &_systemActionsPending);
+    _systemActionSource->interruptOccurred(0, 0, 0);
+}
+
+void GenericPS2Keyboard::systemActionsPending(IOInterruptEventSource *, int)
+{
+    UInt32 pending = OSBitAndAtomic(0, &_systemActionsPending);
     
+    while (pending)
+    {
+        UInt32 action = __builtin_ctz(pending);
+        
+        pending &= pending - 1;
+        _systemActionsFired[action]++;
+        performSystemAction(action);
+    }
+}
+
+void GenericPS2Keyboard::performSystemAction(UInt32 action)
+{
     //
-    // Update our key bit vector, which maintains the up/down status of all keys.
+    // Lock is the standard control + command + Q shortcut, typed as of now.
     //
     
-    goingDown = !(scanCode & kSC_UpBit);
+    static const UInt8 lockKeys[] = { 0x3b, 0x37, 0x0c };
+    
+    IOPMrootDomain * rootDomain = getPMRootDomain();
+    AbsoluteTime     now;
     
-    if (goingDown)
+    switch (action)
     {
-        //
-        // Verify that this is not an autorepeated key -- discard it if it is.
-        //
+        case kSystemActionSleep:
+            if (rootDomain)  rootDomain->receivePowerNotification(kIOPMSleepNow);
+            break;
+            
+        case kSystemActionDisplaySleep:
+            if (rootDomain)  rootDomain->receivePowerNotification(kIOPMDisplaySleepNow);
+            break;
+            
+        case kSystemActionPower:
+            if (rootDomain)  rootDomain->receivePowerNotification(kIOPMPowerButton);
+            break;
+            
+        case kSystemActionLock:
+            clock_get_uptime(&now);
+            for (UInt32 index = 0; index < sizeof(lockKeys); index++)
+                dispatchTranslatedKey(lockKeys[index], true, now);
+            for (UInt32 index = sizeof(lockKeys); index > 0; index--)
+                dispatchTranslatedKey(lockKeys[index - 1], false, now);
+            break;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void GenericPS2Keyboard::releaseAllKeys(const char * reason)
+{
+    //
+    // Dispatches a key up for every key we believe is down, and abandons any
+    // partial sequence.  Used whenever the real key ups may never arrive --
+    // the keyboard was disabled or reset, or it dropped events -- since
+    // otherwise held modifiers would stick, and the next press of any held
+    // key would be taken for a repeat.  The reason, if any, is logged; the
+    // scan code path passes none, and counts an anomaly instead.
+    //
+    // Must be called on our work loop.
+    //
+    
+    _translator.abandonSequence();
+    releaseHeldKeys(reason);
+}
+
+void GenericPS2Keyboard::releaseHeldKeys(const char * reason)
+{
+    //
+    // The key ups alone, leaving a partial sequence to finish.  Must be called
+    // on our work loop.
+    //
+    
+    KeyEvent     event;
+    AbsoluteTime now;
+    UInt32       type;
+    UInt32       released = 0;
+    
+    clock_get_uptime(&now);
+    
+    while ((type = _translator.flush(&event)) != kKeyEventNone)
+    {
+        _keyDownTime[event.keyCode] = 0;
+        if (type != kKeyEventKey)  continue;
+        dispatchKey(event, now, true);
+        released++;
+    }
+    
+    _keyFlushes++;
+    _keysFlushed += released;
+    if (released && reason)
+        IOLog("%s: Released %u held keys (%s).\n", getName(), (unsigned)released, reason);
+}
+
+IOReturn GenericPS2Keyboard::releaseAllKeysGated(void * reason, void *, void *, void *)
+{
+    releaseAllKeys((const char *)reason);
+    return kIOReturnSuccess;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void GenericPS2Keyboard::applyKeyRemaps(OSDictionary *   remaps,
+                                        KeyTranslation * table,
+                                        KeyboardConfig * config)
+{
+    //
+    // Applies a remap dictionary, mapping key codes (the index into
+    // PS2ToADBMap, as a decimal or 0x-prefixed hex string) to ADB key codes,
+    // to macro or tap/hold dictionaries, or to system action names.
+    //
+    
+    OSCollectionIterator * iterator = remaps ? OSCollectionIterator::withCollection(remaps) : 0;
+    if (!iterator)  return;
+    
+    while (OSSymbol * key = OSDynamicCast(OSSymbol, iterator->getNextObject()))
+    {
+        OSObject *     value = remaps->getObject(key);
+        OSNumber *     number = OSDynamicCast(OSNumber, value);
+        OSDictionary * macro = OSDynamicCast(OSDictionary, value);
+        int            action = systemActionNamed(OSDynamicCast(OSString, value));
+        char *         end;
+        unsigned long  keyCode = strtoul(key->getCStringNoCopy(), &end, 0);
+        
+        if ((!number && !macro && action < 0) || *end || end == key->getCStringNoCopy() ||
+            keyCode >= KBV_NUM_KEYCODES ||
+            (number && number->unsigned32BitValue() > kKeyTranslateADBMask))
+        {
+            IOLog("%s: Ignoring invalid key remap %s.\n", getName(), key->getCStringNoCopy());
+            continue;
+        }
+        
+        if (number)
+        {
+            table[keyCode] = number->unsigned8BitValue();
+            continue;
+        }
+        
+        if (action >= 0)
+        {
+            table[keyCode] = kKeyTranslateSystem | action;
+            continue;
+        }
         
-        if (KBV_IS_KEYDOWN(keyCode, _keyBitVector))  return false;
+        if (macro->getObject("Tap") || macro->getObject("Hold"))
+        {
+            int index = addTapHold(macro, config);
+            if (index < 0)
+            {
+                IOLog("%s: Ignoring tap/hold for key %s.\n", getName(), key->getCStringNoCopy());
+                continue;
+            }
+            table[keyCode] = kKeyTranslateTapHold | index;
+            continue;
+        }
         
-        KBV_KEYDOWN(keyCode, _keyBitVector);
+        int index = addMacro(macro, &config->macros);
+        if (index < 0)
+        {
+            IOLog("%s: Ignoring macro for key %s.\n", getName(), key->getCStringNoCopy());
+            continue;
+        }
+        table[keyCode] = kKeyTranslateMacro | index;
+    }
+    iterator->release();
+}
+
+static UInt32 macroSteps(OSArray * keys, UInt16 * steps, UInt32 max, bool * valid)
+{
+    //
+    // Copies an array of ADB key codes, optionally with kMacroStepUp (256)
+    // added for releases, into steps.
+    //
+    
+    UInt32 count = keys ? keys->getCount() : 0;
+    
+    if (count > max)  *valid = false;
+    
+    for (UInt32 index = 0; *valid && index < count; index++)
+    {
+        OSNumber * step = OSDynamicCast(OSNumber, keys->getObject(index));
+        
+        if (!step || (step->unsigned32BitValue() & ~(kMacroStepUp | kKeyTranslateADBMask)))
+            *valid = false;
+        else
+            steps[index] = step->unsigned16BitValue();
+    }
+    
+    return count;
+}
+
+int GenericPS2Keyboard::addTapHold(OSDictionary * tapHold, KeyboardConfig * config)
+{
+    //
+    // Compiles a tap/hold dictionary: "Tap" and "Hold" ADB key codes, and
+    // optionally "Hold after (ms)".  Returns its index, or -1 if it is
+    // invalid or there are too many.
+    //
+    
+    OSNumber * tap       = OSDynamicCast(OSNumber, tapHold->getObject("Tap"));
+    OSNumber * hold      = OSDynamicCast(OSNumber, tapHold->getObject("Hold"));
+    OSNumber * holdAfter = OSDynamicCast(OSNumber, tapHold->getObject("Hold after (ms)"));
+    
+    if (!tap || !hold || config->tapHoldCount == kTapHoldMax ||
+        tap->unsigned32BitValue() > kKeyTranslateADBMask ||
+        hold->unsigned32BitValue() > kKeyTranslateADBMask)
+        return -1;
+    
+    KeyTapHold & entry = config->tapHolds[config->tapHoldCount];
+    
+    entry.tap  = tap->unsigned8BitValue();
+    entry.hold = hold->unsigned8BitValue();
+    nanoseconds_to_absolutetime((holdAfter ? holdAfter->unsigned32BitValue() : kTapHoldDefaultMS) * 1000000ULL,
+                                &entry.holdAfter);
+    
+    return config->tapHoldCount++;
+}
+
+int GenericPS2Keyboard::addMacro(OSDictionary * macro, KeyMacroArena * macros)
+{
+    //
+    // Compiles a macro dictionary into the arena.  "Keys" is the shorthand
+    // for a chord: the keys are pressed in order, and released in reverse.
+    // Otherwise "Down" and "Up" give the steps to run on press and release.
+    //
+    // Returns the macro's index, or -1 if it is invalid or doesn't fit.
+    //
+    
+    UInt16    down[kMacroMaxSequence];
+    UInt16    up[kMacroMaxSequence];
+    UInt32    downCount;
+    UInt32    upCount;
+    bool      valid = true;
+    OSArray * keys  = OSDynamicCast(OSArray, macro->getObject("Keys"));
+    
+    if (keys)
+    {
+        downCount = macroSteps(keys, down, kMacroMaxSequence, &valid);
+        upCount   = downCount;
+        for (UInt32 index = 0; valid && index < downCount; index++)
+        {
+            if (down[index] & kMacroStepUp)  valid = false;
+            up[downCount - 1 - index] = down[index] | kMacroStepUp;
+        }
     }
     else
     {
-        KBV_KEYUP(keyCode, _keyBitVector);
+        downCount = macroSteps(OSDynamicCast(OSArray, macro->getObject("Down")), down, kMacroMaxSequence, &valid);
+        upCount   = macroSteps(OSDynamicCast(OSArray, macro->getObject("Up")), up, kMacroMaxSequence, &valid);
     }
     
+    if (!valid)  return -1;
+    return macros->add(down, downCount, up, upCount);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void GenericPS2Keyboard::applyDebounce(KeyboardConfig * config, OSDictionary * changes)
+{
     //
-    // We have a valid key event -- dispatch it to our superclass.
+    // Compiles "Debounce (ms)" and the per-key overrides in "Debounce keys"
+    // (key codes, as in "Key remaps", to milliseconds) into the debounce
+    // windows.
     //
     
-    clock_get_uptime(reinterpret_cast<UInt64*>(&now));
+    OSNumber *             all      = OSDynamicCast(OSNumber, remapSetting(changes, "Debounce (ms)"));
+    OSDictionary *         keys     = OSDynamicCast(OSDictionary, remapSetting(changes, "Debounce keys"));
+    OSCollectionIterator * iterator = keys ? OSCollectionIterator::withCollection(keys) : 0;
+    UInt32                 window   = 0;
+    UInt64                 time;
     
-    UInt32 adbKeyCode = PS2ToADBMap[keyCode];
-    if (adbKeyCode == 0x39) {
-        adbKeyCode = _capslockKeyCode;
+    if (all && all->unsigned32BitValue() <= kDebounceMaxMS)
+    {
+        nanoseconds_to_absolutetime(all->unsigned32BitValue() * 1000000ULL, &time);
+        window = (UInt32)time;
     }
+    for (int keyCode = 0; keyCode < KBV_NUM_KEYCODES; keyCode++)
+        config->debounce[keyCode] = window;
+    config->debounced = (window != 0);
+    if (!iterator)  return;
     
-    if (_remapFunctionKeys)
+    while (OSSymbol * key = OSDynamicCast(OSSymbol, iterator->getNextObject()))
     {
-        // Abuse the not-so-useful Insert and Application keys to be fn keys
-        if (adbKeyCode == 0x72) // insert
+        OSNumber *    ms = OSDynamicCast(OSNumber, keys->getObject(key));
+        char *        end;
+        unsigned long keyCode = strtoul(key->getCStringNoCopy(), &end, 0);
+        
+        if (!ms || *end || end == key->getCStringNoCopy() || keyCode >= KBV_NUM_KEYCODES ||
+            ms->unsigned32BitValue() > kDebounceMaxMS)
         {
-            _insertKeyDown = goingDown;
-            return true;
+            IOLog("%s: Ignoring invalid debounce for key %s.\n", getName(), key->getCStringNoCopy());
+            continue;
         }
-        if (adbKeyCode == 0x6e) // application
+        
+        nanoseconds_to_absolutetime(ms->unsigned32BitValue() * 1000000ULL, &time);
+        config->debounce[keyCode] = (UInt32)time;
+        if (time)  config->debounced = true;
+    }
+    iterator->release();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void GenericPS2Keyboard::applyLayerKeys(OSArray *       keys,
+                                        KeyTranslation  layerKey,
+                                        KeyTranslation * activation)
+{
+    //
+    // Records the key codes in the given array as activating a layer.
+    //
+    
+    for (unsigned int index = 0; keys && index < keys->getCount(); index++)
+    {
+        OSNumber * keyCode = OSDynamicCast(OSNumber, keys->getObject(index));
+        
+        if (!keyCode || keyCode->unsigned32BitValue() >= KBV_NUM_KEYCODES)
         {
-            _applicationKeyDown = goingDown;
-            return true;
+            IOLog("%s: Ignoring invalid layer key.\n", getName());
+            continue;
         }
+        activation[keyCode->unsigned32BitValue()] = layerKey;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+OSObject * GenericPS2Keyboard::remapSetting(OSDictionary * changes, const char * key)
+{
+    //
+    // A remap setting as it will be once the given changes (if any) are
+    // applied to our properties.
+    //
+    
+    OSObject * value = changes ? changes->getObject(key) : 0;
+    
+    return value ? value : getProperty(key);
+}
+
+KeyboardConfig * GenericPS2Keyboard::buildConfig(OSDictionary * changes)
+{
+    //
+    // Compiles the re-mapping settings from our properties, with the given
+    // changes (if any) applied, into the key translation tables, one per
+    // layer.  Layer 0 is the base layer; if
+    // function keys are remapped, layer 1 is the emulated 'fn' layer, where
+    // they act as themselves; the entries of "Layers" follow.  Each of those
+    // is a dictionary with "Key remaps" overrides for the layer, and arrays
+    // of key codes in "Momentary keys" and "Toggle keys" to activate it.
+    //
+    // Do NOT issue this from the interrupt/completion context.
+    //
+    
+    OSNumber *       capslock          = OSDynamicCast(OSNumber, remapSetting(changes, "Map capslock to keycode"));
+    bool             windowsAltSwap    = (kOSBooleanTrue == remapSetting(changes, "Swap alt and windows key"));
+    bool             functionKeyRemap  = (kOSBooleanTrue == remapSetting(changes, "Remap function keys"));
+    OSArray *        layers            = OSDynamicCast(OSArray, remapSetting(changes, "Layers"));
+    UInt32           capslockKeyCode   = capslock ? capslock->unsigned32BitValue() : 0x39;
+    UInt32           firstUserLayer    = functionKeyRemap ? 2 : 1;
+    UInt32           layerCount        = firstUserLayer + (layers ? layers->getCount() : 0);
+    KeyTranslation   activation[KBV_NUM_KEYCODES];
+    KeyboardConfig * config;
+    KeyTranslation * tables;
+    KeyTranslation * base;
+    UInt32           size;
+    
+    if (layerCount > kKeymapMaxLayers)
+    {
+        IOLog("%s: Ignoring layers after the first %d.\n", getName(), kKeymapMaxLayers);
+        layerCount = kKeymapMaxLayers;
+    }
+    
+    size   = sizeof(KeyboardConfig) + layerCount * KBV_NUM_KEYCODES * sizeof(KeyTranslation);
+    config = (KeyboardConfig *)IOMalloc(size);
+    if (!config)  return 0;
+    
+    tables             = (KeyTranslation *)(config + 1);
+    config->size       = size;
+    config->layerCount = layerCount;
+    config->tables     = tables;
+    base               = tables;
+    
+    //
+    // The built-in Mission Control macro always comes first.
+    //
+    
+    static const UInt16 missionControlDown[] = { 0x3e, 0x7e };
+    static const UInt16 missionControlUp[]   = { 0x3e | kMacroStepUp, 0x7e | kMacroStepUp };
+    
+    config->macros.reset();
+    config->tapHoldCount = 0;
+    config->macros.add(missionControlDown, 2, missionControlUp, 2);
+    
+    for (int keyCode = 0; keyCode < KBV_NUM_KEYCODES; keyCode++)
+    {
+        int source = keyCode;
         
-        if (!(_insertKeyDown || _applicationKeyDown))
+        if (windowsAltSwap)
         {
-            adbKeyCode = remapFunctionKeys(adbKeyCode, goingDown);
-            if (adbKeyCode == kRemappedDeadKey)
+            switch (keyCode)
             {
-                return true;
+                case 0x38: source = 0x70; break; // left alt -> left command
+                case 0x70: source = 0x38; break; // left command -> left alt
+                case 0x61: source = 0x71; break; // right alt -> right command
+                case 0x71: source = 0x61; break; // right command -> right alt
             }
         }
+        
+        base[keyCode] = PS2ToADBMap[source];
+        if (base[keyCode] == 0x39)
+            base[keyCode] = capslockKeyCode;
+        activation[keyCode] = 0;
+    }
+    for (UInt32 index = 0; index < KeyboardLayouts[_layout].keyCount; index++)
+    {
+        const LayoutKey * key = &KeyboardLayouts[_layout].keys[index];
+        base[key->keyCode] = key->adbKeyCode;
     }
+    base[kKeyCodeSleep] = kKeyTranslateSystem | kSystemActionSleep;
     
+    applyKeyRemaps(OSDynamicCast(OSDictionary, remapSetting(changes, "Key remaps")), base, config);
+    applyDebounce(config, changes);
     
-    dispatchKeyboardEvent( adbKeyCode,
-                          /*direction*/ goingDown,
-                          /*timeStamp*/ now );
+    if (functionKeyRemap)
+    {
+        KeyTranslation * fn = tables + KBV_NUM_KEYCODES;
+        
+        for (int keyCode = 0; keyCode < KBV_NUM_KEYCODES; keyCode++)
+        {
+            fn[keyCode] = base[keyCode];
+            
+            // Abuse the not-so-useful Insert and Application keys to be fn keys
+            if (base[keyCode] == 0x72 || base[keyCode] == 0x6e) // insert, application
+                activation[keyCode] = kKeyTranslateLayerMomentary | 1;
+            else
+                base[keyCode] = remapFunctionKeys(base[keyCode]);
+        }
+    }
+    
+    for (UInt32 layer = firstUserLayer; layer < layerCount; layer++)
+    {
+        KeyTranslation * table    = tables + layer * KBV_NUM_KEYCODES;
+        OSDictionary *   settings = OSDynamicCast(OSDictionary, layers->getObject(layer - firstUserLayer));
+        
+        for (int keyCode = 0; keyCode < KBV_NUM_KEYCODES; keyCode++)
+            table[keyCode] = base[keyCode];
+        
+        if (!settings)  continue;
+        
+        applyKeyRemaps(OSDynamicCast(OSDictionary, settings->getObject("Key remaps")), table, config);
+        applyLayerKeys(OSDynamicCast(OSArray, settings->getObject("Momentary keys")),
+                       kKeyTranslateLayerMomentary | layer, activation);
+        applyLayerKeys(OSDynamicCast(OSArray, settings->getObject("Toggle keys")),
+                       kKeyTranslateLayerToggle | layer, activation);
+    }
+    
+    //
+    // Layer keys keep their meaning in every layer, so that they can always be
+    // released or toggled off again.
+    //
+    
+    for (UInt32 layer = 0; layer < layerCount; layer++)
+    {
+        KeyTranslation * table = tables + layer * KBV_NUM_KEYCODES;
+        
+        for (int keyCode = 0; keyCode < KBV_NUM_KEYCODES; keyCode++)
+            if (activation[keyCode])  table[keyCode] = activation[keyCode];
+    }
+    
+    return config;
+}
+
+void GenericPS2Keyboard::publishConfig(KeyboardConfig * config)
+{
+    //
+    // Hands a new configuration to the work loop.  If an earlier one is still
+    // waiting, it was never used, and is superseded.
+    //
+    
+    KeyboardConfig * superseded;
+    
+    do
+    {
+        superseded = _pendingConfig;
+    } while (!OSCompareAndSwapPtr(superseded, config, (void * volatile *)&_pendingConfig));
+    
+    if (superseded)  IOFree(superseded, superseded->size);
+    
+    //
+    // Have the work loop pick it up now, rather than on the next key press.
+    //
+    
+    if (_scancodeSource)  _scancodeSource->interruptOccurred(0, 0, 0);
+}
+
+void GenericPS2Keyboard::adoptPendingConfig()
+{
+    //
+    // Switches the work loop to the pending configuration and retires the old
+    // one.  Only the work loop may touch _config; other threads see the
+    // scalars copied out of it here.  Must be called on our work loop.
+    //
+    
+    KeyboardConfig * config;
+    
+    do
+    {
+        config = _pendingConfig;
+    } while (!OSCompareAndSwapPtr(config, 0, (void * volatile *)&_pendingConfig));
+    
+    if (!config)  return;
+    
+    //
+    // A held key's release goes through the translation, and its macro, it
+    // was pressed with; those belong to the old configuration, so release
+    // everything while it is still in place.  A sequence the keyboard is
+    // part way through finishes in the new one.
+    //
+    
+    releaseHeldKeys("configuration changed");
+    
+    _translator.setTables(config->tables, config->layerCount,
+                          config->debounced ? config->debounce : 0);
+    if (_config)  IOFree(_config, _config->size);
+    _config       = config;
+    _configLayers = config->layerCount;
+    _configsApplied++;
+}
+
+KeyTranslation GenericPS2Keyboard::remapFunctionKeys(UInt32 adbKeyCode)
+{  
+    switch(adbKeyCode)
+    {
+        case 0x7a: return  0x91; // F1 -> Brightness down
+        case 0x78: return  0x90; // F2 -> Brightness up
+        case 0x63: return kKeyTranslateMacro | kMacroMissionControl; // F3 -> Mission Control
+        case 0x76: return 0x6f; // F4 -> F12 (== dashboard)
+        /* case 0x60: */ // F5 -> F5 (or keyboard backlight down on an internal keyboard)
+        /* case 0x61: */ // F6 -> F6 (keyboard backlight up)
+        case 0x62: return kSpecialPrevious; // F7
+        case 0x64: return kSpecialPlay; // F8
+        case 0x65: return kSpecialNext; // F9
+        case 0x6d: return 0x4a; // F10 -> Mute
+        case 0x67: return 0x49; // F11 -> Volume Down
+        case 0x6f: return 0x48; // F12 -> Volume Up
+        default:
+            return adbKeyCode;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+PS2Request * GenericPS2Keyboard::requestWithCommands(const PS2Command *  commands,
+                                                     UInt8               count,
+                                                     PS2CompletionAction completion)
+{
+    //
+    // Takes a request from the pool and fills it in from a command template.
+    // The completion routine, or requestCompleted if none is given, must hand
+    // the request back to recycleRequest.  Returns 0 if the pool is empty;
+    // we never fall back to allocateRequest, which may block.
+    //
+    // It is safe to issue this request from the interrupt/completion context.
+    //
+    
+    PS2Request * request = 0;
+    UInt32       free;
+    
+    while ((free = _requestPoolFree))
+    {
+        UInt32 index = __builtin_ctz(free);
+        if (OSCompareAndSwap(free, free & ~(1 << index), &_requestPoolFree))
+        {
+            request = _requestPool[index];
+            break;
+        }
+    }
+    
+    if (!request)
+    {
+        OSIncrementAtomic(&_requestPoolMisses);
+        return 0;
+    }
+    
+    fillRequest(request, commands, count, completion);
+    return request;
+}
+
+void GenericPS2Keyboard::fillRequest(PS2Request *        request,
+                                     const PS2Command *  commands,
+                                     UInt8               count,
+                                     PS2CompletionAction completion)
+{
+    if (count)  memcpy(request->commands, commands, count * sizeof(PS2Command));
+    request->commandsCount    = count;
+    request->completionTarget = this;
+    request->completionAction = completion ? completion :
+                                    OSMemberFunctionCast(PS2CompletionAction, this,
+                                                         &GenericPS2Keyboard::requestCompleted);
+    request->completionParam  = request;
+}
+
+void GenericPS2Keyboard::recycleRequest(PS2Request * request)
+{
+    for (int index = 0; index < kRequestPoolSize; index++)
+    {
+        if (_requestPool[index] == request)
+        {
+            OSBitOrAtomic(1 << index, &_requestPoolFree);
+            if (_requestsDeferred)  runDeferredRequests();
+            return;
+        }
+    }
+    
+    _device->freeRequest(request);
+}
+
+void GenericPS2Keyboard::deferRequest(UInt32 deferred)
+{
+    //
+    // A request may have come back between our finding the pool empty and
+    // setting the bit, in which case its recycleRequest didn't see the bit.
+    //
+    
+    OSBitOrAtomic(deferred, &_requestsDeferred);
+    if (_requestPoolFree)  runDeferredRequests();
+}
+
+void GenericPS2Keyboard::runDeferredRequests()
+{
+    //
+    // Issues the deferred commands; any that still find the pool empty are
+    // deferred again.
+    //
+    // It is safe to issue this request from the interrupt/completion context.
+    //
+    
+    UInt32 deferred = OSBitAndAtomic(0, &_requestsDeferred);
+    
+    if (deferred & kDeferredEnable)     setKeyboardEnable(_deferredEnable);
+    if (deferred & kDeferredTypematic)  setKeyboardTypematic(_deferredTypematic);
+    if (deferred & kDeferredLEDs)       submitLEDs(_ledDeferred, 0);
+}
+
+void GenericPS2Keyboard::submitRequest(PS2Request * request)
+{
+    //
+    // All our requests go through here and submitRequestAndBlock, so that
+    // we can account for the traffic on the command path.
+    //
+    
+    OSIncrementAtomic(&_requestsSubmitted);
+    OSAddAtomic(request->commandsCount, &_commandsSubmitted);
+    _device->submitRequest(request);
+}
+
+bool GenericPS2Keyboard::submitRequestAndBlock(PS2Request * request)
+{
+    //
+    // Returns true if every command in the request completed.
+    //
+    // Do NOT issue this request from the interrupt/completion context.
+    //
+    
+    UInt8  count = request->commandsCount;
+    UInt64 started;
+    UInt64 finished;
+    
+    OSIncrementAtomic(&_requestsSubmitted);
+    OSAddAtomic(count, &_commandsSubmitted);
+    _requestsBlocking++;
+    
+    clock_get_uptime((AbsoluteTime *)&started);
+    _device->submitRequestAndBlock(request);
+    clock_get_uptime((AbsoluteTime *)&finished);
+    _blockingLatency.record(finished - started);
     
+    if (!requestSucceeded(request, count))
+    {
+        _requestsBlockingTruncated++;
+        return false;
+    }
     return true;
 }
 
-UInt32 GenericPS2Keyboard::remapFunctionKeys(UInt32 adbKeyCode, bool goingDown)
-{  
-    switch(adbKeyCode)
-    {
-        case 0x7a: return  0x91; // F1 -> Brightness down
-        case 0x78: return  0x90; // F2 -> Brightness up
-        case 0x63: // F3 -> Mission Control
-            // Eww....
-            AbsoluteTime now;
-            clock_get_uptime(reinterpret_cast<UInt64*>(&now));
-            dispatchKeyboardEvent(0x3e, goingDown, now); // 1. right control
-            dispatchKeyboardEvent(0x7e, goingDown, now); // 2. up arrow
-            return kRemappedDeadKey;
-        case 0x76: return 0x6f; // F4 -> F12 (== dashboard)
-        /* case 0x60: */ // F5 -> F5 (or keyboard backlight down on an internal keyboard)
-        /* case 0x61: */ // F6 -> F6 (keyboard backlight up)
-        case 0x62: return kSpecialPrevious; // F7
-        case 0x64: return kSpecialPlay; // F8
-        case 0x65: return kSpecialNext; // F9
-        case 0x6d: return 0x4a; // F10 -> Mute
-        case 0x67: return 0x49; // F11 -> Volume Down
-        case 0x6f: return 0x48; // F12 -> Volume Up
-        default:
-            return adbKeyCode;
-    }
+void GenericPS2Keyboard::requestCompleted(void * param)
+{
+    recycleRequest((PS2Request *)param);
+}
+
+bool GenericPS2Keyboard::requestSucceeded(PS2Request * request, UInt8 expected)
+{
+    //
+    // The controller stops a request at the first response that doesn't
+    // match, so a short commandsCount means a failed compare (or timeout).
+    //
+    
+    if (request->commandsCount == expected)  return true;
+    noteAnomaly(kAnomalyCommandFailed);
+    _resetExpected = 1;
+    return false;
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -513,22 +2169,93 @@ void GenericPS2Keyboard::setLEDs(UInt8 ledState)
     //
     // Asynchronously instructs the controller to set the keyboard LED state.
     //
+    // Only one set LEDs request is in flight at a time.  Newer states wait in
+    // a single pending slot, overwriting each other, so rapid toggling or a
+    // replay after wake can't queue up a backlog of redundant transactions
+    // in front of keyboard data.
+    //
     // It is safe to issue this request from the interrupt/completion context.
     //
     
-    PS2Request * request = _device->allocateRequest();
+    IOSimpleLockLock(_ledLock);
+    if (_ledRequestInFlight)
+    {
+        if (_ledPendingValid)  _ledRequestsElided++;
+        _ledPending      = ledState;
+        _ledPendingValid = true;
+        IOSimpleLockUnlock(_ledLock);
+        return;
+    }
+    _ledRequestInFlight = true;
+    IOSimpleLockUnlock(_ledLock);
+    
+    submitLEDs(ledState, 0);
+}
+
+void GenericPS2Keyboard::submitLEDs(UInt8 ledState, PS2Request * request)
+{
+    //
+    // Sends the LED state in the given request, one that just completed, or
+    // else in one from the pool.  The update stays in flight while deferred.
+    //
+    
+    PS2CompletionAction completion = OSMemberFunctionCast(PS2CompletionAction, this,
+                                                          &GenericPS2Keyboard::setLEDsCompleted);
+    
+    if (request)
+        fillRequest(request, kSetLEDsCommands, COMMAND_COUNT(kSetLEDsCommands), completion);
+    else
+        request = requestWithCommands(kSetLEDsCommands, COMMAND_COUNT(kSetLEDsCommands), completion);
+    
+    if (!request)
+    {
+        _ledDeferred = ledState;
+        deferRequest(kDeferredLEDs);
+        return;
+    }
     
     // (set LEDs command)
-    request->commands[0].command = kPS2C_WriteDataPort;
-    request->commands[0].inOrOut = kDP_SetKeyboardLEDs;
-    request->commands[1].command = kPS2C_ReadDataPortAndCompare;
-    request->commands[1].inOrOut = kSC_Acknowledge;
-    request->commands[2].command = kPS2C_WriteDataPort;
     request->commands[2].inOrOut = ledState;
-    request->commands[3].command = kPS2C_ReadDataPortAndCompare;
-    request->commands[3].inOrOut = kSC_Acknowledge;
-    request->commandsCount = 4;
-    _device->submitRequest(request); // asynchronous, auto-free'd
+    _ledRequestsSent++;
+    submitRequest(request);
+}
+
+void GenericPS2Keyboard::setLEDsCompleted(void * param)
+{
+    PS2Request * request = (PS2Request *)param;
+    bool         applied = requestSucceeded(request, COMMAND_COUNT(kSetLEDsCommands));
+    UInt8        ledState = request->commands[2].inOrOut;
+    
+    setLEDsFinished(ledState, applied, request);
+}
+
+void GenericPS2Keyboard::setLEDsFinished(UInt8 ledState, bool applied, PS2Request * request)
+{
+    //
+    // Issues the pending LED state, if any, unless the request that just
+    // finished already set the keyboard to that state.  The finished request,
+    // if we were given one, is reused for it or else recycled.
+    //
+    
+    bool resubmit = false;
+    
+    IOSimpleLockLock(_ledLock);
+    if (_ledPendingValid)
+    {
+        _ledPendingValid = false;
+        if (applied && _ledPending == ledState)
+            _ledRequestsElided++;
+        else
+            resubmit = true;
+        ledState = _ledPending;
+    }
+    _ledRequestInFlight = resubmit;
+    IOSimpleLockUnlock(_ledLock);
+    
+    if (resubmit)
+        submitLEDs(ledState, request);
+    else if (request)
+        recycleRequest(request);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -544,15 +2271,85 @@ void GenericPS2Keyboard::setKeyboardEnable(bool enable)
     // It is safe to issue this request from the interrupt/completion context.
     //
     
-    PS2Request * request = _device->allocateRequest();
+    PS2Request * request;
     
     // (keyboard enable/disable command)
-    request->commands[0].command = kPS2C_WriteDataPort;
-    request->commands[0].inOrOut = (enable)?kDP_Enable:kDP_SetDefaultsAndDisable;
-    request->commands[1].command = kPS2C_ReadDataPortAndCompare;
-    request->commands[1].inOrOut = kSC_Acknowledge;
-    request->commandsCount = 2;
-    _device->submitRequest(request); // asynchronous, auto-free'd
+    if (enable)
+        request = requestWithCommands(kEnableCommands, COMMAND_COUNT(kEnableCommands), 0);
+    else
+        request = requestWithCommands(kDisableCommands, COMMAND_COUNT(kDisableCommands), 0);
+    
+    if (!request)
+    {
+        _deferredEnable = enable;
+        deferRequest(kDeferredEnable);
+        return;
+    }
+    submitRequest(request); // asynchronous, recycled on completion
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void GenericPS2Keyboard::setKeyboardTypematic(UInt8 rateAndDelay)
+{
+    //
+    // Asynchronously sets the keyboard's typematic rate and delay.  Every
+    // typematic repeat costs a controller interrupt, only to be discarded by
+    // the autorepeat check, so slowing repeats down cuts that traffic while
+    // keys are held.  (Make/break-only reporting, kDP_SetAllMakeRelease, only
+    // exists in scan code set 3, which we don't decode.)
+    //
+    // It is safe to issue this request from the interrupt/completion context.
+    //
+    
+    PS2Request * request = requestWithCommands(kSetTypematicCommands, COMMAND_COUNT(kSetTypematicCommands),
+                               OSMemberFunctionCast(PS2CompletionAction, this,
+                                                    &GenericPS2Keyboard::setKeyboardTypematicCompleted));
+    
+    if (!request)
+    {
+        _deferredTypematic = rateAndDelay;
+        deferRequest(kDeferredTypematic);
+        return;
+    }
+    
+    // (set typematic rate/delay command)
+    request->commands[2].inOrOut = rateAndDelay;
+    submitRequest(request);
+}
+
+void GenericPS2Keyboard::setKeyboardTypematicCompleted(void * param)
+{
+    //
+    // If the keyboard didn't acknowledge the new rate, it keeps repeating at
+    // its default rate and we carry on discarding the repeats as before.
+    //
+    
+    PS2Request * request = (PS2Request *)param;
+    
+    _typematicSuppressed = (requestSucceeded(request, COMMAND_COUNT(kSetTypematicCommands)) &&
+                            request->commands[2].inOrOut != kTypematicDefault);
+    recycleRequest(request);
+}
+
+void GenericPS2Keyboard::countAvoidedRepeats(UInt64 heldTime)
+{
+    //
+    // Estimates how many repeats the keyboard would have sent for a key held
+    // this long at its default rate, compared to the rate we set.
+    //
+    
+    UInt64 heldMS;
+    UInt32 atDefault = 0;
+    UInt32 atSlowest = 0;
+    
+    absolutetime_to_nanoseconds(heldTime, &heldMS);
+    heldMS /= 1000000;
+    
+    if (heldMS > 500)   atDefault = (UInt32)((heldMS - 500) * 109 / 10000) + 1;   // 10.9 cps
+    if (heldMS > 1000)  atSlowest = (UInt32)((heldMS - 1000) * 2 / 1000) + 1;     // 2.0 cps
+    
+    _repeatsAvoided += atDefault - atSlowest;
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -570,16 +2367,20 @@ void GenericPS2Keyboard::setCommandByte(UInt8 setBits, UInt8 clearBits)
     UInt8        commandByte;
     UInt8        commandByteNew;
     PS2Request * request = _device->allocateRequest();
+    bool         retry   = false;
     
     do
     {
+        if (retry)  _commandByteRetries++;
+        retry = true;
+        
         // (read command byte)
         request->commands[0].command = kPS2C_WriteCommandPort;
         request->commands[0].inOrOut = kCP_GetCommandByte;
         request->commands[1].command = kPS2C_ReadDataPort;
         request->commands[1].inOrOut = 0;
         request->commandsCount = 2;
-        _device->submitRequestAndBlock(request);
+        submitRequestAndBlock(request);
         
         //
         // Modify the command byte as requested by caller.
@@ -598,7 +2399,7 @@ void GenericPS2Keyboard::setCommandByte(UInt8 setBits, UInt8 clearBits)
         request->commands[3].command = kPS2C_WriteDataPort;
         request->commands[3].inOrOut = commandByteNew;
         request->commandsCount = 4;
-        _device->submitRequestAndBlock(request);
+        submitRequestAndBlock(request);
         
         //
         // Repeat this loop if last command failed, that is, if the old command byte
@@ -608,120 +2409,352 @@ void GenericPS2Keyboard::setCommandByte(UInt8 setBits, UInt8 clearBits)
     } while (request->commandsCount != 4);  
     
     _device->freeRequest(request);
+    
+    _commandByte      = commandByteNew;
+    _commandByteValid = true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void GenericPS2Keyboard::resumeKeyboard()
+{
+    //
+    // Restores the keyboard LED state and typematic rate, enables the keyboard
+    // clock (should already be so), the keyboard IRQ line and the Kscan ->
+    // scan code translation mode, and finally enables the keyboard itself.
+    //
+    // The whole sequence is normally a single request; if it can't be, we
+    // issue the individual requests, which costs at least two more blocking
+    // round trips for the command byte.
+    //
+    // Do NOT issue this request from the interrupt/completion context.
+    //
+    
+    UInt64 started;
+    UInt64 finished;
+    
+    clock_get_uptime((AbsoluteTime *)&started);
+    
+    if (resumeKeyboardBatched())
+    {
+        _wakesBatched++;
+    }
+    else
+    {
+        _wakesFallenBack++;
+        setLEDs(_ledState);
+        if (_suppressTypematic)  setKeyboardTypematic(kTypematicSlowest);
+        setCommandByte(kCommandByteRunningSet, kCommandByteRunningClear);
+        setKeyboardEnable(true);
+    }
+    
+    clock_get_uptime((AbsoluteTime *)&finished);
+    _wakeLatency.record(finished - started);
+}
+
+bool GenericPS2Keyboard::resumeKeyboardBatched()
+{
+    //
+    // Issues the resume sequence as one request, built around our shadow of
+    // the command byte, and waits for it.  Returns false, having done
+    // nothing, if the shadow is unknown or out of date.
+    //
+    
+    PS2Request * request;
+    bool         success;
+    
+    if (!_commandByteValid)  return false;
+    
+    request = _device->allocateRequest();
+    prepareResume(request, _commandByte);
+    submitRequestAndBlock(request);
+    success = finishResume(request);
+    _device->freeRequest(request);
+    
+    return success;
+}
+
+void GenericPS2Keyboard::prepareResume(PS2Request * request, UInt8 commandByte)
+{
+    //
+    // Fills in the resume sequence.  The controller has no read-modify-write
+    // primitive, so the request reads the command byte back and compares it
+    // with the value we expect; if someone else (eg. the mouse driver, or the
+    // firmware on wake) changed it, the request stops right there, before it
+    // has changed anything.
+    //
+    
+    UInt8 commandByteNew = (commandByte | kCommandByteRunningSet) & ~kCommandByteRunningClear;
+    UInt8 count = 0;
+    
+    //
+    // The LEDs are only part of the batch if no update is in flight, since
+    // only one may be.  If one is, it will pick up the current state.
+    //
+    
+    IOSimpleLockLock(_ledLock);
+    _resumeSendsLEDs = !_ledRequestInFlight;
+    if (_resumeSendsLEDs)  _ledRequestInFlight = true;
+    IOSimpleLockUnlock(_ledLock);
+    
+    if (!_resumeSendsLEDs)  setLEDs(_ledState);
+    
+    // ("test-and-set" command byte)
+    request->commands[count].command   = kPS2C_WriteCommandPort;
+    request->commands[count++].inOrOut = kCP_GetCommandByte;
+    request->commands[count].command   = kPS2C_ReadDataPortAndCompare;
+    request->commands[count++].inOrOut = commandByte;
+    request->commands[count].command   = kPS2C_WriteCommandPort;
+    request->commands[count++].inOrOut = kCP_SetCommandByte;
+    request->commands[count].command   = kPS2C_WriteDataPort;
+    request->commands[count++].inOrOut = commandByteNew;
+    
+    if (_resumeSendsLEDs)
+    {
+        memcpy(&request->commands[count], kSetLEDsCommands, sizeof(kSetLEDsCommands));
+        request->commands[count + 2].inOrOut = _ledState;
+        count += COMMAND_COUNT(kSetLEDsCommands);
+    }
+    
+    if (_suppressTypematic)
+    {
+        memcpy(&request->commands[count], kSetTypematicCommands, sizeof(kSetTypematicCommands));
+        request->commands[count + 2].inOrOut = kTypematicSlowest;
+        count += COMMAND_COUNT(kSetTypematicCommands);
+    }
+    
+    memcpy(&request->commands[count], kEnableCommands, sizeof(kEnableCommands));
+    count += COMMAND_COUNT(kEnableCommands);
+    
+    request->commandsCount = count;
+}
+
+bool GenericPS2Keyboard::finishResume(PS2Request * request)
+{
+    //
+    // Accounts for a completed resume request.  The request is truncated at
+    // the first command that failed; if that was the command byte compare,
+    // we return false.  Otherwise anything not reached is retried on its own.
+    //
+    // It is safe to issue this request from the interrupt/completion context.
+    //
+    
+    UInt8 done        = request->commandsCount;
+    UInt8 ledsAt      = 4;
+    UInt8 typematicAt = ledsAt + (_resumeSendsLEDs ? COMMAND_COUNT(kSetLEDsCommands) : 0);
+    UInt8 enableAt    = typematicAt + (_suppressTypematic ? COMMAND_COUNT(kSetTypematicCommands) : 0);
+    
+    if (done < 4)
+    {
+        _commandByteValid = false;
+        if (_resumeSendsLEDs)  setLEDsFinished(_ledState, false, 0);
+        return false;
+    }
+    
+    _commandByte      = request->commands[3].inOrOut;
+    _commandByteValid = true;
+    
+    if (_resumeSendsLEDs)
+    {
+        _ledRequestsSent++;
+        setLEDsFinished(request->commands[ledsAt + 2].inOrOut,
+                        done >= ledsAt + COMMAND_COUNT(kSetLEDsCommands), 0);
+    }
+    
+    if (_suppressTypematic)
+    {
+        if (done >= enableAt)
+            _typematicSuppressed = true;
+        else
+            setKeyboardTypematic(kTypematicSlowest);
+    }
+    
+    if (done < enableAt + COMMAND_COUNT(kEnableCommands))
+    {
+        noteAnomaly(kAnomalyCommandFailed);
+        _resetExpected = 1;
+        setKeyboardEnable(true);
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool GenericPS2Keyboard::setStartState(UInt32 from, UInt32 to)
+{
+    //
+    // Moves the bring-up sequence on, unless something (stop, the timeout)
+    // moved it elsewhere first.
+    //
+    
+    return OSCompareAndSwap(from, to, &_startState);
+}
+
+void GenericPS2Keyboard::startKeyboard()
+{
+    //
+    // Each step of the sequence reuses the request of the step before, so
+    // the bring-up only ever takes one request from the pool.
+    //
+    
+    PS2Request * request;
+    UInt64       returned;
+    
+    clock_get_uptime((AbsoluteTime *)&_startTime);
+    _startRetries = 0;
+    _startState   = kStartStateEcho;
+    _startTimer->setTimeoutMS(kStartTimeoutMS);
+    
+    // (diagnostic echo command)
+    request = requestWithCommands(kTestEchoCommands, COMMAND_COUNT(kTestEchoCommands),
+                                  OSMemberFunctionCast(PS2CompletionAction, this,
+                                                       &GenericPS2Keyboard::startEchoCompleted));
+    if (request)
+        submitRequest(request);
+    else if (setStartState(kStartStateEcho, kStartStateFailed))
+        startFailed("no request for the echo");
+    
+    clock_get_uptime((AbsoluteTime *)&returned);
+    _startBlocked = returned - _startTime;
+}
+
+void GenericPS2Keyboard::startEchoCompleted(void * param)
+{
+    PS2Request * request = (PS2Request *)param;
+    bool         success = requestSucceeded(request, COMMAND_COUNT(kTestEchoCommands));
+    
+    if (!success)
+    {
+        recycleRequest(request);
+        if (setStartState(kStartStateEcho, kStartStateFailed))
+            startFailed("no response to echo");
+        return;
+    }
+    
+    if (setStartState(kStartStateEcho, kStartStateReadCommandByte))
+        startReadCommandByte(request);
+    else
+        recycleRequest(request);
+}
+
+void GenericPS2Keyboard::startReadCommandByte(PS2Request * request)
+{
+    fillRequest(request, kGetCommandByteCommands, COMMAND_COUNT(kGetCommandByteCommands),
+                OSMemberFunctionCast(PS2CompletionAction, this,
+                                     &GenericPS2Keyboard::startReadCommandByteCompleted));
+    submitRequest(request);
+}
+
+void GenericPS2Keyboard::startReadCommandByteCompleted(void * param)
+{
+    PS2Request * request     = (PS2Request *)param;
+    bool         success     = requestSucceeded(request, COMMAND_COUNT(kGetCommandByteCommands));
+    UInt8        commandByte = request->commands[1].inOrOut;
+    
+    if (!success)
+    {
+        recycleRequest(request);
+        if (setStartState(kStartStateReadCommandByte, kStartStateFailed))
+            startFailed("command byte read failed");
+        return;
+    }
+    
+    if (setStartState(kStartStateReadCommandByte, kStartStateResume))
+    {
+        fillRequest(request, 0, 0, OSMemberFunctionCast(PS2CompletionAction, this,
+                                                        &GenericPS2Keyboard::startResumeCompleted));
+        prepareResume(request, commandByte);
+        submitRequest(request);
+    }
+    else
+    {
+        recycleRequest(request);
+    }
+}
+
+void GenericPS2Keyboard::startResumeCompleted(void * param)
+{
+    PS2Request * request = (PS2Request *)param;
+    bool         success = finishResume(request);
+    UInt64       now;
+    
+    if (!success)
+    {
+        //
+        // The command byte changed between our read and our write; go round
+        // again.
+        //
+        
+        if (++_startRetries > kStartRetries)
+        {
+            recycleRequest(request);
+            if (setStartState(kStartStateResume, kStartStateFailed))
+                startFailed("command byte kept changing");
+        }
+        else if (setStartState(kStartStateResume, kStartStateReadCommandByte))
+        {
+            startReadCommandByte(request);
+        }
+        else
+        {
+            recycleRequest(request);
+        }
+        return;
+    }
+    
+    recycleRequest(request);
+    
+    if (setStartState(kStartStateResume, kStartStateRunning))
+    {
+        clock_get_uptime((AbsoluteTime *)&now);
+        _startDuration = now - _startTime;
+    }
+}
+
+void GenericPS2Keyboard::startFailed(const char * reason)
+{
+    //
+    // Called once the state is Failed.  Termination isn't safe from the
+    // completion context, so the timer hands it over to the work loop.
+    //
+    
+    IOLog("%s: keyboard bring-up failed: %s\n", getName(), reason);
+    _startTimer->setTimeoutUS(1);
+}
+
+void GenericPS2Keyboard::startTimerFired(IOTimerEventSource * sender)
+{
+    //
+    // Either the bring-up failed and startFailed handed us the termination,
+    // or it timed out.
+    //
+    
+    UInt32 state = _startState;
+    
+    while (state != kStartStateFailed)
+    {
+        if (state == kStartStateRunning || state == kStartStateStopped)  return;
+        if (setStartState(state, kStartStateFailed))
+        {
+            IOLog("%s: keyboard bring-up timed out\n", getName());
+            break;
+        }
+        state = _startState;
+    }
+    
+    terminate(kIOServiceAsynchronous);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 const unsigned char * GenericPS2Keyboard::defaultKeymapOfLength(UInt32 * length)
 {
-	//
-    // Keymap data borrowed from IOUSBFamily/AppleUSBKeyboard.
-    //
-    static const unsigned char appleUSAKeyMap[] = {
-        0x00,0x00,
-        
-        // Modifier Defs
-        0x0a,   //Number of modifier keys.  Was 7
-        //0x00,0x01,0x39,  //CAPSLOCK, uses one byte.
-        0x01,0x01,0x38,
-        0x02,0x01,0x3b,
-        0x03,0x01,0x3a,
-        0x04,0x01,0x37,
-        0x05,0x15,0x52,0x41,0x4c,0x53,0x54,0x55,0x45,0x58,0x57,0x56,0x5b,0x5c,
-        0x43,0x4b,0x51,0x7b,0x7d,0x7e,0x7c,0x4e,0x59,
-        0x06,0x01,0x72,
-        0x09,0x01,0x3c, //Right shift
-        0x0a,0x01,0x3e, //Right control
-        0x0b,0x01,0x3d, //Right Option
-        0x0c,0x01,0x36, //Right Command
-        
-        // key deffs
-        0x7f,0x0d,0x00,0x61,
-        0x00,0x41,0x00,0x01,0x00,0x01,0x00,0xca,0x00,0xc7,0x00,0x01,0x00,0x01,0x0d,0x00,
-        0x73,0x00,0x53,0x00,0x13,0x00,0x13,0x00,0xfb,0x00,0xa7,0x00,0x13,0x00,0x13,0x0d,
-        0x00,0x64,0x00,0x44,0x00,0x04,0x00,0x04,0x01,0x44,0x01,0xb6,0x00,0x04,0x00,0x04,
-        0x0d,0x00,0x66,0x00,0x46,0x00,0x06,0x00,0x06,0x00,0xa6,0x01,0xac,0x00,0x06,0x00,
-        0x06,0x0d,0x00,0x68,0x00,0x48,0x00,0x08,0x00,0x08,0x00,0xe3,0x00,0xeb,0x00,0x00,
-        0x18,0x00,0x0d,0x00,0x67,0x00,0x47,0x00,0x07,0x00,0x07,0x00,0xf1,0x00,0xe1,0x00,
-        0x07,0x00,0x07,0x0d,0x00,0x7a,0x00,0x5a,0x00,0x1a,0x00,0x1a,0x00,0xcf,0x01,0x57,
-        0x00,0x1a,0x00,0x1a,0x0d,0x00,0x78,0x00,0x58,0x00,0x18,0x00,0x18,0x01,0xb4,0x01,
-        0xce,0x00,0x18,0x00,0x18,0x0d,0x00,0x63,0x00,0x43,0x00,0x03,0x00,0x03,0x01,0xe3,
-        0x01,0xd3,0x00,0x03,0x00,0x03,0x0d,0x00,0x76,0x00,0x56,0x00,0x16,0x00,0x16,0x01,
-        0xd6,0x01,0xe0,0x00,0x16,0x00,0x16,0x02,0x00,0x3c,0x00,0x3e,0x0d,0x00,0x62,0x00,
-        0x42,0x00,0x02,0x00,0x02,0x01,0xe5,0x01,0xf2,0x00,0x02,0x00,0x02,0x0d,0x00,0x71,
-        0x00,0x51,0x00,0x11,0x00,0x11,0x00,0xfa,0x00,0xea,0x00,0x11,0x00,0x11,0x0d,0x00,
-        0x77,0x00,0x57,0x00,0x17,0x00,0x17,0x01,0xc8,0x01,0xc7,0x00,0x17,0x00,0x17,0x0d,
-        0x00,0x65,0x00,0x45,0x00,0x05,0x00,0x05,0x00,0xc2,0x00,0xc5,0x00,0x05,0x00,0x05,
-        0x0d,0x00,0x72,0x00,0x52,0x00,0x12,0x00,0x12,0x01,0xe2,0x01,0xd2,0x00,0x12,0x00,
-        0x12,0x0d,0x00,0x79,0x00,0x59,0x00,0x19,0x00,0x19,0x00,0xa5,0x01,0xdb,0x00,0x19,
-        0x00,0x19,0x0d,0x00,0x74,0x00,0x54,0x00,0x14,0x00,0x14,0x01,0xe4,0x01,0xd4,0x00,
-        0x14,0x00,0x14,0x0a,0x00,0x31,0x00,0x21,0x01,0xad,0x00,0xa1,0x0e,0x00,0x32,0x00,
-        0x40,0x00,0x32,0x00,0x00,0x00,0xb2,0x00,0xb3,0x00,0x00,0x00,0x00,0x0a,0x00,0x33,
-        0x00,0x23,0x00,0xa3,0x01,0xba,0x0a,0x00,0x34,0x00,0x24,0x00,0xa2,0x00,0xa8,0x0e,
-        0x00,0x36,0x00,0x5e,0x00,0x36,0x00,0x1e,0x00,0xb6,0x00,0xc3,0x00,0x1e,0x00,0x1e,
-        0x0a,0x00,0x35,0x00,0x25,0x01,0xa5,0x00,0xbd,0x0a,0x00,0x3d,0x00,0x2b,0x01,0xb9,
-        0x01,0xb1,0x0a,0x00,0x39,0x00,0x28,0x00,0xac,0x00,0xab,0x0a,0x00,0x37,0x00,0x26,
-        0x01,0xb0,0x01,0xab,0x0e,0x00,0x2d,0x00,0x5f,0x00,0x1f,0x00,0x1f,0x00,0xb1,0x00,
-        0xd0,0x00,0x1f,0x00,0x1f,0x0a,0x00,0x38,0x00,0x2a,0x00,0xb7,0x00,0xb4,0x0a,0x00,
-        0x30,0x00,0x29,0x00,0xad,0x00,0xbb,0x0e,0x00,0x5d,0x00,0x7d,0x00,0x1d,0x00,0x1d,
-        0x00,0x27,0x00,0xba,0x00,0x1d,0x00,0x1d,0x0d,0x00,0x6f,0x00,0x4f,0x00,0x0f,0x00,
-        0x0f,0x00,0xf9,0x00,0xe9,0x00,0x0f,0x00,0x0f,0x0d,0x00,0x75,0x00,0x55,0x00,0x15,
-        0x00,0x15,0x00,0xc8,0x00,0xcd,0x00,0x15,0x00,0x15,0x0e,0x00,0x5b,0x00,0x7b,0x00,
-        0x1b,0x00,0x1b,0x00,0x60,0x00,0xaa,0x00,0x1b,0x00,0x1b,0x0d,0x00,0x69,0x00,0x49,
-        0x00,0x09,0x00,0x09,0x00,0xc1,0x00,0xf5,0x00,0x09,0x00,0x09,0x0d,0x00,0x70,0x00,
-        0x50,0x00,0x10,0x00,0x10,0x01,0x70,0x01,0x50,0x00,0x10,0x00,0x10,0x10,0x00,0x0d,
-        0x00,0x03,0x0d,0x00,0x6c,0x00,0x4c,0x00,0x0c,0x00,0x0c,0x00,0xf8,0x00,0xe8,0x00,
-        0x0c,0x00,0x0c,0x0d,0x00,0x6a,0x00,0x4a,0x00,0x0a,0x00,0x0a,0x00,0xc6,0x00,0xae,
-        0x00,0x0a,0x00,0x0a,0x0a,0x00,0x27,0x00,0x22,0x00,0xa9,0x01,0xae,0x0d,0x00,0x6b,
-        0x00,0x4b,0x00,0x0b,0x00,0x0b,0x00,0xce,0x00,0xaf,0x00,0x0b,0x00,0x0b,0x0a,0x00,
-        0x3b,0x00,0x3a,0x01,0xb2,0x01,0xa2,0x0e,0x00,0x5c,0x00,0x7c,0x00,0x1c,0x00,0x1c,
-        0x00,0xe3,0x00,0xeb,0x00,0x1c,0x00,0x1c,0x0a,0x00,0x2c,0x00,0x3c,0x00,0xcb,0x01,
-        0xa3,0x0a,0x00,0x2f,0x00,0x3f,0x01,0xb8,0x00,0xbf,0x0d,0x00,0x6e,0x00,0x4e,0x00,
-        0x0e,0x00,0x0e,0x00,0xc4,0x01,0xaf,0x00,0x0e,0x00,0x0e,0x0d,0x00,0x6d,0x00,0x4d,
-        0x00,0x0d,0x00,0x0d,0x01,0x6d,0x01,0xd8,0x00,0x0d,0x00,0x0d,0x0a,0x00,0x2e,0x00,
-        0x3e,0x00,0xbc,0x01,0xb3,0x02,0x00,0x09,0x00,0x19,0x0c,0x00,0x20,0x00,0x00,0x00,
-        0x80,0x00,0x00,0x0a,0x00,0x60,0x00,0x7e,0x00,0x60,0x01,0xbb,0x02,0x00,0x7f,0x00,
-        0x08,0xff,0x02,0x00,0x1b,0x00,0x7e,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
-        0xff,0xff,0x00,0x00,0x2e,0xff,0x00,0x00,
-        0x2a,0xff,0x00,0x00,0x2b,0xff,0x00,0x00,0x1b,0xff,0xff,0xff,0x0e,0x00,0x2f,0x00,
-        0x5c,0x00,0x2f,0x00,0x1c,0x00,0x2f,0x00,0x5c,0x00,0x00,0x0a,0x00,0x00,0x00,0x0d, //XX03
-        0xff,0x00,0x00,0x2d,0xff,0xff,0x0e,0x00,0x3d,0x00,0x7c,0x00,0x3d,0x00,0x1c,0x00,
-        0x3d,0x00,0x7c,0x00,0x00,0x18,0x46,0x00,0x00,0x30,0x00,0x00,0x31,0x00,0x00,0x32,
-        0x00,0x00,0x33,0x00,0x00,0x34,0x00,0x00,0x35,0x00,0x00,0x36,0x00,0x00,0x37,0xff,
-        0x00,0x00,0x38,0x00,0x00,0x39,0xff,0xff,0xff,0x00,0xfe,0x24,0x00,0xfe,0x25,0x00,
-        0xfe,0x26,0x00,0xfe,0x22,0x00,0xfe,0x27,0x00,0xfe,0x28,0xff,0x00,0xfe,0x2a,0xff,
-        0x00,0xfe,0x32,0x00,0xfe,0x35,0x00,0xfe,0x33,0xff,0x00,0xfe,0x29,0xff,0x00,0xfe,0x2b,0xff,
-        0x00,0xfe,0x34,0xff,0x00,0xfe,0x2e,0x00,0xfe,0x30,0x00,0xfe,0x2d,0x00,0xfe,0x23,
-        0x00,0xfe,0x2f,0x00,0xfe,0x21,0x00,0xfe,0x31,0x00,0xfe,0x20,
-        0x00,0x01,0xac, //ADB=0x7b is left arrow
-        0x00,0x01,0xae, //ADB = 0x7c is right arrow
-        0x00,0x01,0xaf, //ADB=0x7d is down arrow.  
-        0x00,0x01,0xad, //ADB=0x7e is up arrow	 
-        0x0f,0x02,0xff,0x04,            
-        0x00,0x31,0x02,0xff,0x04,0x00,0x32,0x02,0xff,0x04,0x00,0x33,0x02,0xff,0x04,0x00,
-        0x34,0x02,0xff,0x04,0x00,0x35,0x02,0xff,0x04,0x00,0x36,0x02,0xff,0x04,0x00,0x37,
-        0x02,0xff,0x04,0x00,0x38,0x02,0xff,0x04,0x00,0x39,0x02,0xff,0x04,0x00,0x30,0x02,
-        0xff,0x04,0x00,0x2d,0x02,0xff,0x04,0x00,0x3d,0x02,0xff,0x04,0x00,0x70,0x02,0xff,
-        0x04,0x00,0x5d,0x02,0xff,0x04,0x00,0x5b,
-        0x0a, // number of following special keys
-        0x04,0x39,  //caps lock
-        0x05,0x72,  //NX_KEYTYPE_HELP is 5, ADB code is 0x72
-        0x06,0x7f,  //NX_POWER_KEY is 6, ADB code is 0x7f
-        0x07,0x4a,  //NX_KEYTYPE_MUTE is 7, ADB code is 0x4a
-        0x00,0x48,  //NX_KEYTYPE_SOUND_UP is 0, ADB code is 0x48
-        0x01,0x49,  //NX_KEYTYPE_SOUND_DOWN is 1, ADB code is 0x49
-        NX_KEYTYPE_REWIND,kSpecialPrevious, // REWIND == previous track, no idea what NX_KEYTYPE_PREVIOUS is.
-        NX_KEYTYPE_PLAY,kSpecialPlay,
-        NX_KEYTYPE_FAST,kSpecialNext, // Similar. FAST == next track, NEXT == NFI.
-        // remove arrow keys as special keys. They are generating double up/down scroll events
-        // in both carbon and coco apps.
-        //0x08,0x7e,  //NX_UP_ARROW_KEY is 8, ADB is 3e raw, 7e virtual (KMAP)
-        //0x09,0x7d,  //NX_DOWN_ARROW_KEY is 9, ADB is 0x3d raw, 7d virtual
-        0x0a,0x47   //NX_KEYTYPE_NUM_LOCK is 10, ADB combines with CLEAR key for numlock
-    };
-    
-    *length = sizeof(appleUSAKeyMap);
-    return appleUSAKeyMap;
+    //
+    // The keymaps are built by the compiler, see GenericPS2Keymap.h.
+    //
+    
+    *length = KeyboardLayouts[_layout].keymapLength;
+    return KeyboardLayouts[_layout].keymap;
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -739,30 +2772,26 @@ void GenericPS2Keyboard::setDevicePowerState( UInt32 whatToDo )
             
             setKeyboardEnable( false );
             
-            break;
-            
-        case kPS2C_EnableDevice:
-            
             //
-            // Initialize the keyboard LED state.
+            // Any keys held now will be released while the keyboard is off.
             //
             
-            setLEDs(_ledState);
+            if (_workLoop)
+                _workLoop->runAction(OSMemberFunctionCast(IOWorkLoop::Action, this,
+                                                          &GenericPS2Keyboard::releaseAllKeysGated),
+                                     this, (void *)"keyboard disabled");
             
-            //
-            // Enable the keyboard clock (should already be so), the keyboard
-            // IRQ line, and the keyboard Kscan -> scan code translation mode.
-            //
+            break;
             
-            setCommandByte( kCB_EnableKeyboardIRQ | kCB_TranslateMode,
-                           kCB_DisableKeyboardClock );
+        case kPS2C_EnableDevice:
             
             //
-            // Finally, we enable the keyboard itself, so that it may start
-            // reporting key events.
+            // Restore the LED state and typematic rate (the keyboard forgets
+            // them when it powers down), the command byte, and enable the
+            // keyboard.
             //
             
-            setKeyboardEnable( true );
+            if (_startState == kStartStateRunning)  resumeKeyboard();
             
             break;
     }
@@ -25,29 +25,243 @@
 
 #include <libkern/c++/OSBoolean.h>
 #include <IOKit/hidsystem/IOHIKeyboard.h>
+#include <IOKit/IOInterruptEventSource.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOWorkLoop.h>
 #include "ApplePS2KeyboardDevice.h"
+#include "GenericPS2KeyTranslator.h"
+#include "GenericPS2ScancodeRing.h"
+#include "GenericPS2ScancodeTrace.h"
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-// Definitions used to keep track of key state.   Key up/down state is tracked
-// in a bit list.  Bits are set for key-down, and cleared for key-up.  The bit
-// vector and macros for it's manipulation are defined here.
+// Keyboard configuration.  The remap settings are compiled into an immutable
+// snapshot -- the translation tables for every layer, in one allocation --
+// whenever they are set, on the caller's thread.  The new snapshot is handed
+// to the work loop through a single pointer, which it picks up before the
+// next batch of scan codes; the work loop never sees a half-built snapshot,
+// and never waits for one to be built.
 //
 
-#define KBV_NUM_KEYCODES        128
-#define KBV_BITS_PER_UNIT       32     // for UInt32
-#define KBV_BITS_MASK           31
-#define KBV_BITS_SHIFT          5      // 1<<5 == 32, for cheap divide
-#define KBV_NUNITS ((KBV_NUM_KEYCODES + \
-(KBV_BITS_PER_UNIT-1))/KBV_BITS_PER_UNIT)
+//
+// Dual-role (tap-hold) keys send one key when tapped, and another while held.
+// A key is held once it has been down for holdAfter (AbsoluteTime), or as soon
+// as another key is pressed while it is down; releasing it before either
+// makes it a tap.  Only one dual-role key is undecided at a time.
+//
+
+#define kTapHoldMax                     32
+#define kTapHoldDefaultMS               200
+
+struct KeyTapHold
+{
+    KeyTranslation tap;
+    KeyTranslation hold;
+    UInt64         holdAfter;
+};
+
+//
+// Debounce windows are per key code, in AbsoluteTime; "Debounce (ms)" sets
+// the window of every key, and "Debounce keys" overrides it key by key.
+// debounced is false when every window is 0, to skip the filter entirely.
+// The cap keeps the window well short of the quickest deliberate double
+// press.
+//
+
+#define kDebounceMaxMS                  30
+
+struct KeyboardConfig
+{
+    UInt32           size;          // of the allocation, tables included
+    UInt32           layerCount;
+    KeyTranslation * tables;        // layerCount tables, following this struct
+    KeyMacroArena    macros;
+    UInt32           tapHoldCount;
+    KeyTapHold       tapHolds[kTapHoldMax];
+    bool             debounced;
+    UInt32           debounce[KBV_NUM_KEYCODES];
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Bytes after which the keyboard's idea of which keys are down can no longer
+// be trusted.  Both mean the keyboard dropped key events.
+//
+
+#define kSC_Overrun             0x00    // key detection error/overrun (set 2)
+#define kSC_OverrunSet1         0xFF    // key detection error/overrun (set 1)
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Asynchronous requests come from a small pool preallocated in start(), and
+// are recycled by their completion routines, so that no command path has to
+// wait in allocateRequest.  Free entries are tracked as a bitmask.
+//
+// Asynchronous commands are issued from completion routines, which must never
+// block, so an empty pool never falls back to allocateRequest.  The steps of
+// a sequence (the bring-up, LED updates) reuse the request that just
+// completed; a new command that finds the pool empty is deferred, by setting
+// its bit in a mask, and issued as soon as a request comes back.
+//
+
+#define kRequestPoolSize                4
+
+enum
+{
+    kDeferredLEDs       = 1 << 0,
+    kDeferredEnable     = 1 << 1,
+    kDeferredTypematic  = 1 << 2
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Typematic rate/delay bytes for kDP_SetKeyboardTypematic.  Bits 0-4 are the
+// repeat rate, bits 5-6 the delay before repeating starts.
+//
+
+#define kTypematicDefault               0x2B    // 10.9 cps after 500ms
+#define kTypematicSlowest               0x7F    // 2.0 cps after 1000ms
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Latency histograms with log2 buckets: bucket 0 counts latencies under 1us,
+// bucket n those in [2^(n-1), 2^n) us, and the last bucket everything longer.
+// Each histogram has a single writer (the work loop), so no locking needed.
+//
+
+#define kLatencyBuckets                 32
+
+struct LatencyHistogram
+{
+    UInt32 buckets[kLatencyBuckets];
+    
+    void reset()
+    {
+        for (int index = 0; index < kLatencyBuckets; index++)  buckets[index] = 0;
+    }
+    
+    void record(UInt64 absoluteTime)
+    {
+        UInt64 nanoseconds;
+        UInt64 microseconds;
+        UInt32 bucket;
+        
+        absolutetime_to_nanoseconds(absoluteTime, &nanoseconds);
+        microseconds = nanoseconds / 1000;
+        bucket = microseconds ? 64 - __builtin_clzll(microseconds) : 0;
+        buckets[bucket < kLatencyBuckets ? bucket : kLatencyBuckets - 1]++;
+    }
+};
 
-#define KBV_KEYDOWN(n, bits) \
-(bits)[((n)>>KBV_BITS_SHIFT)] |= (1 << ((n) & KBV_BITS_MASK))
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// The interrupt action only timestamps each byte and queues it in the scan
+// code ring; a work loop of our own drains the ring in batches and does the
+// decoding, remapping and dispatching.
+//
+
+#define kScancodeRingSize               256
+#define kScancodeBatchSize              32
+
+//
+// With "Capture scan codes" on, the interrupt action also keeps the last
+// kCaptureSize raw bytes, which are exported as the "Scan code trace"
+// property (see GenericPS2ScancodeTrace.h for the format).
+//
+
+#define kCaptureSize                    4096
+
+typedef ScancodeCapture<kCaptureSize> KeyboardCapture;
+
+//
+// Key usage.  The work loop counts the presses of every key code, and sums
+// how long each was held, with plain increments.  They are exported as the
+// "Key usage" data property, a snapshot in this format (in host byte order,
+// ie. little-endian), copied while the counters carry on changing:
+//
+
+#define kKeyUsageVersion                1
+
+struct KeyUsageSnapshot
+{
+    UInt8  magic[4];                            // 'P' 'S' '2' 'U'
+    UInt16 version;                             // kKeyUsageVersion
+    UInt16 keyCount;                            // KBV_NUM_KEYCODES
+    UInt32 presses[KBV_NUM_KEYCODES];           // by key code
+    UInt64 heldNanoseconds[KBV_NUM_KEYCODES];   // summed over all presses
+};
+
+typedef char KeyUsageSnapshotIsPacked[sizeof(KeyUsageSnapshot) == 8 + 12 * KBV_NUM_KEYCODES ? 1 : -1];
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// start() doesn't wait for the keyboard.  It submits the first request of the
+// bring-up sequence and returns; each completion submits the next, until the
+// keyboard is running.  A timer on the work loop bounds the whole sequence.
+//
+// o  Echo:            diagnostic echo, to check that a keyboard is there.
+// o  ReadCommandByte: read the controller's command byte.
+// o  Resume:          test-and-set the command byte, set the LEDs and
+//                     typematic rate, and enable the keyboard, as on wake.
+//                     If the command byte changed under us, we go back to
+//                     ReadCommandByte, up to kStartRetries times.
+// o  Running:         done.
+// o  Failed:          no echo, out of retries or timed out; the work loop
+//                     terminates the driver.
+// o  Stopped:         stop() was called; outstanding completions do nothing.
+//
+
+enum
+{
+    kStartStateIdle,
+    kStartStateEcho,
+    kStartStateReadCommandByte,
+    kStartStateResume,
+    kStartStateRunning,
+    kStartStateFailed,
+    kStartStateStopped
+};
+
+#define kStartTimeoutMS                 2000
+#define kStartRetries                   8
 
-#define KBV_KEYUP(n, bits) \
-(bits)[((n)>>KBV_BITS_SHIFT)] &= ~(1 << ((n) & KBV_BITS_MASK))
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Anomalies.  Bytes and responses that shouldn't happen are counted per
+// category, with atomic increments wherever they are seen, the interrupt
+// action included, and never logged there.  The first one arms a timer on
+// the work loop, which logs a one-line summary of the counts since the last
+// summary; while anomalies keep coming, summaries are kAnomalyLogIntervalMS
+// apart.  The totals are exported as the "Anomalies" property.
+//
+
+enum
+{
+    kAnomalyAcknowledge,        // unexpected acknowledge (FA)
+    kAnomalyResend,             // unexpected resend request (FE)
+    kAnomalyOverrun,            // keyboard overrun byte
+    kAnomalyReset,              // keyboard reset itself (AA)
+    kAnomalyUnknownExtended,    // E0 code we don't know
+    kAnomalyRingOverflow,       // byte dropped, scan code ring full
+    kAnomalyCommandFailed,      // request cut short by a failed compare
+    kAnomalyCount
+};
 
-#define KBV_IS_KEYDOWN(n, bits) \
-(((bits)[((n)>>KBV_BITS_SHIFT)] & (1 << ((n) & KBV_BITS_MASK))) != 0)
+#define kAnomalyLogDelayMS              100
+#define kAnomalyLogIntervalMS           10000
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// System actions.  A key can be translated into a system action instead of a
+// key (the sleep key is, by default).  Pressing it only sets the action's bit
+// in a pending mask and signals an event source, which performs the action on
+// the work loop once the scan codes at hand are dispatched.  A press within
+// the action's debounce window of the last time it fired is suppressed, so a
+// bouncing key can't put the machine to sleep twice.
+//
+
+enum
+{
+    kSystemActionSleep,
+    kSystemActionDisplaySleep,
+    kSystemActionPower,         // as if the power button was pressed
+    kSystemActionLock,          // control + command + Q
+    kSystemActionCount
+};
+
+#define kKeyCodeSleep                   0x74    // E05F, see the decoder
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // GenericPS2Keyboard Class Declaration
@@ -58,30 +272,168 @@ class GenericPS2Keyboard : public IOHIKeyboard
     OSDeclareDefaultStructors(GenericPS2Keyboard);
     
 private:
-    UInt32                   _capslockKeyCode;
-    bool                     _remapFunctionKeys;
-    bool                     _windowsAltSwap;
-    bool                     _insertKeyDown;
-    bool                     _applicationKeyDown;
+    KeyboardConfig *         _config;           // in use by the work loop
+    KeyboardConfig * volatile _pendingConfig;   // waiting to be picked up
+    UInt32                   _configsApplied;
+    UInt32                   _configLayers;     // _config->layerCount, for other threads
+    KeyTranslator            _translator;
+    UInt32                   _layout;           // index in KeyboardLayouts
     ApplePS2KeyboardDevice * _device;
-    UInt32                   _keyBitVector[KBV_NUNITS];
-    UInt8                    _extendCount;
+    IOWorkLoop *             _workLoop;
+    IOInterruptEventSource * _scancodeSource;
+    IOTimerEventSource *     _startTimer;
+    IOTimerEventSource *     _tapHoldTimer;
+    IOTimerEventSource *     _anomalyTimer;
+    volatile SInt32          _anomalies[kAnomalyCount];
+    UInt32                   _anomaliesLogged[kAnomalyCount];
+    volatile UInt32          _anomalyLogArmed;
+    IOInterruptEventSource * _systemActionSource;
+    volatile UInt32          _systemActionsPending;
+    UInt64                   _systemActionTime[kSystemActionCount];
+    UInt32                   _systemActionsFired[kSystemActionCount];
+    UInt32                   _systemActionsSuppressed[kSystemActionCount];
+    UInt8                    _tapHoldKey;       // undecided, or KBV_NUM_KEYCODES
+    KeyTapHold               _tapHold;          // its settings
+    UInt64                   _tapHoldPressed;
+    KeyTranslation           _tapHoldHolding[KBV_NUM_KEYCODES];
+    UInt32                   _taps;
+    UInt32                   _holdsByTime;
+    UInt32                   _holdsByKey;
+    LatencyHistogram         _tapHoldLatency;
+    volatile UInt32          _startState;
+    UInt32                   _startRetries;
+    UInt64                   _startTime;
+    UInt64                   _startBlocked;
+    UInt64                   _startDuration;
+    ScancodeRing<kScancodeRingSize> _scancodeRing;
+    KeyboardCapture *        _capture;
+    volatile bool            _captureEnabled;
+    UInt64                   _keyDownTime[KBV_NUM_KEYCODES];
+    UInt32                   _keyPresses[KBV_NUM_KEYCODES];
+    UInt64                   _keyHeld[KBV_NUM_KEYCODES];    // AbsoluteTime
+    UInt32                   _keyFlushes;
+    UInt32                   _keysFlushed;
+    volatile UInt32          _resetExpected;    // after an overrun or a failed command
+    UInt32                   _chatterSuppressed[KBV_NUM_KEYCODES];
+    UInt32                   _chatterTotal;
+    bool                     _suppressTypematic;
+    bool                     _typematicSuppressed;
+    UInt32                   _repeatsDiscarded;
+    UInt32                   _repeatsAvoided;
+    UInt64                   _sequenceStart;
+    UInt64                   _lastEventTime;
+    LatencyHistogram         _sequenceLatency;
+    LatencyHistogram         _dispatchLatency;
     UInt8                    _interruptHandlerInstalled:1;
     UInt8                    _powerControlHandlerInstalled:1;
     UInt8                    _ledState;
+    PS2Request *             _requestPool[kRequestPoolSize];
+    volatile UInt32          _requestPoolFree;
+    volatile SInt32          _requestPoolMisses;
+    volatile UInt32          _requestsDeferred;
+    volatile bool            _deferredEnable;
+    volatile UInt8           _deferredTypematic;
+    UInt8                    _ledDeferred;
+    IOSimpleLock *           _ledLock;
+    bool                     _ledRequestInFlight;
+    bool                     _ledPendingValid;
+    UInt8                    _ledPending;
+    UInt32                   _ledRequestsSent;
+    UInt32                   _ledRequestsElided;
+    UInt8                    _commandByte;      // shadow of the controller's
+    bool                     _commandByteValid;
+    bool                     _resumeSendsLEDs;
+    UInt32                   _wakesBatched;
+    UInt32                   _wakesFallenBack;
+    LatencyHistogram         _wakeLatency;
+    volatile SInt32          _requestsSubmitted;
+    volatile SInt32          _commandsSubmitted;
+    UInt32                   _requestsBlocking;
+    UInt32                   _requestsBlockingTruncated;
+    UInt32                   _commandByteRetries;
+    LatencyHistogram         _blockingLatency;
+    
+    //
+    // The per-byte path, from the ring to dispatchKeyboardEvent, is made of
+    // direct calls only.
+    //
+    
+    template <bool Debounced> void dispatchScancodes(const ScancodeRingEntry * batch, UInt32 count);
+    template <bool Debounced> bool dispatchKeyboardEventWithScancode(UInt8 scanCode, AbsoluteTime arrival);
+    void dispatchKey(const KeyEvent & event, AbsoluteTime time, bool flushing);
+    void resolveTapHold(bool hold, UInt64 now);
+    void dispatchTranslatedKey(KeyTranslation translation, bool goingDown, AbsoluteTime time);
     
-    virtual bool dispatchKeyboardEventWithScancode(UInt8 scanCode);
+    virtual void scancodesAvailable(IOInterruptEventSource * source, int count);
+    virtual void tapHoldTimerFired(IOTimerEventSource * sender);
+    virtual void releaseAllKeys(const char * reason);
+    virtual void releaseHeldKeys(const char * reason);
+    virtual IOReturn releaseAllKeysGated(void * reason, void *, void *, void *);
+    virtual void releaseWorkLoop();
+    virtual void noteAnomaly(UInt32 anomaly);
+    virtual void armAnomalyLog();
+    virtual void anomalyTimerFired(IOTimerEventSource * sender);
+    virtual void queueSystemAction(UInt32 action, UInt64 time);
+    virtual void systemActionsPending(IOInterruptEventSource * source, int count);
+    virtual void performSystemAction(UInt32 action);
+    virtual void setCaptureEnabled(bool enable);
+    virtual void publishCapture();
+    virtual void publishKeyUsage();
     virtual void setCommandByte(UInt8 setBits, UInt8 clearBits);
+    virtual void resumeKeyboard();
+    virtual bool resumeKeyboardBatched();
+    virtual void prepareResume(PS2Request * request, UInt8 commandByte);
+    virtual bool finishResume(PS2Request * request);
+    virtual bool setStartState(UInt32 from, UInt32 to);
+    virtual void startKeyboard();
+    virtual void startEchoCompleted(void * param);
+    virtual void startReadCommandByte(PS2Request * request);
+    virtual void startReadCommandByteCompleted(void * param);
+    virtual void startResumeCompleted(void * param);
+    virtual void startFailed(const char * reason);
+    virtual void startTimerFired(IOTimerEventSource * sender);
+    virtual PS2Request * requestWithCommands(const PS2Command * commands, UInt8 count,
+                                             PS2CompletionAction completion);
+    virtual void fillRequest(PS2Request * request, const PS2Command * commands, UInt8 count,
+                             PS2CompletionAction completion);
+    virtual void recycleRequest(PS2Request * request);
+    virtual void deferRequest(UInt32 deferred);
+    virtual void runDeferredRequests();
+    virtual void submitRequest(PS2Request * request);
+    virtual bool submitRequestAndBlock(PS2Request * request);
+    virtual void requestCompleted(void * param);
+    virtual bool requestSucceeded(PS2Request * request, UInt8 expected);
     virtual void setLEDs(UInt8 ledState);
+    virtual void submitLEDs(UInt8 ledState, PS2Request * request);
+    virtual void setLEDsCompleted(void * param);
+    virtual void setLEDsFinished(UInt8 ledState, bool applied, PS2Request * request);
     virtual void setKeyboardEnable(bool enable);
+    virtual void setKeyboardTypematic(UInt8 rateAndDelay);
+    virtual void setKeyboardTypematicCompleted(void * param);
+    virtual void countAvoidedRepeats(UInt64 heldTime);
     virtual void setDevicePowerState(UInt32 whatToDo);
-    virtual UInt32 remapFunctionKeys(UInt32 adbKeyCode, bool goingDown);
+    virtual KeyboardConfig * buildConfig(OSDictionary * changes);
+    virtual OSObject * remapSetting(OSDictionary * changes, const char * key);
+    virtual void publishConfig(KeyboardConfig * config);
+    virtual void adoptPendingConfig();
+    virtual IOReturn validateSettings(OSDictionary * settings);
+    virtual void applyKeyRemaps(OSDictionary * remaps, KeyTranslation * table,
+                                KeyboardConfig * config);
+    virtual int addMacro(OSDictionary * macro, KeyMacroArena * macros);
+    virtual int addTapHold(OSDictionary * tapHold, KeyboardConfig * config);
+    virtual void applyDebounce(KeyboardConfig * config, OSDictionary * changes);
+    virtual void applyLayerKeys(OSArray * keys, KeyTranslation layerKey,
+                                KeyTranslation * activation);
+    virtual KeyTranslation remapFunctionKeys(UInt32 adbKeyCode);
     
 protected:
+    virtual void free();
     virtual const unsigned char * defaultKeymapOfLength(UInt32 * length);
     virtual void setAlphaLockFeedback(bool locked);
     virtual void setNumLockFeedback(bool locked);
     virtual UInt32 maxKeyCodes();
+    virtual bool serializeProperties(OSSerialize * serialize) const;
+    virtual void publishStatistics();
     
 public:
     virtual IOReturn setProperties( OSObject * properties);
@@ -0,0 +1,446 @@
+#ifndef _GENERICPS2KEYMAP_H
+#define _GENERICPS2KEYMAP_H
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Keymaps.
+//
+// IOHIKeyboard turns ADB key codes into characters with an NX keymap, a byte
+// stream in which every count and length has to agree with what follows it:
+//
+//   0x00 0x00                      entries are bytes, not shorts
+//   modifier count
+//     modifier, key count, keys... for each modifier
+//   key count
+//     key definition...            for each key code, in order
+//   sequence count
+//     length, pairs...             for each sequence
+//   special key count
+//     special key type, key code   for each special key
+//
+// A key definition is a mask of the modifiers that change the character the
+// key generates, followed by a (character set, character) pair for each
+// combination of those modifiers, or 0xFF alone for a key that generates no
+// character.
+//
+// Rather than edit that stream by hand, the keymaps below are generated by
+// the compiler from lists of keys, one per line, so there is no runtime cost
+// to building them.  Each list is expanded several times: once for the bytes
+// of the keymap, and once for each structural check, which fail to compile if
+// the keys aren't listed in order, a key doesn't list one pair for every
+// combination of its modifiers, a modifier or special key is defined twice,
+// or the counts don't add up to the size of the keymap.
+//
+// The data started life as the keymap of IOUSBFamily/AppleUSBKeyboard.
+//
+
+// I just made these up (after checking they weren't in the main map).
+#define kSpecialPrevious 0xa1
+#define kSpecialPlay 0xa2
+#define kSpecialNext 0xa3
+
+#define kKeymapKeyCount                 0x7F
+#define kKeymapSetFunction              0xFE    // function keys, by number
+#define kKeymapSetModifier              0xFF    // in sequences: a modifier
+
+//
+// A pair is packed into 16 bits, set << 8 | character, so that it is a single
+// macro argument however it was written.
+//
+
+#define KEYMAP_PAIR(set, c)             (((set) << 8) | ((c) & 0xFF))
+#define KEYMAP_CHAR(c)                  KEYMAP_PAIR(NX_ASCIISET, c)
+#define KEYMAP_SYMBOL(c)                KEYMAP_PAIR(NX_SYMBOLSET, c)
+#define KEYMAP_FUNCTION(n)              KEYMAP_PAIR(kKeymapSetFunction, n)
+#define KEYMAP_CONTROL(c)               KEYMAP_CHAR((c) & 0x1F)
+#define KEYMAP_PAIR_BYTES(p)            (unsigned char)((p) >> 8), (unsigned char)(p)
+
+#define KEYMAP_MASK(modifier)           (1 << NX_MODIFIERKEY_##modifier)
+#define KEYMAP_SHIFT_MASK               KEYMAP_MASK(SHIFT)
+#define KEYMAP_SPACE_MASK               (KEYMAP_MASK(CONTROL) | KEYMAP_MASK(ALTERNATE))
+#define KEYMAP_SYMBOL_MASK              (KEYMAP_MASK(SHIFT) | KEYMAP_MASK(ALTERNATE))
+#define KEYMAP_PUNCTUATION_MASK         (KEYMAP_MASK(SHIFT) | KEYMAP_MASK(CONTROL) | KEYMAP_MASK(ALTERNATE))
+#define KEYMAP_LETTER_MASK              (KEYMAP_MASK(ALPHALOCK) | KEYMAP_MASK(CONTROL) | KEYMAP_MASK(ALTERNATE))
+#define KEYMAP_COMMAND_MASK             KEYMAP_MASK(COMMAND)
+
+#define KEYMAP_BITS8(x) \
+( (((x) >> 0) & 1) + (((x) >> 1) & 1) + (((x) >> 2) & 1) + (((x) >> 3) & 1) + \
+  (((x) >> 4) & 1) + (((x) >> 5) & 1) + (((x) >> 6) & 1) + (((x) >> 7) & 1) )
+#define KEYMAP_BITS(x) \
+( KEYMAP_BITS8((x) & 0xFF) + KEYMAP_BITS8(((x) >> 8) & 0xFF) + \
+  KEYMAP_BITS8(((x) >> 16) & 0xFF) + KEYMAP_BITS8(((x) >> 24) & 0xFF) )
+
+//
+// Keys.  A list of keys is a macro taking the name of an expansion, K, and
+// listing K##_KEY_NONE(code) for a key that generates no character, or
+// K##_KEY_<n>(code, mask, pairs...) for a key whose mask has n modifiers,
+// with 2^n pairs in the order of the modifier combinations (for a mask of
+// shift and alternate: none, shift, alternate, shift + alternate).
+//
+// Letters, and the keys with a shifted symbol, follow a pattern.  A letter's
+// option characters are the only ones that vary; control gives the control
+// character with or without option.
+//
+
+#define KEYMAP_LETTER(K, code, c, option, shiftOption) \
+  K##_KEY_3(code, KEYMAP_LETTER_MASK, \
+            KEYMAP_CHAR(c), KEYMAP_CHAR((c) - 0x20), KEYMAP_CONTROL(c), KEYMAP_CONTROL(c), \
+            option, shiftOption, KEYMAP_CONTROL(c), KEYMAP_CONTROL(c))
+
+#define KEYMAP_SYMBOL_KEY(K, code, c, shifted, option, shiftOption) \
+  K##_KEY_2(code, KEYMAP_SYMBOL_MASK, KEYMAP_CHAR(c), KEYMAP_CHAR(shifted), option, shiftOption)
+
+//
+// The keys common to every layout.  The odd pairs of H, keypad / and keypad =
+// are as they were in Apple's keymap.
+//
+
+#define KEYMAP_KEYS_00_09(K) \
+    /* A            */ KEYMAP_LETTER(K, 0x00, 'a', KEYMAP_CHAR(0xca), KEYMAP_CHAR(0xc7)) \
+    /* S            */ KEYMAP_LETTER(K, 0x01, 's', KEYMAP_CHAR(0xfb), KEYMAP_CHAR(0xa7)) \
+    /* D            */ KEYMAP_LETTER(K, 0x02, 'd', KEYMAP_SYMBOL(0x44), KEYMAP_SYMBOL(0xb6)) \
+    /* F            */ KEYMAP_LETTER(K, 0x03, 'f', KEYMAP_CHAR(0xa6), KEYMAP_SYMBOL(0xac)) \
+    /* H            */ K##_KEY_3(0x04, KEYMAP_LETTER_MASK, \
+                           KEYMAP_CHAR('h'), KEYMAP_CHAR('H'), KEYMAP_CHAR(0x08), KEYMAP_CHAR(0x08), \
+                           KEYMAP_CHAR(0xe3), KEYMAP_CHAR(0xeb), KEYMAP_CHAR(0x00), KEYMAP_PAIR(0x18, 0x00)) \
+    /* G            */ KEYMAP_LETTER(K, 0x05, 'g', KEYMAP_CHAR(0xf1), KEYMAP_CHAR(0xe1)) \
+    /* Z            */ KEYMAP_LETTER(K, 0x06, 'z', KEYMAP_CHAR(0xcf), KEYMAP_SYMBOL(0x57)) \
+    /* X            */ KEYMAP_LETTER(K, 0x07, 'x', KEYMAP_SYMBOL(0xb4), KEYMAP_SYMBOL(0xce)) \
+    /* C            */ KEYMAP_LETTER(K, 0x08, 'c', KEYMAP_SYMBOL(0xe3), KEYMAP_SYMBOL(0xd3)) \
+    /* V            */ KEYMAP_LETTER(K, 0x09, 'v', KEYMAP_SYMBOL(0xd6), KEYMAP_SYMBOL(0xe0))
+
+#define KEYMAP_KEYS_0B_5C(K) \
+    /* B            */ KEYMAP_LETTER(K, 0x0b, 'b', KEYMAP_SYMBOL(0xe5), KEYMAP_SYMBOL(0xf2)) \
+    /* Q            */ KEYMAP_LETTER(K, 0x0c, 'q', KEYMAP_CHAR(0xfa), KEYMAP_CHAR(0xea)) \
+    /* W            */ KEYMAP_LETTER(K, 0x0d, 'w', KEYMAP_SYMBOL(0xc8), KEYMAP_SYMBOL(0xc7)) \
+    /* E            */ KEYMAP_LETTER(K, 0x0e, 'e', KEYMAP_CHAR(0xc2), KEYMAP_CHAR(0xc5)) \
+    /* R            */ KEYMAP_LETTER(K, 0x0f, 'r', KEYMAP_SYMBOL(0xe2), KEYMAP_SYMBOL(0xd2)) \
+    /* Y            */ KEYMAP_LETTER(K, 0x10, 'y', KEYMAP_CHAR(0xa5), KEYMAP_SYMBOL(0xdb)) \
+    /* T            */ KEYMAP_LETTER(K, 0x11, 't', KEYMAP_SYMBOL(0xe4), KEYMAP_SYMBOL(0xd4)) \
+    /* 1            */ KEYMAP_SYMBOL_KEY(K, 0x12, '1', '!', KEYMAP_SYMBOL(0xad), KEYMAP_CHAR(0xa1)) \
+    /* 2            */ K##_KEY_3(0x13, KEYMAP_PUNCTUATION_MASK, \
+                           KEYMAP_CHAR('2'), KEYMAP_CHAR('@'), KEYMAP_CHAR('2'), KEYMAP_CHAR(0x00), \
+                           KEYMAP_CHAR(0xb2), KEYMAP_CHAR(0xb3), KEYMAP_CHAR(0x00), KEYMAP_CHAR(0x00)) \
+    /* 3            */ KEYMAP_SYMBOL_KEY(K, 0x14, '3', '#', KEYMAP_CHAR(0xa3), KEYMAP_SYMBOL(0xba)) \
+    /* 4            */ KEYMAP_SYMBOL_KEY(K, 0x15, '4', '$', KEYMAP_CHAR(0xa2), KEYMAP_CHAR(0xa8)) \
+    /* 6            */ K##_KEY_3(0x16, KEYMAP_PUNCTUATION_MASK, \
+                           KEYMAP_CHAR('6'), KEYMAP_CHAR('^'), KEYMAP_CHAR('6'), KEYMAP_CHAR(0x1e), \
+                           KEYMAP_CHAR(0xb6), KEYMAP_CHAR(0xc3), KEYMAP_CHAR(0x1e), KEYMAP_CHAR(0x1e)) \
+    /* 5            */ KEYMAP_SYMBOL_KEY(K, 0x17, '5', '%', KEYMAP_SYMBOL(0xa5), KEYMAP_CHAR(0xbd)) \
+    /* =            */ KEYMAP_SYMBOL_KEY(K, 0x18, '=', '+', KEYMAP_SYMBOL(0xb9), KEYMAP_SYMBOL(0xb1)) \
+    /* 9            */ KEYMAP_SYMBOL_KEY(K, 0x19, '9', '(', KEYMAP_CHAR(0xac), KEYMAP_CHAR(0xab)) \
+    /* 7            */ KEYMAP_SYMBOL_KEY(K, 0x1a, '7', '&', KEYMAP_SYMBOL(0xb0), KEYMAP_SYMBOL(0xab)) \
+    /* -            */ K##_KEY_3(0x1b, KEYMAP_PUNCTUATION_MASK, \
+                           KEYMAP_CHAR('-'), KEYMAP_CHAR('_'), KEYMAP_CHAR(0x1f), KEYMAP_CHAR(0x1f), \
+                           KEYMAP_CHAR(0xb1), KEYMAP_CHAR(0xd0), KEYMAP_CHAR(0x1f), KEYMAP_CHAR(0x1f)) \
+    /* 8            */ KEYMAP_SYMBOL_KEY(K, 0x1c, '8', '*', KEYMAP_CHAR(0xb7), KEYMAP_CHAR(0xb4)) \
+    /* 0            */ KEYMAP_SYMBOL_KEY(K, 0x1d, '0', ')', KEYMAP_CHAR(0xad), KEYMAP_CHAR(0xbb)) \
+    /* ]            */ K##_KEY_3(0x1e, KEYMAP_PUNCTUATION_MASK, \
+                           KEYMAP_CHAR(']'), KEYMAP_CHAR('}'), KEYMAP_CHAR(0x1d), KEYMAP_CHAR(0x1d), \
+                           KEYMAP_CHAR('\''), KEYMAP_CHAR(0xba), KEYMAP_CHAR(0x1d), KEYMAP_CHAR(0x1d)) \
+    /* O            */ KEYMAP_LETTER(K, 0x1f, 'o', KEYMAP_CHAR(0xf9), KEYMAP_CHAR(0xe9)) \
+    /* U            */ KEYMAP_LETTER(K, 0x20, 'u', KEYMAP_CHAR(0xc8), KEYMAP_CHAR(0xcd)) \
+    /* [            */ K##_KEY_3(0x21, KEYMAP_PUNCTUATION_MASK, \
+                           KEYMAP_CHAR('['), KEYMAP_CHAR('{'), KEYMAP_CHAR(0x1b), KEYMAP_CHAR(0x1b), \
+                           KEYMAP_CHAR('`'), KEYMAP_CHAR(0xaa), KEYMAP_CHAR(0x1b), KEYMAP_CHAR(0x1b)) \
+    /* I            */ KEYMAP_LETTER(K, 0x22, 'i', KEYMAP_CHAR(0xc1), KEYMAP_CHAR(0xf5)) \
+    /* P            */ KEYMAP_LETTER(K, 0x23, 'p', KEYMAP_SYMBOL(0x70), KEYMAP_SYMBOL(0x50)) \
+    /* Return       */ K##_KEY_1(0x24, KEYMAP_COMMAND_MASK, KEYMAP_CHAR(0x0d), KEYMAP_CHAR(0x03)) \
+    /* L            */ KEYMAP_LETTER(K, 0x25, 'l', KEYMAP_CHAR(0xf8), KEYMAP_CHAR(0xe8)) \
+    /* J            */ KEYMAP_LETTER(K, 0x26, 'j', KEYMAP_CHAR(0xc6), KEYMAP_CHAR(0xae)) \
+    /* '            */ KEYMAP_SYMBOL_KEY(K, 0x27, '\'', '"', KEYMAP_CHAR(0xa9), KEYMAP_SYMBOL(0xae)) \
+    /* K            */ KEYMAP_LETTER(K, 0x28, 'k', KEYMAP_CHAR(0xce), KEYMAP_CHAR(0xaf)) \
+    /* ;            */ KEYMAP_SYMBOL_KEY(K, 0x29, ';', ':', KEYMAP_SYMBOL(0xb2), KEYMAP_SYMBOL(0xa2)) \
+    /* \            */ K##_KEY_3(0x2a, KEYMAP_PUNCTUATION_MASK, \
+                           KEYMAP_CHAR('\\'), KEYMAP_CHAR('|'), KEYMAP_CHAR(0x1c), KEYMAP_CHAR(0x1c), \
+                           KEYMAP_CHAR(0xe3), KEYMAP_CHAR(0xeb), KEYMAP_CHAR(0x1c), KEYMAP_CHAR(0x1c)) \
+    /* ,            */ KEYMAP_SYMBOL_KEY(K, 0x2b, ',', '<', KEYMAP_CHAR(0xcb), KEYMAP_SYMBOL(0xa3)) \
+    /* /            */ KEYMAP_SYMBOL_KEY(K, 0x2c, '/', '?', KEYMAP_SYMBOL(0xb8), KEYMAP_CHAR(0xbf)) \
+    /* N            */ KEYMAP_LETTER(K, 0x2d, 'n', KEYMAP_CHAR(0xc4), KEYMAP_SYMBOL(0xaf)) \
+    /* M            */ KEYMAP_LETTER(K, 0x2e, 'm', KEYMAP_SYMBOL(0x6d), KEYMAP_SYMBOL(0xd8)) \
+    /* .            */ KEYMAP_SYMBOL_KEY(K, 0x2f, '.', '>', KEYMAP_CHAR(0xbc), KEYMAP_SYMBOL(0xb3)) \
+    /* Tab          */ K##_KEY_1(0x30, KEYMAP_SHIFT_MASK, KEYMAP_CHAR(0x09), KEYMAP_CHAR(0x19)) \
+    /* Space        */ K##_KEY_2(0x31, KEYMAP_SPACE_MASK, KEYMAP_CHAR(' '), KEYMAP_CHAR(0x00), KEYMAP_CHAR(0x80), KEYMAP_CHAR(0x00)) \
+    /* `            */ KEYMAP_SYMBOL_KEY(K, 0x32, '`', '~', KEYMAP_CHAR('`'), KEYMAP_SYMBOL(0xbb)) \
+    /* Delete       */ K##_KEY_1(0x33, KEYMAP_SHIFT_MASK, KEYMAP_CHAR(0x7f), KEYMAP_CHAR(0x08)) \
+    /* Keypad Enter (PowerBook)*/ K##_KEY_NONE(0x34) \
+    /* Escape       */ K##_KEY_1(0x35, KEYMAP_SHIFT_MASK, KEYMAP_CHAR(0x1b), KEYMAP_CHAR('~')) \
+    /* Right Command*/ K##_KEY_NONE(0x36) \
+    /* Command      */ K##_KEY_NONE(0x37) \
+    /* Shift        */ K##_KEY_NONE(0x38) \
+    /* Caps Lock    */ K##_KEY_NONE(0x39) \
+    /* Option       */ K##_KEY_NONE(0x3a) \
+    /* Control      */ K##_KEY_NONE(0x3b) \
+    /* Right Shift  */ K##_KEY_NONE(0x3c) \
+    /* Right Option */ K##_KEY_NONE(0x3d) \
+    /* Right Control*/ K##_KEY_NONE(0x3e) \
+    /* Fn           */ K##_KEY_NONE(0x3f) \
+    /* F17          */ K##_KEY_NONE(0x40) \
+    /* Keypad .     */ K##_KEY_0(0x41, KEYMAP_CHAR('.')) \
+    /* (unused)     */ K##_KEY_NONE(0x42) \
+    /* Keypad *     */ K##_KEY_0(0x43, KEYMAP_CHAR('*')) \
+    /* (unused)     */ K##_KEY_NONE(0x44) \
+    /* Keypad +     */ K##_KEY_0(0x45, KEYMAP_CHAR('+')) \
+    /* (unused)     */ K##_KEY_NONE(0x46) \
+    /* Keypad Clear */ K##_KEY_0(0x47, KEYMAP_CHAR(0x1b)) \
+    /* Volume Up    */ K##_KEY_NONE(0x48) \
+    /* Volume Down  */ K##_KEY_NONE(0x49) \
+    /* Mute         */ K##_KEY_NONE(0x4a) \
+    /* Keypad /     */ K##_KEY_3(0x4b, KEYMAP_PUNCTUATION_MASK, \
+                           KEYMAP_CHAR('/'), KEYMAP_CHAR('\\'), KEYMAP_CHAR('/'), KEYMAP_CHAR(0x1c), \
+                           KEYMAP_CHAR('/'), KEYMAP_CHAR('\\'), KEYMAP_CHAR(0x00), KEYMAP_PAIR(0x0a, 0x00)) \
+    /* Keypad Enter */ K##_KEY_0(0x4c, KEYMAP_CHAR(0x0d)) \
+    /* (unused)     */ K##_KEY_NONE(0x4d) \
+    /* Keypad -     */ K##_KEY_0(0x4e, KEYMAP_CHAR('-')) \
+    /* F18          */ K##_KEY_NONE(0x4f) \
+    /* F19          */ K##_KEY_NONE(0x50) \
+    /* Keypad =     */ K##_KEY_3(0x51, KEYMAP_PUNCTUATION_MASK, \
+                           KEYMAP_CHAR('='), KEYMAP_CHAR('|'), KEYMAP_CHAR('='), KEYMAP_CHAR(0x1c), \
+                           KEYMAP_CHAR('='), KEYMAP_CHAR('|'), KEYMAP_CHAR(0x00), KEYMAP_PAIR(0x18, 0x46)) \
+    /* Keypad 0     */ K##_KEY_0(0x52, KEYMAP_CHAR('0')) \
+    /* Keypad 1     */ K##_KEY_0(0x53, KEYMAP_CHAR('1')) \
+    /* Keypad 2     */ K##_KEY_0(0x54, KEYMAP_CHAR('2')) \
+    /* Keypad 3     */ K##_KEY_0(0x55, KEYMAP_CHAR('3')) \
+    /* Keypad 4     */ K##_KEY_0(0x56, KEYMAP_CHAR('4')) \
+    /* Keypad 5     */ K##_KEY_0(0x57, KEYMAP_CHAR('5')) \
+    /* Keypad 6     */ K##_KEY_0(0x58, KEYMAP_CHAR('6')) \
+    /* Keypad 7     */ K##_KEY_0(0x59, KEYMAP_CHAR('7')) \
+    /* F20          */ K##_KEY_NONE(0x5a) \
+    /* Keypad 8     */ K##_KEY_0(0x5b, KEYMAP_CHAR('8')) \
+    /* Keypad 9     */ K##_KEY_0(0x5c, KEYMAP_CHAR('9'))
+
+#define KEYMAP_KEYS_60_7E(K) \
+    /* F5           */ K##_KEY_0(0x60, KEYMAP_FUNCTION(0x24)) \
+    /* F6           */ K##_KEY_0(0x61, KEYMAP_FUNCTION(0x25)) \
+    /* F7           */ K##_KEY_0(0x62, KEYMAP_FUNCTION(0x26)) \
+    /* F3           */ K##_KEY_0(0x63, KEYMAP_FUNCTION(0x22)) \
+    /* F8           */ K##_KEY_0(0x64, KEYMAP_FUNCTION(0x27)) \
+    /* F9           */ K##_KEY_0(0x65, KEYMAP_FUNCTION(0x28)) \
+    /* Eisu         */ K##_KEY_NONE(0x66) \
+    /* F11          */ K##_KEY_0(0x67, KEYMAP_FUNCTION(0x2a)) \
+    /* Kana         */ K##_KEY_NONE(0x68) \
+    /* F13          */ K##_KEY_0(0x69, KEYMAP_FUNCTION(0x32)) \
+    /* F16          */ K##_KEY_0(0x6a, KEYMAP_FUNCTION(0x35)) \
+    /* F14          */ K##_KEY_0(0x6b, KEYMAP_FUNCTION(0x33)) \
+    /* (unused)     */ K##_KEY_NONE(0x6c) \
+    /* F10          */ K##_KEY_0(0x6d, KEYMAP_FUNCTION(0x29)) \
+    /* Application  */ K##_KEY_NONE(0x6e) \
+    /* F12          */ K##_KEY_0(0x6f, KEYMAP_FUNCTION(0x2b)) \
+    /* (unused)     */ K##_KEY_NONE(0x70) \
+    /* F15          */ K##_KEY_0(0x71, KEYMAP_FUNCTION(0x34)) \
+    /* Help         */ K##_KEY_NONE(0x72) \
+    /* Home         */ K##_KEY_0(0x73, KEYMAP_FUNCTION(0x2e)) \
+    /* Page Up      */ K##_KEY_0(0x74, KEYMAP_FUNCTION(0x30)) \
+    /* Forward Delete*/ K##_KEY_0(0x75, KEYMAP_FUNCTION(0x2d)) \
+    /* F4           */ K##_KEY_0(0x76, KEYMAP_FUNCTION(0x23)) \
+    /* End          */ K##_KEY_0(0x77, KEYMAP_FUNCTION(0x2f)) \
+    /* F2           */ K##_KEY_0(0x78, KEYMAP_FUNCTION(0x21)) \
+    /* Page Down    */ K##_KEY_0(0x79, KEYMAP_FUNCTION(0x31)) \
+    /* F1           */ K##_KEY_0(0x7a, KEYMAP_FUNCTION(0x20)) \
+    /* Left Arrow   */ K##_KEY_0(0x7b, KEYMAP_SYMBOL(0xac)) \
+    /* Right Arrow  */ K##_KEY_0(0x7c, KEYMAP_SYMBOL(0xae)) \
+    /* Down Arrow   */ K##_KEY_0(0x7d, KEYMAP_SYMBOL(0xaf)) \
+    /* Up Arrow     */ K##_KEY_0(0x7e, KEYMAP_SYMBOL(0xad))
+
+//
+// The keys that differ between layouts.  The extra ISO key next to 1 (the
+// PC's ` key arrives as ADB 0x0a) gives section and plus-minus on ISO
+// keyboards; JIS keyboards add yen, ro and a keypad comma.  Eisu and kana
+// switch input modes and generate no characters on any layout.
+//
+
+#define KEYMAP_ANSI_KEYS(K) \
+    KEYMAP_KEYS_00_09(K) \
+    /* ISO section  */ K##_KEY_1(0x0a, KEYMAP_SHIFT_MASK, KEYMAP_CHAR('<'), KEYMAP_CHAR('>')) \
+    KEYMAP_KEYS_0B_5C(K) \
+    /* Yen          */ K##_KEY_NONE(0x5d) \
+    /* Ro           */ K##_KEY_NONE(0x5e) \
+    /* Keypad ,     */ K##_KEY_NONE(0x5f) \
+    KEYMAP_KEYS_60_7E(K)
+
+#define KEYMAP_ISO_KEYS(K) \
+    KEYMAP_KEYS_00_09(K) \
+    /* ISO section  */ K##_KEY_1(0x0a, KEYMAP_SHIFT_MASK, KEYMAP_CHAR(0xa7), KEYMAP_CHAR(0xd1)) \
+    KEYMAP_KEYS_0B_5C(K) \
+    /* Yen          */ K##_KEY_NONE(0x5d) \
+    /* Ro           */ K##_KEY_NONE(0x5e) \
+    /* Keypad ,     */ K##_KEY_NONE(0x5f) \
+    KEYMAP_KEYS_60_7E(K)
+
+#define KEYMAP_JIS_KEYS(K) \
+    KEYMAP_KEYS_00_09(K) \
+    /* ISO section  */ K##_KEY_1(0x0a, KEYMAP_SHIFT_MASK, KEYMAP_CHAR('<'), KEYMAP_CHAR('>')) \
+    KEYMAP_KEYS_0B_5C(K) \
+    /* Yen          */ K##_KEY_1(0x5d, KEYMAP_SHIFT_MASK, KEYMAP_CHAR(0xa5), KEYMAP_CHAR('|')) \
+    /* Ro           */ K##_KEY_1(0x5e, KEYMAP_SHIFT_MASK, KEYMAP_CHAR('_'), KEYMAP_CHAR('_')) \
+    /* Keypad ,     */ K##_KEY_0(0x5f, KEYMAP_CHAR(',')) \
+    KEYMAP_KEYS_60_7E(K)
+
+//
+// Modifiers, sequences and special keys are common to every layout.  Caps
+// lock isn't a modifier here: it is a special key, so that IOHIKeyboard
+// toggles it (and its LED) rather than treating it as held.
+//
+
+#define KEYMAP_NUMERIC_PAD_KEYS(K) \
+    K##_KEYCODE(0x52) K##_KEYCODE(0x41) K##_KEYCODE(0x4c) K##_KEYCODE(0x53) \
+    K##_KEYCODE(0x54) K##_KEYCODE(0x55) K##_KEYCODE(0x45) K##_KEYCODE(0x58) \
+    K##_KEYCODE(0x57) K##_KEYCODE(0x56) K##_KEYCODE(0x5b) K##_KEYCODE(0x5c) \
+    K##_KEYCODE(0x43) K##_KEYCODE(0x4b) K##_KEYCODE(0x51) K##_KEYCODE(0x7b) \
+    K##_KEYCODE(0x7d) K##_KEYCODE(0x7e) K##_KEYCODE(0x7c) K##_KEYCODE(0x4e) \
+    K##_KEYCODE(0x59)
+
+#define KEYMAP_MODIFIERS(K) \
+    K##_MODIFIER(NX_MODIFIERKEY_SHIFT, 0x38) \
+    K##_MODIFIER(NX_MODIFIERKEY_CONTROL, 0x3b) \
+    K##_MODIFIER(NX_MODIFIERKEY_ALTERNATE, 0x3a) \
+    K##_MODIFIER(NX_MODIFIERKEY_COMMAND, 0x37) \
+    K##_MODIFIER_KEYS(NX_MODIFIERKEY_NUMERICPAD, KEYMAP_NUMERIC_PAD_KEYS) \
+    K##_MODIFIER(NX_MODIFIERKEY_HELP, 0x72) \
+    K##_MODIFIER(NX_MODIFIERKEY_RSHIFT, 0x3c) \
+    K##_MODIFIER(NX_MODIFIERKEY_RCONTROL, 0x3e) \
+    K##_MODIFIER(NX_MODIFIERKEY_RALTERNATE, 0x3d) \
+    K##_MODIFIER(NX_MODIFIERKEY_RCOMMAND, 0x36)
+
+#define KEYMAP_COMMAND_SEQUENCE(K, c) \
+    K##_SEQUENCE_2(KEYMAP_PAIR(kKeymapSetModifier, NX_MODIFIERKEY_COMMAND), KEYMAP_CHAR(c))
+
+#define KEYMAP_SEQUENCES(K) \
+    KEYMAP_COMMAND_SEQUENCE(K, '1') KEYMAP_COMMAND_SEQUENCE(K, '2') \
+    KEYMAP_COMMAND_SEQUENCE(K, '3') KEYMAP_COMMAND_SEQUENCE(K, '4') \
+    KEYMAP_COMMAND_SEQUENCE(K, '5') KEYMAP_COMMAND_SEQUENCE(K, '6') \
+    KEYMAP_COMMAND_SEQUENCE(K, '7') KEYMAP_COMMAND_SEQUENCE(K, '8') \
+    KEYMAP_COMMAND_SEQUENCE(K, '9') KEYMAP_COMMAND_SEQUENCE(K, '0') \
+    KEYMAP_COMMAND_SEQUENCE(K, '-') KEYMAP_COMMAND_SEQUENCE(K, '=') \
+    KEYMAP_COMMAND_SEQUENCE(K, 'p') KEYMAP_COMMAND_SEQUENCE(K, ']') \
+    KEYMAP_COMMAND_SEQUENCE(K, '[')
+
+//
+// The arrow keys aren't special keys (NX_UP_ARROW_KEY, NX_DOWN_ARROW_KEY):
+// they generate double up/down scroll events in both carbon and cocoa apps.
+// The clear key doubles as num lock.
+//
+
+#define KEYMAP_SPECIALS(K) \
+    K##_SPECIAL(NX_KEYTYPE_CAPS_LOCK, 0x39) \
+    K##_SPECIAL(NX_KEYTYPE_HELP, 0x72) \
+    K##_SPECIAL(NX_POWER_KEY, 0x7f) \
+    K##_SPECIAL(NX_KEYTYPE_MUTE, 0x4a) \
+    K##_SPECIAL(NX_KEYTYPE_SOUND_UP, 0x48) \
+    K##_SPECIAL(NX_KEYTYPE_SOUND_DOWN, 0x49) \
+    K##_SPECIAL(NX_KEYTYPE_REWIND, kSpecialPrevious) /* previous track */ \
+    K##_SPECIAL(NX_KEYTYPE_PLAY, kSpecialPlay) \
+    K##_SPECIAL(NX_KEYTYPE_FAST, kSpecialNext) /* next track */ \
+    K##_SPECIAL(NX_KEYTYPE_NUM_LOCK, 0x47)
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Expansions.
+//
+
+// KEYMAP_EMIT: the bytes of the keymap.
+#define KEYMAP_EMIT_KEY_NONE(code)                  0xFF,
+#define KEYMAP_EMIT_KEY_0(code, p0)                 0x00, KEYMAP_PAIR_BYTES(p0),
+#define KEYMAP_EMIT_KEY_1(code, mask, p0, p1) \
+    (mask), KEYMAP_PAIR_BYTES(p0), KEYMAP_PAIR_BYTES(p1),
+#define KEYMAP_EMIT_KEY_2(code, mask, p0, p1, p2, p3) \
+    (mask), KEYMAP_PAIR_BYTES(p0), KEYMAP_PAIR_BYTES(p1), \
+            KEYMAP_PAIR_BYTES(p2), KEYMAP_PAIR_BYTES(p3),
+#define KEYMAP_EMIT_KEY_3(code, mask, p0, p1, p2, p3, p4, p5, p6, p7) \
+    (mask), KEYMAP_PAIR_BYTES(p0), KEYMAP_PAIR_BYTES(p1), \
+            KEYMAP_PAIR_BYTES(p2), KEYMAP_PAIR_BYTES(p3), \
+            KEYMAP_PAIR_BYTES(p4), KEYMAP_PAIR_BYTES(p5), \
+            KEYMAP_PAIR_BYTES(p6), KEYMAP_PAIR_BYTES(p7),
+#define KEYMAP_EMIT_KEYCODE(code)                   (code),
+#define KEYMAP_EMIT_MODIFIER(modifier, code)        (modifier), 1, (code),
+#define KEYMAP_EMIT_MODIFIER_KEYS(modifier, KEYS)   (modifier), (0 KEYS(KEYMAP_COUNT)), KEYS(KEYMAP_EMIT)
+#define KEYMAP_EMIT_SEQUENCE_2(p0, p1)              2, KEYMAP_PAIR_BYTES(p0), KEYMAP_PAIR_BYTES(p1),
+#define KEYMAP_EMIT_SPECIAL(type, code)             (type), (code),
+
+// KEYMAP_COUNT: + 1 per entry.
+#define KEYMAP_COUNT_KEY_NONE(code)                             + 1
+#define KEYMAP_COUNT_KEY_0(code, p0)                            + 1
+#define KEYMAP_COUNT_KEY_1(code, mask, p0, p1)                  + 1
+#define KEYMAP_COUNT_KEY_2(code, mask, p0, p1, p2, p3)          + 1
+#define KEYMAP_COUNT_KEY_3(code, mask, p0, p1, p2, p3, p4, p5, p6, p7) + 1
+#define KEYMAP_COUNT_KEYCODE(code)                              + 1
+#define KEYMAP_COUNT_MODIFIER(modifier, code)                   + 1
+#define KEYMAP_COUNT_MODIFIER_KEYS(modifier, KEYS)              + 1
+#define KEYMAP_COUNT_SEQUENCE_2(p0, p1)                         + 1
+#define KEYMAP_COUNT_SPECIAL(type, code)                        + 1
+
+// KEYMAP_SIZE: + the size of each entry, in bytes.
+#define KEYMAP_SIZE_KEY_NONE(code)                              + 1
+#define KEYMAP_SIZE_KEY_0(code, p0)                             + 3
+#define KEYMAP_SIZE_KEY_1(code, mask, p0, p1)                   + 5
+#define KEYMAP_SIZE_KEY_2(code, mask, p0, p1, p2, p3)           + 9
+#define KEYMAP_SIZE_KEY_3(code, mask, p0, p1, p2, p3, p4, p5, p6, p7) + 17
+#define KEYMAP_SIZE_MODIFIER(modifier, code)                    + 3
+#define KEYMAP_SIZE_MODIFIER_KEYS(modifier, KEYS)               + 2 KEYS(KEYMAP_COUNT)
+#define KEYMAP_SIZE_SEQUENCE_2(p0, p1)                          + 5
+#define KEYMAP_SIZE_SPECIAL(type, code)                         + 2
+
+// KEYMAP_ORDER: an enumerator per key, kKey_<code>, numbered by position.
+#define KEYMAP_ORDER_KEY_NONE(code)                             kKey_##code,
+#define KEYMAP_ORDER_KEY_0(code, p0)                            kKey_##code,
+#define KEYMAP_ORDER_KEY_1(code, mask, p0, p1)                  kKey_##code,
+#define KEYMAP_ORDER_KEY_2(code, mask, p0, p1, p2, p3)          kKey_##code,
+#define KEYMAP_ORDER_KEY_3(code, mask, p0, p1, p2, p3, p4, p5, p6, p7) kKey_##code,
+
+// KEYMAP_MISPLACED: + 1 per key whose position isn't its key code.
+#define KEYMAP_MISPLACED_KEY_NONE(code)                         + (kKey_##code != (code))
+#define KEYMAP_MISPLACED_KEY_0(code, p0)                        + (kKey_##code != (code))
+#define KEYMAP_MISPLACED_KEY_1(code, mask, p0, p1)              + (kKey_##code != (code))
+#define KEYMAP_MISPLACED_KEY_2(code, mask, p0, p1, p2, p3)      + (kKey_##code != (code))
+#define KEYMAP_MISPLACED_KEY_3(code, mask, p0, p1, p2, p3, p4, p5, p6, p7) + (kKey_##code != (code))
+
+// KEYMAP_MISCOUNTED: + 1 per key with the wrong number of pairs for its mask.
+#define KEYMAP_MISCOUNTED_KEY_NONE(code)
+#define KEYMAP_MISCOUNTED_KEY_0(code, p0)
+#define KEYMAP_MISCOUNTED_KEY_1(code, mask, p0, p1)             + (KEYMAP_BITS(mask) != 1)
+#define KEYMAP_MISCOUNTED_KEY_2(code, mask, p0, p1, p2, p3)     + (KEYMAP_BITS(mask) != 2)
+#define KEYMAP_MISCOUNTED_KEY_3(code, mask, p0, p1, p2, p3, p4, p5, p6, p7) + (KEYMAP_BITS(mask) != 3)
+
+// KEYMAP_DEFINED: | a bit per modifier, or per special key type.
+#define KEYMAP_DEFINED_MODIFIER(modifier, code)                 | (1U << (modifier))
+#define KEYMAP_DEFINED_MODIFIER_KEYS(modifier, KEYS)            | (1U << (modifier))
+#define KEYMAP_DEFINED_SPECIAL(type, code)                      | (1U << (type))
+
+//
+// Defines a keymap, name, from a list of keys, and the checks on it.  The
+// checks are typedefs of arrays whose size is negative if the check fails, so
+// that a broken keymap doesn't build; the typedef's name says what is wrong.
+//
+
+#define KEYMAP_DEFINE(name, KEYS) \
+static const unsigned char name[] = \
+{ \
+    0x00, 0x00, \
+    (0 KEYMAP_MODIFIERS(KEYMAP_COUNT)), KEYMAP_MODIFIERS(KEYMAP_EMIT) \
+    (0 KEYS(KEYMAP_COUNT)), KEYS(KEYMAP_EMIT) \
+    (0 KEYMAP_SEQUENCES(KEYMAP_COUNT)), KEYMAP_SEQUENCES(KEYMAP_EMIT) \
+    (0 KEYMAP_SPECIALS(KEYMAP_COUNT)), KEYMAP_SPECIALS(KEYMAP_EMIT) \
+}; \
+struct name##Checks \
+{ \
+    enum { KEYS(KEYMAP_ORDER) kKeyCount }; \
+    enum \
+    { \
+        kMisplaced  = 0 KEYS(KEYMAP_MISPLACED), \
+        kMiscounted = 0 KEYS(KEYMAP_MISCOUNTED), \
+        kSize       = 2 + 4 KEYMAP_MODIFIERS(KEYMAP_SIZE) KEYS(KEYMAP_SIZE) \
+                        KEYMAP_SEQUENCES(KEYMAP_SIZE) KEYMAP_SPECIALS(KEYMAP_SIZE) \
+    }; \
+    typedef char KeysListedInOrder[(kMisplaced == 0) ? 1 : -1]; \
+    typedef char KeysDefinedUpTo0x7E[(kKeyCount == kKeymapKeyCount) ? 1 : -1]; \
+    typedef char KeysHaveAPairPerModifierCombination[(kMiscounted == 0) ? 1 : -1]; \
+    typedef char ModifiersDefinedOnce[(KEYMAP_BITS(0 KEYMAP_MODIFIERS(KEYMAP_DEFINED)) == \
+                                       (0 KEYMAP_MODIFIERS(KEYMAP_COUNT))) ? 1 : -1]; \
+    typedef char SpecialKeysDefinedOnce[(KEYMAP_BITS(0U KEYMAP_SPECIALS(KEYMAP_DEFINED)) == \
+                                         (0 KEYMAP_SPECIALS(KEYMAP_COUNT))) ? 1 : -1]; \
+    typedef char SizeAddsUp[(sizeof(name) == kSize) ? 1 : -1]; \
+}
+
+KEYMAP_DEFINE(KeymapANSI, KEYMAP_ANSI_KEYS);
+KEYMAP_DEFINE(KeymapISO,  KEYMAP_ISO_KEYS);
+KEYMAP_DEFINE(KeymapJIS,  KEYMAP_JIS_KEYS);
+
+#endif /* !_GENERICPS2KEYMAP_H */
@@ -0,0 +1,250 @@
+#ifndef _GENERICPS2SCANCODEDECODER_H
+#define _GENERICPS2SCANCODEDECODER_H
+
+#ifdef KERNEL
+#include "ApplePS2Device.h"
+#else
+#include <stdint.h>
+typedef uint8_t  UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+#define kSC_Extend              0xE0
+#define kSC_Pause               0xE1
+#define kSC_UpBit               0x80
+#endif
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Scan code decoder.
+//
+// The byte stream from the keyboard is decoded by a small deterministic state
+// machine.  Every (state, byte) pair has a precomputed transition giving the
+// next state, the action to take, and the key code (in the 0x00-0x7F space
+// used to index PS2ToADBMap) together with its up bit.  Decoding a byte is a
+// single indexed load; the table is generated by the compiler from the macros
+// below, so there is no runtime initialisation and nothing to get out of sync.
+//
+// States:
+//
+// o  Idle:   no prefix seen; plain scan codes map straight to key codes.
+// o  Extend: an E0 prefix was seen (or the second byte of an E1 sequence);
+//            the next byte is looked up in the extended conversion table.
+// o  Pause:  an E1 prefix was seen.  The next byte (1D / 9D) is useless data,
+//            and the byte after that (45 / C5) finishes the Pause Key.
+//
+// The Pause Key sequence actually sent to us by the keyboard is:
+//
+// 1. E1  Extended Sequence for Pause Key
+// 2. 1D  Useless Data, with Up Bit Cleared
+// 3. 45  Pause Key, with Up Bit Cleared
+// 4. E1  Extended Sequence for Pause Key
+// 5. 9D  Useless Data, with Up Bit Set
+// 6. C5  Pause Key, with Up Bit Set
+//
+// The reason items 4 through 6 are sent with the Pause Key is because the
+// keyboard hardware never generates a release code for the Pause Key and
+// the designers are being smart about it.  The sequence above translates
+// to this parser as two separate events, as it should be -- one down key
+// event and one up key event (for the Pause Key).
+//
+// PrintScreen (and the gray navigation keys, with NumLock or Shift active)
+// are wrapped in fake shift sequences, E0 2A / E0 AA and E0 B6 / E0 36.  The
+// fake shifts decode to kDecodeActionNone explicitly; only the real key in
+// the middle (E0 37 / E0 B7 for PrintScreen) produces an event.  Any other
+// extended code we don't know decodes to kDecodeActionUnknown, so that it
+// can be counted.
+//
+
+enum
+{
+    kDecodeStateIdle,
+    kDecodeStateExtend,
+    kDecodeStatePause,
+    kDecodeStateCount
+};
+
+enum
+{
+    kDecodeActionNone,
+    kDecodeActionKey,
+    kDecodeActionUnknown
+};
+
+//
+// A transition is packed into 16 bits:
+//
+//   bits  0-6   key code
+//   bit   7     up bit (same position as kSC_UpBit)
+//   bits  8-9   action
+//   bits 10-11  next state
+//
+// The next state is stored so that (transition >> 2) & kDecodeRowMask is the
+// offset of the next state's row, ready to be OR'd with the next byte.
+//
+
+typedef UInt16 ScancodeTransition;
+
+#define kDecodeRowMask          0x0300
+#define kDecodeRowIdle          (kDecodeStateIdle << 8)     // row of the idle state
+#define kDecodeKeyCodeMask      0x7F
+
+#define DECODE_TRANSITION(next, action, upBit, keyCode) \
+((ScancodeTransition)(((next) << 10) | ((action) << 8) | (upBit) | (keyCode)))
+
+#define DECODE_KEYCODE(t)       ((t) & kDecodeKeyCodeMask)
+#define DECODE_GOING_DOWN(t)    (((t) & kSC_UpBit) == 0)
+#define DECODE_ACTION(t)        (((t) >> 8) & 0x3)
+#define DECODE_NEXT_ROW(t)      (((t) >> 2) & kDecodeRowMask)
+
+//
+// Convert certain extended codes on the PC keyboard into single key codes,
+// in the otherwise unused 0x60-0x7F range of PS2ToADBMap.  Zero means the
+// extended code is ignored.  Key codes are physical keys; the alt/windows
+// swap and other remapping happens later, in the key translation table.
+// New ones must avoid the plain scan codes that international keyboards
+// send in that range: 70 (kana), 73 (ro, ABNT2 /?), 79 (henkan), 7B
+// (muhenkan), 7D (yen) and 7E (ABNT2 keypad .).
+//
+
+#define DECODE_EXTENDED_KEYCODE(c) \
+( (c) == 0x1D ? 0x60 : /* ctrl */ \
+  (c) == 0x38 ? 0x61 : /* right alt */ \
+  (c) == 0x1C ? 0x62 : /* enter */ \
+  (c) == 0x35 ? 0x63 : /* / */ \
+  (c) == 0x48 ? 0x64 : /* up arrow */ \
+  (c) == 0x50 ? 0x65 : /* down arrow */ \
+  (c) == 0x4B ? 0x66 : /* left arrow */ \
+  (c) == 0x4D ? 0x67 : /* right arrow */ \
+  (c) == 0x52 ? 0x68 : /* insert */ \
+  (c) == 0x53 ? 0x69 : /* delete */ \
+  (c) == 0x49 ? 0x6A : /* page up */ \
+  (c) == 0x51 ? 0x6B : /* page down */ \
+  (c) == 0x47 ? 0x6C : /* home */ \
+  (c) == 0x4F ? 0x6D : /* end */ \
+  (c) == 0x37 ? 0x6E : /* PrintScreen */ \
+  (c) == 0x45 ? 0x6F : /* Pause */ \
+  (c) == 0x5D ? 0x72 : /* Application */ \
+  (c) == 0x5B ? 0x70 : /* left windows/command */ \
+  (c) == 0x5C ? 0x71 : /* right windows/command */ \
+  (c) == 0x30 ? 0x75 : /* E030 = volume up */ \
+  (c) == 0x2e ? 0x7e : /* E02E = volume down */ \
+  (c) == 0x20 ? 0x7f : /* E020 = volume mute */ \
+  (c) == 0x5e ? 0x7c : /* E05E = power */ \
+  (c) == 0x5f ? 0x74 : /* E05F = sleep */ \
+  0 ) /* 2A/36 fake shifts and anything unknown */
+
+#define DECODE_FAKE_SHIFT(c)    ((c) == 0x2A || (c) == 0x36)
+
+#define DECODE_PREFIX(b, otherwise) \
+( (b) == kSC_Extend ? DECODE_TRANSITION(kDecodeStateExtend, kDecodeActionNone, 0, 0) : \
+  (b) == kSC_Pause  ? DECODE_TRANSITION(kDecodeStatePause, kDecodeActionNone, 0, 0) : \
+  (otherwise) )
+
+#define DECODE_IDLE(b) DECODE_PREFIX(b, \
+  ((b) & ~kSC_UpBit) == 0 \
+    ? DECODE_TRANSITION(kDecodeStateIdle, kDecodeActionNone, 0, 0) \
+    : DECODE_TRANSITION(kDecodeStateIdle, kDecodeActionKey, (b) & kSC_UpBit, \
+                        (b) & ~kSC_UpBit))
+
+#define DECODE_EXTEND(b) DECODE_PREFIX(b, \
+  DECODE_FAKE_SHIFT((b) & ~kSC_UpBit) \
+    ? DECODE_TRANSITION(kDecodeStateIdle, kDecodeActionNone, 0, 0) \
+  : DECODE_EXTENDED_KEYCODE((b) & ~kSC_UpBit) == 0 \
+    ? DECODE_TRANSITION(kDecodeStateIdle, kDecodeActionUnknown, 0, 0) \
+    : DECODE_TRANSITION(kDecodeStateIdle, kDecodeActionKey, (b) & kSC_UpBit, \
+                        DECODE_EXTENDED_KEYCODE((b) & ~kSC_UpBit)))
+
+#define DECODE_PAUSE(b) DECODE_PREFIX(b, \
+  DECODE_TRANSITION(kDecodeStateExtend, kDecodeActionNone, 0, 0))
+
+#define DECODE_ROW16(F, hi) \
+  F((hi)+0x0), F((hi)+0x1), F((hi)+0x2), F((hi)+0x3), \
+  F((hi)+0x4), F((hi)+0x5), F((hi)+0x6), F((hi)+0x7), \
+  F((hi)+0x8), F((hi)+0x9), F((hi)+0xA), F((hi)+0xB), \
+  F((hi)+0xC), F((hi)+0xD), F((hi)+0xE), F((hi)+0xF)
+
+#define DECODE_ROW(F) \
+  DECODE_ROW16(F, 0x00), DECODE_ROW16(F, 0x10), \
+  DECODE_ROW16(F, 0x20), DECODE_ROW16(F, 0x30), \
+  DECODE_ROW16(F, 0x40), DECODE_ROW16(F, 0x50), \
+  DECODE_ROW16(F, 0x60), DECODE_ROW16(F, 0x70), \
+  DECODE_ROW16(F, 0x80), DECODE_ROW16(F, 0x90), \
+  DECODE_ROW16(F, 0xA0), DECODE_ROW16(F, 0xB0), \
+  DECODE_ROW16(F, 0xC0), DECODE_ROW16(F, 0xD0), \
+  DECODE_ROW16(F, 0xE0), DECODE_ROW16(F, 0xF0)
+
+//
+// The table is indexed by (state row | byte).
+//
+
+static const ScancodeTransition ScancodeDecoderTable[kDecodeStateCount * 0x100] =
+{
+    DECODE_ROW(DECODE_IDLE),
+    DECODE_ROW(DECODE_EXTEND),
+    DECODE_ROW(DECODE_PAUSE)
+};
+
+static inline ScancodeTransition decodeScancode(UInt16 * row, UInt8 scanCode)
+{
+    ScancodeTransition transition = ScancodeDecoderTable[*row | scanCode];
+    *row = DECODE_NEXT_ROW(transition);
+    return transition;
+}
+
+//
+// Batch decoding, for whole buffers of bytes: replayed traces, and any
+// future batched read from the controller.  The work loop decodes a byte at
+// a time, since the table load overlaps the translation that follows it.
+//
+// Most of a typing stream is plain make and break codes in the idle state,
+// and the transition for those is just the byte with the key action set, so
+// the decoder tests eight bytes at a time, as one 64-bit word, for a prefix
+// byte (E0, E1) or a zero key code (00, 80), and only goes through the table
+// for the words that have one, or while a sequence is in progress.
+//
+
+typedef char DecodePlainIsByteAndAction[
+    DECODE_TRANSITION(kDecodeStateIdle, kDecodeActionKey, kSC_UpBit, 0x7F) == 0x1FF ? 1 : -1];
+
+#define DECODE_ONES             0x0101010101010101ULL
+#define DECODE_HIGHS            0x8080808080808080ULL
+#define DECODE_HAS_ZERO(w)      (((w) - DECODE_ONES) & ~(w) & DECODE_HIGHS)
+
+static inline bool decodeWordIsPlain(UInt64 word)
+{
+    UInt64 keyCodes = word & ~DECODE_HIGHS;                                 // 00 or 80 -> 00
+    UInt64 prefixes = (word & ~DECODE_ONES) ^ (DECODE_ONES * kSC_Extend);   // E0 or E1 -> 00
+    
+    return !DECODE_HAS_ZERO(keyCodes) && !DECODE_HAS_ZERO(prefixes);
+}
+
+//
+// Decodes count bytes, writing one transition per byte into out, exactly as
+// decodeScancode would one at a time.
+//
+
+static inline void decodeScancodes(UInt16 * row, const UInt8 * bytes, UInt32 count,
+                                   ScancodeTransition * out)
+{
+    UInt32 index = 0;
+    
+    while (count - index >= 8)
+    {
+        UInt64 word;
+        
+        __builtin_memcpy(&word, bytes + index, sizeof(word));
+        if (*row == kDecodeRowIdle && decodeWordIsPlain(word))
+        {
+            for (UInt32 end = index + 8; index < end; index++)
+                out[index] = DECODE_TRANSITION(kDecodeStateIdle, kDecodeActionKey, 0, 0) | bytes[index];
+            continue;
+        }
+        for (UInt32 end = index + 8; index < end; index++)
+            out[index] = decodeScancode(row, bytes[index]);
+    }
+    
+    for (; index < count; index++)
+        out[index] = decodeScancode(row, bytes[index]);
+}
+
+#endif /* !_GENERICPS2SCANCODEDECODER_H */
@@ -0,0 +1,165 @@
+#ifndef _GENERICPS2SCANCODERING_H
+#define _GENERICPS2SCANCODERING_H
+
+#ifdef KERNEL
+#include <libkern/OSTypes.h>
+#else
+#include <stdint.h>
+typedef uint8_t  UInt8;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+#endif
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Scan code ring.
+//
+// A fixed-size, lock-free, single-producer/single-consumer queue of raw scan
+// code bytes and their arrival times.  The interrupt action is the only
+// producer and the work loop is the only consumer, so each index is written
+// by one side only; a barrier orders the entry stores before the index store
+// that publishes them.  Nothing here depends on IOKit, so it builds on any
+// host with a GCC-compatible compiler.
+//
+
+struct ScancodeRingEntry
+{
+    UInt64 time;        // AbsoluteTime the byte arrived
+    UInt8  scanCode;
+};
+
+template <UInt32 Size>
+class ScancodeRing
+{
+    // Size must be a power of two, so that indices can wrap freely.
+    typedef char SizeIsPowerOfTwo[(Size & (Size - 1)) == 0 ? 1 : -1];
+
+    enum { kCacheLine = 64 };
+
+public:
+    void reset()
+    {
+        _head = 0;
+        _tail = 0;
+    }
+
+    //
+    // Producer side.  Returns false, dropping the byte, if the ring is full.
+    //
+
+    bool push(UInt8 scanCode, UInt64 time)
+    {
+        UInt32 head = _head;
+
+        if (head - _tail == Size)  return false;
+
+        _entries[head & (Size - 1)].time     = time;
+        _entries[head & (Size - 1)].scanCode = scanCode;
+        __sync_synchronize();
+        _head = head + 1;
+        return true;
+    }
+
+    //
+    // Consumer side.  Copies up to max of the oldest entries into out, frees
+    // their slots, and returns how many were copied.
+    //
+
+    UInt32 pop(ScancodeRingEntry * out, UInt32 max)
+    {
+        UInt32 tail  = _tail;
+        UInt32 count = _head - tail;
+
+        if (count > max)  count = max;
+        if (count == 0)   return 0;
+
+        __sync_synchronize();
+        for (UInt32 index = 0; index < count; index++)
+            out[index] = _entries[(tail + index) & (Size - 1)];
+        __sync_synchronize();
+        _tail = tail + count;
+        return count;
+    }
+
+    UInt32 count() const { return _head - _tail; }
+
+private:
+    volatile UInt32   _head;    // written by the producer only
+    char              _headPad[kCacheLine - sizeof(UInt32)];
+    volatile UInt32   _tail;    // written by the consumer only
+    char              _tailPad[kCacheLine - sizeof(UInt32)];
+    ScancodeRingEntry _entries[Size];
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Scan code capture.
+//
+// A fixed-size ring that keeps the most recent Size raw bytes and their
+// arrival times, for diagnosing dropped or stuck keys.  The interrupt action
+// is the only writer and never waits: it overwrites the oldest entry.  A
+// snapshot may be taken from any thread at any time; it copies the entries
+// and then throws away any the writer may have overwritten while it was
+// copying, so it never needs the writer to stop either.
+//
+
+template <UInt32 Size>
+class ScancodeCapture
+{
+    typedef char SizeIsPowerOfTwo[(Size & (Size - 1)) == 0 ? 1 : -1];
+
+public:
+    void reset()
+    {
+        _written = 0;
+    }
+
+    void record(UInt8 scanCode, UInt64 time)
+    {
+        UInt32 written = _written;
+
+        _entries[written & (Size - 1)].time     = time;
+        _entries[written & (Size - 1)].scanCode = scanCode;
+        __sync_synchronize();
+        _written = written + 1;
+    }
+
+    //
+    // Copies the captured entries, oldest first, into out (which must have
+    // room for Size entries) and returns how many were copied.
+    //
+
+    UInt32 snapshot(ScancodeRingEntry * out) const
+    {
+        UInt32 end   = _written;
+        UInt32 start = (end > Size) ? end - Size : 0;
+        UInt32 after;
+
+        __sync_synchronize();
+        for (UInt32 index = start; index != end; index++)
+            out[index - start] = _entries[index & (Size - 1)];
+        __sync_synchronize();
+
+        //
+        // The writer may have been storing entry "after" (unpublished) and
+        // everything before it, into the slots of entries after - Size and
+        // earlier.
+        //
+
+        after = _written;
+        if (after - start >= Size)
+        {
+            UInt32 lost = after - start - Size + 1;
+
+            if (lost >= end - start)  return 0;
+            for (UInt32 index = lost; index < end - start; index++)
+                out[index - lost] = out[index];
+            return end - start - lost;
+        }
+        return end - start;
+    }
+
+private:
+    volatile UInt32   _written;     // entries ever recorded
+    ScancodeRingEntry _entries[Size];
+};
+
+#endif /* !_GENERICPS2SCANCODERING_H */
@@ -0,0 +1,138 @@
+#ifndef _GENERICPS2SCANCODETRACE_H
+#define _GENERICPS2SCANCODETRACE_H
+
+#include "GenericPS2ScancodeRing.h"
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Scan code trace format.
+//
+// A capture is exported as the "Scan code trace" data property, in a compact
+// format that can be saved straight to disk (eg. from ioreg -a) and replayed
+// elsewhere:
+//
+//   'P' 'S' '2' 'T'      magic
+//   version              one byte, kScancodeTraceVersion
+//   records...           until the end of the data
+//
+// Each record is the time since the previous record (since boot, for the
+// first) in nanoseconds, as an unsigned LEB128 varint, followed by the raw
+// byte as received from the keyboard.  A typing stream is usually 3 bytes
+// per record.
+//
+// Both the writer and the reader are free of IOKit, so the reader builds on
+// any host with a GCC-compatible compiler.
+//
+
+#define kScancodeTraceVersion           1
+#define kScancodeTraceHeaderSize        5
+#define kScancodeTraceMaxRecordSize     11      // 10 byte varint + scan code
+
+class ScancodeTraceWriter
+{
+public:
+    //
+    // Writes the header into buffer; returns false if it doesn't fit.
+    //
+
+    bool begin(UInt8 * buffer, UInt32 capacity)
+    {
+        _buffer   = buffer;
+        _capacity = capacity;
+        _length   = 0;
+        _last     = 0;
+
+        if (capacity < kScancodeTraceHeaderSize)  return false;
+
+        _buffer[_length++] = 'P';
+        _buffer[_length++] = 'S';
+        _buffer[_length++] = '2';
+        _buffer[_length++] = 'T';
+        _buffer[_length++] = kScancodeTraceVersion;
+        return true;
+    }
+
+    //
+    // Appends a record; returns false, writing nothing, if it doesn't fit.
+    // Times must not go backwards.
+    //
+
+    bool append(UInt64 nanoseconds, UInt8 scanCode)
+    {
+        UInt64 delta = nanoseconds - _last;
+
+        if (_capacity - _length < kScancodeTraceMaxRecordSize)  return false;
+
+        while (delta >= 0x80)
+        {
+            _buffer[_length++] = (UInt8)(delta | 0x80);
+            delta >>= 7;
+        }
+        _buffer[_length++] = (UInt8)delta;
+        _buffer[_length++] = scanCode;
+        _last = nanoseconds;
+        return true;
+    }
+
+    UInt32 length() const { return _length; }
+
+private:
+    UInt8 * _buffer;
+    UInt32  _capacity;
+    UInt32  _length;
+    UInt64  _last;
+};
+
+class ScancodeTraceReader
+{
+public:
+    //
+    // Returns false if the data isn't a trace we understand.
+    //
+
+    bool begin(const UInt8 * data, UInt32 length)
+    {
+        _data   = data;
+        _length = length;
+        _offset = kScancodeTraceHeaderSize;
+        _time   = 0;
+
+        return length >= kScancodeTraceHeaderSize &&
+               data[0] == 'P' && data[1] == 'S' && data[2] == '2' && data[3] == 'T' &&
+               data[4] == kScancodeTraceVersion;
+    }
+
+    //
+    // Reads the next record; returns false at the end of the trace, or if
+    // the last record is truncated.
+    //
+
+    bool next(UInt64 * nanoseconds, UInt8 * scanCode)
+    {
+        UInt64 delta = 0;
+        UInt32 shift = 0;
+        UInt8  byte;
+
+        do
+        {
+            if (_offset >= _length || shift > 63)  return false;
+            byte   = _data[_offset++];
+            delta |= (UInt64)(byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+
+        if (_offset >= _length)  return false;
+
+        _time       += delta;
+        *nanoseconds = _time;
+        *scanCode    = _data[_offset++];
+        return true;
+    }
+
+private:
+    const UInt8 * _data;
+    UInt32        _length;
+    UInt32        _offset;
+    UInt64        _time;
+};
+
+#endif /* !_GENERICPS2SCANCODETRACE_H */
@@ -0,0 +1,259 @@
+//
+// Runs the driver's command path on the simulated controller: bring-up,
+// LED storms, typing through them, wake with the command byte kept or
+// changed, and stop.  For each, it reports the controller transactions and
+// bytes on the wire, the simulated time taken and spent blocked, the
+// requests allocated, and the host CPU time, the best of several rounds.
+//
+// The simulated figures are deterministic; every round must repeat them, and
+// the transaction counts are checked against what each path should cost.
+//
+
+#include <algorithm>
+#include "DriverHarness.h"
+
+#define kRounds                 15
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+struct ScenarioResult
+{
+    UInt32 requests;
+    UInt32 cutShort;
+    UInt32 bytes;
+    UInt64 simulatedNS;
+    UInt64 blockedNS;
+    UInt32 allocations;
+    UInt32 keysTyped;
+    UInt32 keysDispatched;
+    
+    bool operator==(const ScenarioResult & other) const
+    {
+        return requests == other.requests && cutShort == other.cutShort && bytes == other.bytes &&
+               simulatedNS == other.simulatedNS && blockedNS == other.blockedNS &&
+               allocations == other.allocations && keysTyped == other.keysTyped &&
+               keysDispatched == other.keysDispatched;
+    }
+};
+
+//
+// Measures from construction to finish(): the controller's counters, the
+// simulated clock and the host clock.
+//
+
+class Measurement
+{
+public:
+    Measurement(DriverHarness * harness) : _harness(harness)
+    {
+        _statistics = harness->controller->statistics;
+        _keyDowns   = harness->keyboard->hostKeyDowns;
+        _simulated  = hostTime();
+        _host       = hostNanoseconds();
+    }
+    
+    UInt64 finish(ScenarioResult * result)
+    {
+        UInt64                hostNS = hostNanoseconds() - _host;
+        const PS2Statistics & now    = _harness->controller->statistics;
+    
+        result->requests       = now.requests - _statistics.requests;
+        result->cutShort       = now.requestsCutShort - _statistics.requestsCutShort;
+        result->bytes          = now.bytesToKeyboard + now.bytesFromKeyboard -
+                                 _statistics.bytesToKeyboard - _statistics.bytesFromKeyboard;
+        result->simulatedNS    = hostTime() - _simulated;
+        result->blockedNS      = now.blockedNS - _statistics.blockedNS;
+        result->allocations    = now.allocations - _statistics.allocations;
+        result->keysDispatched = _harness->keyboard->hostKeyDowns - _keyDowns;
+        return hostNS;
+    }
+    
+private:
+    DriverHarness * _harness;
+    PS2Statistics   _statistics;
+    UInt32          _keyDowns;
+    UInt64          _simulated;
+    UInt64          _host;
+};
+
+static void startDriver(DriverHarness * harness)
+{
+    CHECK(harness->start());
+    CHECK(harness->runUntilIdle());
+    CHECK(harness->running());
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// The scenarios.  Each returns the host nanoseconds of its measured part.
+//
+
+static UInt64 scenarioStart(ScenarioResult * result)
+{
+    DriverHarness harness;
+    Measurement   measurement(&harness);
+    
+    startDriver(&harness);
+    return measurement.finish(result);
+}
+
+static UInt64 scenarioStartWithFaults(ScenarioResult * result)
+{
+    //
+    // Two resends, and the command byte changed under the first two reads.
+    //
+    
+    DriverHarness harness;
+    Measurement   measurement(&harness);
+    
+    harness.controller->faults.resends          = 2;
+    harness.controller->faults.commandByteRaces = 2;
+    startDriver(&harness);
+    return measurement.finish(result);
+}
+
+static UInt64 scenarioLEDStorm(ScenarioResult * result)
+{
+    //
+    // 32 lock changes at once, as from a key held down on a remote session.
+    //
+    
+    DriverHarness harness;
+    
+    startDriver(&harness);
+    
+    Measurement measurement(&harness);
+    for (int index = 0; index < 32; index++)
+        harness.keyboard->setAlphaLock(!(index & 1));
+    harness.runUntilIdle();
+    CHECK_EQUAL(harness.controller->keyboard.leds(), 0);
+    return measurement.finish(result);
+}
+
+static UInt64 scenarioTypingThroughLEDs(ScenarioResult * result)
+{
+    //
+    // 200 keystrokes 20 ms apart, with caps lock toggled every 100 ms.
+    //
+    
+    DriverHarness harness;
+    UInt64        started;
+    
+    startDriver(&harness);
+    started = hostTime();
+    for (int key = 0; key < 200; key++)
+    {
+        harness.controller->keyboard.type(0x1e, started + key * 20000000ULL);
+        harness.controller->keyboard.type(0x9e, started + key * 20000000ULL + 8000000);
+    }
+    
+    Measurement measurement(&harness);
+    for (int toggle = 0; toggle < 40; toggle++)
+    {
+        hostRunUntil(started + toggle * 100000000ULL + 3000000);
+        harness.keyboard->setAlphaLock(!(toggle & 1));
+    }
+    harness.runUntilIdle();
+    result->keysTyped = 200;
+    return measurement.finish(result);
+}
+
+static UInt64 scenarioWake(ScenarioResult * result, bool commandByteChanged)
+{
+    DriverHarness harness;
+    
+    startDriver(&harness);
+    harness.keyboard->setAlphaLock(true);
+    harness.runUntilIdle();
+    harness.controller->sleep();
+    if (commandByteChanged)
+        harness.controller->setWakeCommandByte(harness.controller->commandByte() ^ kCB_EnableMouseIRQ);
+    
+    Measurement measurement(&harness);
+    harness.controller->wake();
+    harness.runUntilIdle();
+    CHECK(harness.controller->keyboard.scanning());
+    CHECK_EQUAL(harness.controller->keyboard.leds(), 0x04);
+    return measurement.finish(result);
+}
+
+static UInt64 scenarioWakeKept(ScenarioResult * result)
+{
+    return scenarioWake(result, false);
+}
+
+static UInt64 scenarioWakeChanged(ScenarioResult * result)
+{
+    return scenarioWake(result, true);
+}
+
+static UInt64 scenarioStop(ScenarioResult * result)
+{
+    DriverHarness harness;
+    
+    startDriver(&harness);
+    
+    Measurement measurement(&harness);
+    harness.terminate();
+    CHECK(!harness.controller->keyboard.scanning());
+    return measurement.finish(result);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+struct Scenario
+{
+    const char * name;
+    UInt64       (*run)(ScenarioResult * result);
+    UInt32       requests;      // what the path should cost
+    UInt32       allocations;
+};
+
+static const Scenario kScenarios[] =
+{
+    { "start to running",    scenarioStart,             3,   kRequestPoolSize },
+    { "start with faults",   scenarioStartWithFaults,   7,   kRequestPoolSize },
+    { "LED storm x32",       scenarioLEDStorm,          2,   0 },
+    { "typing through LEDs", scenarioTypingThroughLEDs, 40,  0 },
+    { "wake",                scenarioWakeKept,          1,   1 },
+    { "wake, byte changed",  scenarioWakeChanged,       5,   2 },
+    { "stop",                scenarioStop,              3,   1 }
+};
+
+int main()
+{
+    printf("%-20s %8s %8s %6s %9s %9s %6s %6s %9s\n", "scenario", "requests", "cut", "bytes",
+           "simulated", "blocked", "allocs", "keys", "host");
+    printf("%-20s %8s %8s %6s %9s %9s %6s %6s %9s\n", "", "", "short", "", "ms", "ms", "",
+           "lost", "us");
+    
+    for (UInt32 index = 0; index < sizeof(kScenarios) / sizeof(kScenarios[0]); index++)
+    {
+        const Scenario & scenario = kScenarios[index];
+        ScenarioResult   first;
+        UInt64           best = ~0ULL;
+    
+        memset(&first, 0, sizeof(first));
+    
+        for (int round = 0; round < kRounds; round++)
+        {
+            ScenarioResult result;
+    
+            memset(&result, 0, sizeof(result));
+            best = std::min(best, scenario.run(&result));
+            if (round == 0)
+                first = result;
+            else
+                CHECK(result == first);
+        }
+    
+        printf("%-20s %8u %8u %6u %9.2f %9.2f %6u %6u %9.1f\n", scenario.name, first.requests,
+               first.cutShort, first.bytes, first.simulatedNS / 1e6, first.blockedNS / 1e6,
+               first.allocations, first.keysTyped - first.keysDispatched, best / 1e3);
+    
+        CHECK_EQUAL(first.requests, scenario.requests);
+        CHECK_EQUAL(first.allocations, scenario.allocations);
+    }
+    
+    CHECK_EQUAL(hostKernelStatistics.errors, 0);
+    return testResult("CommandPathBenchmark");
+}
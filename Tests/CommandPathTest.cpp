@@ -0,0 +1,505 @@
+//
+// Checks the simulated controller against the PS2Request semantics the
+// driver relies on -- order, compare aborts and commandsCount, timeouts,
+// resends, fire-and-forget, key data interleaved with responses -- and then
+// the driver's command path on it: start, typing and the key usage it
+// counts, LEDs, sleep and wake, and stop.
+//
+
+#include "DriverHarness.h"
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// A bare controller, and an interrupt action that keeps what it is given.
+//
+
+class ByteSink : public OSObject
+{
+public:
+    static void interrupt(void * target, UInt8 byte)
+    {
+        ((ByteSink *)target)->bytes.push_back(byte);
+    }
+    
+    std::vector<UInt8> bytes;
+};
+
+static UInt32 completions;
+
+static void countCompletion(void *, void *)
+{
+    completions++;
+}
+
+static PS2Request * newRequest(ApplePS2Controller * controller, const PS2Command * commands, UInt8 count)
+{
+    PS2Request * request = controller->allocateRequest();
+    
+    memcpy(request->commands, commands, count * sizeof(PS2Command));
+    request->commandsCount = count;
+    return request;
+}
+
+static void runRequest(ApplePS2Controller * controller, const PS2Command * commands, UInt8 count,
+                       UInt8 expected)
+{
+    PS2Request * request = newRequest(controller, commands, count);
+    
+    controller->submitRequestAndBlock(request);
+    CHECK_EQUAL(request->commandsCount, expected);
+    controller->freeRequest(request);
+}
+
+static const PS2Command kEcho[] =
+{
+    { kPS2C_WriteDataPort,          kDP_TestKeyboardEcho },
+    { kPS2C_ReadDataPortAndCompare, kDP_TestKeyboardEcho }
+};
+
+static const PS2Command kEnable[] =
+{
+    { kPS2C_WriteDataPort,          kDP_Enable },
+    { kPS2C_ReadDataPortAndCompare, kSC_Acknowledge }
+};
+
+static const PS2Command kLEDs[] =
+{
+    { kPS2C_WriteDataPort,          kDP_SetKeyboardLEDs },
+    { kPS2C_ReadDataPortAndCompare, kSC_Acknowledge },
+    { kPS2C_WriteDataPort,          0x04 },
+    { kPS2C_ReadDataPortAndCompare, kSC_Acknowledge }
+};
+
+#define COUNT(a)  (sizeof(a) / sizeof((a)[0]))
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static void testEcho()
+{
+    //
+    // A command and its response cross the wire once each.
+    //
+    
+    ApplePS2Controller * controller = new ApplePS2Controller;
+    UInt64               started    = hostTime();
+    
+    controller->init();
+    runRequest(controller, kEcho, COUNT(kEcho), COUNT(kEcho));
+    CHECK_EQUAL(hostTime() - started, 2 * controller->timing.wireByteNS + controller->timing.keyboardResponseNS);
+    CHECK_EQUAL(controller->statistics.requests, 1);
+    CHECK_EQUAL(controller->statistics.requestsBlocking, 1);
+    CHECK_EQUAL(controller->statistics.bytesToKeyboard, 1);
+    CHECK_EQUAL(controller->statistics.bytesFromKeyboard, 1);
+    CHECK_EQUAL(controller->statistics.blockedNS, hostTime() - started);
+    controller->release();
+}
+
+static void testCompareAbort()
+{
+    //
+    // A failed compare ends the request; commandsCount is its index, and
+    // nothing after it runs.
+    //
+    
+    static const PS2Command commands[] =
+    {
+        { kPS2C_WriteDataPort,          kDP_Enable },
+        { kPS2C_ReadDataPortAndCompare, kSC_Acknowledge },
+        { kPS2C_WriteDataPort,          kDP_TestKeyboardEcho },
+        { kPS2C_ReadDataPortAndCompare, 0x00 },
+        { kPS2C_WriteDataPort,          kDP_SetDefaultsAndDisable },
+        { kPS2C_ReadDataPortAndCompare, kSC_Acknowledge }
+    };
+    ApplePS2Controller * controller = new ApplePS2Controller;
+    
+    controller->init();
+    runRequest(controller, commands, COUNT(commands), 3);
+    CHECK(controller->keyboard.scanning());
+    CHECK_EQUAL(controller->statistics.requestsCutShort, 1);
+    CHECK_EQUAL(controller->statistics.commands, 4);
+    controller->release();
+}
+
+static void testTimeout()
+{
+    ApplePS2Controller * controller = new ApplePS2Controller;
+    UInt64               started    = hostTime();
+    
+    controller->init();
+    controller->faults.absent = true;
+    runRequest(controller, kEcho, COUNT(kEcho), 1);
+    CHECK_EQUAL(controller->statistics.readTimeouts, 1);
+    CHECK_EQUAL(hostTime() - started, controller->timing.commandPortNS + controller->timing.readTimeoutNS);
+    controller->release();
+}
+
+static void testResend()
+{
+    //
+    // The controller sends a byte the keyboard asks for again, a few times.
+    //
+    
+    ApplePS2Controller * controller = new ApplePS2Controller;
+    
+    controller->init();
+    controller->faults.resends = 2;
+    runRequest(controller, kLEDs, COUNT(kLEDs), COUNT(kLEDs));
+    CHECK_EQUAL(controller->statistics.resends, 2);
+    CHECK_EQUAL(controller->statistics.bytesToKeyboard, 4);
+    CHECK_EQUAL(controller->keyboard.leds(), 0x04);
+    
+    controller->faults.resends = kPS2MaxResends + 1;
+    runRequest(controller, kLEDs, COUNT(kLEDs), 1);
+    CHECK_EQUAL(controller->statistics.resends, 2 + kPS2MaxResends);
+    controller->faults.resends = 0;
+    controller->release();
+}
+
+static void testCommandByte()
+{
+    //
+    // The test-and-set the driver builds its command byte updates from.
+    //
+    
+    ApplePS2Controller * controller = new ApplePS2Controller;
+    UInt8                original;
+    PS2Request *         request;
+    
+    controller->init();
+    original = controller->commandByte();
+    
+    static const PS2Command read[] =
+    {
+        { kPS2C_WriteCommandPort, kCP_GetCommandByte },
+        { kPS2C_ReadDataPort,     0 }
+    };
+    request = newRequest(controller, read, COUNT(read));
+    controller->submitRequestAndBlock(request);
+    CHECK_EQUAL(request->commandsCount, 2);
+    CHECK_EQUAL(request->commands[1].inOrOut, original);
+    controller->freeRequest(request);
+    
+    PS2Command testAndSet[] =
+    {
+        { kPS2C_WriteCommandPort,       kCP_GetCommandByte },
+        { kPS2C_ReadDataPortAndCompare, (UInt8)(original ^ kCB_EnableMouseIRQ) },
+        { kPS2C_WriteCommandPort,       kCP_SetCommandByte },
+        { kPS2C_WriteDataPort,          (UInt8)(original | kCB_DisableKeyboardClock) }
+    };
+    runRequest(controller, testAndSet, COUNT(testAndSet), 1);
+    CHECK_EQUAL(controller->commandByte(), original);
+    
+    testAndSet[1].inOrOut = original;
+    runRequest(controller, testAndSet, COUNT(testAndSet), COUNT(testAndSet));
+    CHECK_EQUAL(controller->commandByte(), original | kCB_DisableKeyboardClock);
+    
+    //
+    // Another driver's write, between our read and our test-and-set.
+    //
+    
+    controller->faults.commandByteRaces = 1;
+    request = newRequest(controller, read, COUNT(read));
+    controller->submitRequestAndBlock(request);
+    testAndSet[1].inOrOut = request->commands[1].inOrOut;
+    testAndSet[3].inOrOut = original;
+    controller->freeRequest(request);
+    runRequest(controller, testAndSet, COUNT(testAndSet), 1);
+    CHECK_EQUAL(controller->commandByte(), original | kCB_DisableKeyboardClock | kCB_EnableMouseIRQ);
+    controller->release();
+}
+
+static void testCompletionAndFireAndForget()
+{
+    //
+    // Queued requests run in order; one with no completion routine is freed
+    // by the controller.
+    //
+    
+    ApplePS2Controller * controller = new ApplePS2Controller;
+    PS2Request *         first;
+    PS2Request *         second;
+    
+    controller->init();
+    first  = newRequest(controller, kEcho, COUNT(kEcho));
+    second = newRequest(controller, kEnable, COUNT(kEnable));
+    first->completionAction = countCompletion;
+    completions = 0;
+    
+    CHECK(controller->submitRequest(first));
+    CHECK(controller->submitRequest(second));
+    CHECK_EQUAL(controller->requestsOutstanding(), 2);
+    while (!controller->idle())  hostRunNext();
+    
+    CHECK_EQUAL(completions, 1);
+    CHECK_EQUAL(first->commandsCount, COUNT(kEcho));
+    CHECK(controller->keyboard.scanning());
+    CHECK_EQUAL(controller->statistics.frees, 1);
+    CHECK_EQUAL(controller->requestsOutstanding(), 1);
+    controller->freeRequest(first);
+    controller->release();
+}
+
+static void testInterleaving()
+{
+    //
+    // Between requests, keys go to the interrupt action.  A key typed while
+    // a command is on the wire waits for the response; one that gets ahead
+    // of it is read by the compare, which fails, and the response reaches
+    // the interrupt action.
+    //
+    
+    ApplePS2Controller * controller = new ApplePS2Controller;
+    ByteSink *           sink       = new ByteSink;
+    UInt8                key[]      = { 0x1e };
+    
+    controller->init();
+    controller->installInterruptAction(sink, ByteSink::interrupt);
+    runRequest(controller, kEnable, COUNT(kEnable), COUNT(kEnable));
+    
+    controller->keyboard.type(0x1e, hostTime() + 100000);
+    controller->keyboard.type(0x9e, hostTime() + 200000);
+    while (!controller->idle())  hostRunNext();
+    CHECK_EQUAL(sink->bytes.size(), 2);
+    CHECK_EQUAL(controller->statistics.interrupts, 2);
+    
+    controller->keyboard.type(0x1f, hostTime() + 500000);
+    runRequest(controller, kEcho, COUNT(kEcho), COUNT(kEcho));
+    while (!controller->idle())  hostRunNext();
+    CHECK_EQUAL(sink->bytes.size(), 3);
+    CHECK_EQUAL(sink->bytes.back(), 0x1f);
+    
+    controller->faults.beforeResponse.assign(key, key + 1);
+    runRequest(controller, kLEDs, COUNT(kLEDs), 1);
+    while (!controller->idle())  hostRunNext();
+    CHECK_EQUAL(sink->bytes.size(), 4);
+    CHECK_EQUAL(sink->bytes.back(), kSC_Acknowledge);
+    
+    controller->uninstallInterruptAction();
+    sink->release();
+    controller->release();
+}
+
+static void testKeyboardBuffer()
+{
+    //
+    // Keys typed while the keyboard is disabled are lost; with the clock
+    // held off, its buffer fills and overruns.
+    //
+    
+    static const PS2Command clockOff[] = { { kPS2C_WriteCommandPort, kCP_DisableKeyboardClock } };
+    ApplePS2Controller *    controller = new ApplePS2Controller;
+    
+    controller->init();
+    controller->keyboard.type(0x1e, hostTime());
+    while (!controller->idle())  hostRunNext();
+    CHECK_EQUAL(controller->statistics.keysLost, 1);
+    
+    runRequest(controller, kEnable, COUNT(kEnable), COUNT(kEnable));
+    runRequest(controller, clockOff, COUNT(clockOff), COUNT(clockOff));
+    for (UInt32 index = 0; index < kPS2KeyboardBufferSize + 4; index++)
+        controller->keyboard.type(0x1e, hostTime() + index * 1000);
+    while (!controller->idle())  hostRunNext();
+    CHECK_EQUAL(controller->statistics.keysLost, 5);
+    CHECK_EQUAL(controller->statistics.bytesFromKeyboard, 1);   // the acknowledge
+    controller->release();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// The driver.
+//
+
+static void testDriverStart()
+{
+    DriverHarness harness;
+    UInt64        started = hostTime();
+    
+    CHECK(harness.start());
+    CHECK_EQUAL(hostTime(), started);
+    CHECK(harness.runUntilIdle());
+    CHECK(harness.running());
+    
+    //
+    // Echo, command byte read, and the resume sequence.
+    //
+    
+    CHECK_EQUAL(harness.controller->statistics.requests, 3);
+    CHECK_EQUAL(harness.controller->statistics.requestsBlocking, 0);
+    CHECK_EQUAL(harness.controller->statistics.requestsCutShort, 0);
+    CHECK_EQUAL(harness.statistic("Start", "Start to running (us)"), (hostTime() - started) / 1000);
+    CHECK(harness.controller->keyboard.scanning());
+    CHECK_EQUAL(harness.controller->commandByte() & (kCB_EnableKeyboardIRQ | kCB_TranslateMode | kCB_DisableKeyboardClock),
+                kCB_EnableKeyboardIRQ | kCB_TranslateMode);
+}
+
+static void testDriverTyping()
+{
+    DriverHarness harness;
+    
+    CHECK(harness.start());
+    harness.runUntilIdle();
+    harness.controller->keyboard.type(0x1e, hostTime() + 1000000);
+    harness.controller->keyboard.type(0x9e, hostTime() + 50000000);
+    harness.runUntilIdle();
+    CHECK_EQUAL(harness.keyboard->hostKeyDowns, 1);
+    CHECK_EQUAL(harness.keyboard->hostKeyUps, 1);
+    CHECK_EQUAL(harness.controller->statistics.interrupts, 2);
+}
+
+static void testDriverKeyUsage()
+{
+    //
+    // Scroll lock is a momentary layer key; it is counted like any other key,
+    // though its presses never reach the superclass.
+    //
+    
+    DriverHarness  harness;
+    OSDictionary * layer    = OSDictionary::withCapacity(1);
+    OSArray *      keys     = OSArray::withCapacity(1);
+    OSArray *      layers   = OSArray::withCapacity(1);
+    OSNumber *     number   = OSNumber::withNumber(0x46, 32);
+    UInt64         started;
+    
+    keys->setObject(number);
+    layer->setObject("Momentary keys", keys);
+    layers->setObject(layer);
+    harness.keyboard->setProperty("Layers", layers);
+    layers->release();
+    layer->release();
+    keys->release();
+    number->release();
+    
+    CHECK(harness.start());
+    harness.runUntilIdle();
+    started = hostTime();
+    harness.controller->keyboard.type(0x46, started + 1000000);
+    harness.controller->keyboard.type(0x1e, started + 11000000);
+    harness.controller->keyboard.type(0x9e, started + 21000000);
+    harness.controller->keyboard.type(0xc6, started + 51000000);
+    harness.runUntilIdle();
+    CHECK_EQUAL(harness.keyboard->hostKeyDowns, 1);
+    CHECK_EQUAL(harness.keyboard->hostKeyUps, 1);
+    
+    static_cast<IORegistryEntry *>(harness.keyboard)->serializeProperties(0);
+    OSData * data = OSDynamicCast(OSData, harness.keyboard->getProperty("Key usage"));
+    CHECK(data && data->getLength() == sizeof(KeyUsageSnapshot));
+    if (!data)  return;
+    
+    const KeyUsageSnapshot * usage = (const KeyUsageSnapshot *)data->getBytesNoCopy();
+    CHECK_EQUAL(usage->presses[0x46], 1);
+    CHECK_EQUAL(usage->heldNanoseconds[0x46], 50000000);
+    CHECK_EQUAL(usage->presses[0x1e], 1);
+    CHECK_EQUAL(usage->heldNanoseconds[0x1e], 10000000);
+}
+
+static void testDriverLEDs()
+{
+    //
+    // A burst of lock changes sends the first and the last state.
+    //
+    
+    DriverHarness harness;
+    UInt32        requests;
+    
+    CHECK(harness.start());
+    harness.runUntilIdle();
+    requests = harness.controller->statistics.requests;
+    
+    for (int index = 0; index < 16; index++)
+        harness.keyboard->setAlphaLock(index & 1);
+    harness.keyboard->setAlphaLock(true);
+    harness.runUntilIdle();
+    
+    CHECK_EQUAL(harness.controller->keyboard.leds(), 0x04);
+    CHECK_EQUAL(harness.controller->statistics.requests - requests, 2);
+    CHECK_EQUAL(harness.statistic("LED updates", "Requests elided"), 15);
+}
+
+static void testDriverWake()
+{
+    DriverHarness harness;
+    
+    CHECK(harness.start());
+    harness.runUntilIdle();
+    harness.keyboard->setAlphaLock(true);
+    harness.runUntilIdle();
+    
+    //
+    // The controller restores the command byte: one request.
+    //
+    
+    harness.controller->sleep();
+    CHECK(!harness.controller->keyboard.scanning());
+    harness.controller->wake();
+    harness.runUntilIdle();
+    CHECK(harness.controller->keyboard.scanning());
+    CHECK_EQUAL(harness.controller->keyboard.leds(), 0x04);
+    CHECK_EQUAL(harness.statistic("Resume", "Single request"), 1);
+    
+    //
+    // The firmware changed it: the separate requests.
+    //
+    
+    harness.controller->sleep();
+    harness.controller->setWakeCommandByte(harness.controller->commandByte() ^ kCB_EnableMouseIRQ);
+    harness.controller->wake();
+    harness.runUntilIdle();
+    CHECK(harness.controller->keyboard.scanning());
+    CHECK_EQUAL(harness.controller->keyboard.leds(), 0x04);
+    CHECK_EQUAL(harness.statistic("Resume", "Separate requests"), 1);
+    CHECK(harness.controller->commandByte() & kCB_EnableKeyboardIRQ);
+}
+
+static void testDriverStop()
+{
+    DriverHarness harness;
+    
+    CHECK(harness.start());
+    harness.runUntilIdle();
+    harness.terminate();
+    
+    CHECK(!harness.controller->keyboard.scanning());
+    CHECK(harness.controller->commandByte() & kCB_DisableKeyboardClock);
+    CHECK(!(harness.controller->commandByte() & kCB_EnableKeyboardIRQ));
+    CHECK_EQUAL(harness.controller->requestsOutstanding(), 0);
+    CHECK(!hostLogged("request still outstanding at stop"));
+}
+
+static void testDriverStopDuringStart()
+{
+    //
+    // Stopped before the bring-up finishes, which then goes no further.
+    //
+    
+    DriverHarness harness;
+    
+    CHECK(harness.start());
+    harness.terminate();
+    harness.runUntilIdle();
+    
+    CHECK(!harness.running());
+    CHECK(!harness.controller->keyboard.scanning());
+    CHECK_EQUAL(harness.controller->requestsOutstanding(), 0);
+    CHECK(!hostLogged("request still outstanding at stop"));
+}
+
+int main()
+{
+    testEcho();
+    testCompareAbort();
+    testTimeout();
+    testResend();
+    testCommandByte();
+    testCompletionAndFireAndForget();
+    testInterleaving();
+    testKeyboardBuffer();
+    
+    testDriverStart();
+    testDriverTyping();
+    testDriverKeyUsage();
+    testDriverLEDs();
+    testDriverWake();
+    testDriverStop();
+    testDriverStopDuringStart();
+    
+    CHECK_EQUAL(hostKernelStatistics.errors, 0);
+    return testResult("CommandPathTest");
+}
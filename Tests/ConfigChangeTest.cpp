@@ -0,0 +1,153 @@
+//
+// Checks changing the driver's settings while it runs: the new translation
+// tables are taken up between scan codes without breaking a sequence in
+// progress or turning off toggled layers, and a change that can't be
+// applied changes nothing.
+//
+
+#include "DriverHarness.h"
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static IOReturn changeSetting(DriverHarness & harness, const char * key, OSObject * value)
+{
+    OSDictionary * changes = OSDictionary::withCapacity(1);
+    IOReturn       result;
+    
+    changes->setObject(key, value);
+    result = harness.keyboard->setProperties(changes);
+    changes->release();
+    return result;
+}
+
+static void typeKey(DriverHarness & harness, const UInt8 * scanCodes, UInt32 count)
+{
+    //
+    // Types scan codes 1 ms apart, and lets the driver dispatch them.
+    //
+    
+    UInt64 started = hostTime();
+    
+    for (UInt32 index = 0; index < count; index++)
+        harness.controller->keyboard.type(scanCodes[index], started + (index + 1) * 1000000ULL);
+    harness.runUntilIdle();
+}
+
+static void startDriver(DriverHarness & harness)
+{
+    CHECK(harness.start());
+    CHECK(harness.runUntilIdle());
+    CHECK(harness.running());
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static void testChangeMidSequence()
+{
+    //
+    // A change taken up between E0 and the byte after it: E0 48 is still the
+    // up arrow, not keypad 8.
+    //
+    
+    static const UInt8 kExtend[]  = { kSC_Extend };
+    static const UInt8 kUpArrow[] = { 0x48, kSC_Extend, 0x48 | kSC_UpBit };
+    
+    DriverHarness harness;
+    UInt64        applied;
+    
+    startDriver(harness);
+    applied = harness.statistic("Configuration", "Applied");
+    
+    typeKey(harness, kExtend, 1);
+    CHECK_EQUAL(changeSetting(harness, "Swap alt and windows key", kOSBooleanTrue), kIOReturnSuccess);
+    harness.runUntilIdle();
+    CHECK_EQUAL(harness.statistic("Configuration", "Applied"), applied + 1);
+    
+    typeKey(harness, kUpArrow, 3);
+    CHECK_EQUAL(harness.keyboard->hostKeyDowns, 1);
+    CHECK_EQUAL(harness.keyboard->hostKeyUps, 1);
+    CHECK_EQUAL(harness.keyboard->hostLastKeyCode, 0x7e);
+}
+
+static void testToggledLayerKept()
+{
+    //
+    // Scroll lock toggles a layer where B is F15; the layer stays on across a
+    // change to an unrelated setting.
+    //
+    
+    static const UInt8 kScrollLock[] = { 0x46, 0x46 | kSC_UpBit };
+    static const UInt8 kB[]          = { 0x30, 0x30 | kSC_UpBit };
+    
+    DriverHarness  harness;
+    OSDictionary * layer   = OSDictionary::withCapacity(2);
+    OSDictionary * remaps  = OSDictionary::withCapacity(1);
+    OSArray *      toggles = OSArray::withCapacity(1);
+    OSArray *      layers  = OSArray::withCapacity(1);
+    OSNumber *     number;
+    
+    number = OSNumber::withNumber(0x71, 32);
+    remaps->setObject("0x30", number);
+    number->release();
+    number = OSNumber::withNumber(0x46, 32);
+    toggles->setObject(number);
+    number->release();
+    layer->setObject("Key remaps", remaps);
+    layer->setObject("Toggle keys", toggles);
+    layers->setObject(layer);
+    harness.keyboard->setProperty("Layers", layers);
+    layers->release();
+    toggles->release();
+    remaps->release();
+    layer->release();
+    
+    startDriver(harness);
+    typeKey(harness, kScrollLock, 2);
+    typeKey(harness, kB, 2);
+    CHECK_EQUAL(harness.keyboard->hostLastKeyCode, 0x71);
+    
+    CHECK_EQUAL(changeSetting(harness, "Swap alt and windows key", kOSBooleanTrue), kIOReturnSuccess);
+    harness.runUntilIdle();
+    typeKey(harness, kB, 2);
+    CHECK_EQUAL(harness.keyboard->hostLastKeyCode, 0x71);
+    
+    typeKey(harness, kScrollLock, 2);
+    typeKey(harness, kB, 2);
+    CHECK_EQUAL(harness.keyboard->hostLastKeyCode, 0x0b);
+}
+
+static void testChangeFailed()
+{
+    //
+    // The tables for the change can't be allocated: the request fails, and
+    // neither the properties nor the tables in use change.
+    //
+    
+    DriverHarness harness;
+    UInt64        applied;
+    
+    startDriver(harness);
+    applied = harness.statistic("Configuration", "Applied");
+    
+    hostFailMallocs = 1;
+    CHECK_EQUAL(changeSetting(harness, "Swap alt and windows key", kOSBooleanTrue), kIOReturnNoMemory);
+    hostFailMallocs = 0;
+    harness.runUntilIdle();
+    CHECK(!harness.keyboard->getProperty("Swap alt and windows key"));
+    CHECK_EQUAL(harness.statistic("Configuration", "Applied"), applied);
+    
+    CHECK_EQUAL(changeSetting(harness, "Swap alt and windows key", kOSBooleanTrue), kIOReturnSuccess);
+    harness.runUntilIdle();
+    CHECK(harness.keyboard->getProperty("Swap alt and windows key") == kOSBooleanTrue);
+    CHECK_EQUAL(harness.statistic("Configuration", "Applied"), applied + 1);
+}
+
+int main()
+{
+    testChangeMidSequence();
+    testToggledLayerKept();
+    testChangeFailed();
+    
+    CHECK_EQUAL(hostKernelStatistics.errors, 0);
+    return testResult("ConfigChangeTest");
+}
@@ -0,0 +1,171 @@
+//
+// Checks the key translator's debounce filter: chattered presses are
+// dropped, and releases of keys that are down never are, so no key is left
+// down.  Times are in milliseconds here.
+//
+
+#include "GenericPS2KeyTranslator.h"
+#include "TestSupport.h"
+
+#define kKey            0x1e    // A
+#define kWindow         20
+
+static KeyTranslation tables[KBV_NUM_KEYCODES];
+static UInt32         debounce[KBV_NUM_KEYCODES];
+
+static void setUp(KeyTranslator * translator)
+{
+    for (int keyCode = 0; keyCode < KBV_NUM_KEYCODES; keyCode++)
+    {
+        tables[keyCode]   = keyCode;
+        debounce[keyCode] = kWindow;
+    }
+    translator->reset();
+    translator->setTables(tables, 1, debounce);
+}
+
+static UInt32 key(KeyTranslator * translator, bool goingDown, UInt64 time)
+{
+    KeyEvent event;
+    
+    return translator->translate(goingDown ? kKey : kKey | kSC_UpBit, time, &event);
+}
+
+static void testQuickTap()
+{
+    //
+    // A release inside the window is a real one, however quick.
+    //
+    
+    KeyTranslator translator;
+    
+    setUp(&translator);
+    CHECK_EQUAL(key(&translator, true,  1000), kKeyEventKey);
+    CHECK_EQUAL(key(&translator, false, 1005), kKeyEventKey);
+    CHECK(!translator.isKeyDown(kKey));
+}
+
+static void testChatter()
+{
+    //
+    // make, break, make, break in quick succession types one key; the
+    // second break is of a key already up, and is ignored.
+    //
+    
+    KeyTranslator translator;
+    
+    setUp(&translator);
+    CHECK_EQUAL(key(&translator, true,  1000), kKeyEventKey);
+    CHECK_EQUAL(key(&translator, false, 1080), kKeyEventKey);
+    CHECK_EQUAL(key(&translator, true,  1085), kKeyEventChatter);
+    CHECK(!translator.isKeyDown(kKey));
+    CHECK_EQUAL(key(&translator, false, 1090), kKeyEventNone);
+    CHECK(!translator.isKeyDown(kKey));
+    
+    // The window runs from that last release.
+    CHECK_EQUAL(key(&translator, true,  1105), kKeyEventChatter);
+    CHECK_EQUAL(key(&translator, true,  1110), kKeyEventKey);
+    CHECK(translator.isKeyDown(kKey));
+}
+
+static void testOutsideWindow()
+{
+    KeyTranslator translator;
+    
+    setUp(&translator);
+    CHECK_EQUAL(key(&translator, true,  5), kKeyEventKey);     // no release yet
+    CHECK_EQUAL(key(&translator, false, 50), kKeyEventKey);
+    CHECK_EQUAL(key(&translator, true,  50 + kWindow), kKeyEventKey);
+    CHECK_EQUAL(key(&translator, true,  51 + kWindow), kKeyEventRepeat);
+    CHECK_EQUAL(key(&translator, false, 52 + kWindow), kKeyEventKey);
+}
+
+static void testOtherKeys()
+{
+    //
+    // Windows are per key, and a key with none isn't filtered.
+    //
+    
+    KeyTranslator translator;
+    KeyEvent      event;
+    
+    setUp(&translator);
+    debounce[0x30] = 0;
+    CHECK_EQUAL(key(&translator, true,  1000), kKeyEventKey);
+    CHECK_EQUAL(key(&translator, false, 1001), kKeyEventKey);
+    CHECK_EQUAL(translator.translate(0x1f, 1002, &event), kKeyEventKey);
+    CHECK_EQUAL(translator.translate(0x30, 1003, &event), kKeyEventKey);
+    CHECK_EQUAL(translator.translate(0xb0, 1004, &event), kKeyEventKey);
+    CHECK_EQUAL(translator.translate(0x30, 1005, &event), kKeyEventKey);
+}
+
+static UInt32 countReleases(KeyTranslator * translator, const UInt8 * scanCodes, UInt32 count,
+                            UInt64 time)
+{
+    //
+    // Runs scan codes 5 ms apart, and counts the releases passed on.
+    //
+    
+    KeyEvent event;
+    UInt32   releases = 0;
+    
+    for (UInt32 index = 0; index < count; index++, time += 5)
+    {
+        UInt32 type = translator->translate(scanCodes[index], time, &event);
+    
+        if ((type == kKeyEventKey || type == kKeyEventLayer) && !event.goingDown)
+            releases++;
+    }
+    return releases;
+}
+
+static void testChatterOnSpecialKeys()
+{
+    //
+    // A chattered macro key or layer key is released once: the macro's Up
+    // steps run once, and the layer is let go of once, so another key still
+    // holding it keeps it active.
+    //
+    
+    static const UInt8 kMacroChatter[] = { kKey, kKey | kSC_UpBit, kKey, kKey | kSC_UpBit };
+    static const UInt8 kLayerChatter[] = { 0x1f, 0x1f | kSC_UpBit, 0x1f, 0x1f | kSC_UpBit };
+    static KeyTranslation layered[2 * KBV_NUM_KEYCODES];
+    
+    KeyTranslator translator;
+    KeyEvent      event;
+    
+    setUp(&translator);
+    for (int keyCode = 0; keyCode < KBV_NUM_KEYCODES; keyCode++)
+    {
+        layered[keyCode]                    = keyCode;
+        layered[KBV_NUM_KEYCODES + keyCode] = keyCode;
+    }
+    layered[kKey]                    = kKeyTranslateMacro | 1;
+    layered[0x1f]                    = kKeyTranslateLayerMomentary | 1;
+    layered[0x20]                    = kKeyTranslateLayerMomentary | 1;
+    layered[KBV_NUM_KEYCODES + 0x1f] = kKeyTranslateLayerMomentary | 1;
+    layered[KBV_NUM_KEYCODES + 0x20] = kKeyTranslateLayerMomentary | 1;
+    layered[KBV_NUM_KEYCODES + 0x30] = 0x7f;
+    translator.setTables(layered, 2, debounce);
+    
+    CHECK_EQUAL(countReleases(&translator, kMacroChatter, 4, 1000), 1);
+    CHECK(!translator.isKeyDown(kKey));
+    
+    CHECK_EQUAL(translator.translate(0x20, 2000, &event), kKeyEventLayer);
+    CHECK_EQUAL(countReleases(&translator, kLayerChatter, 4, 2010), 1);
+    CHECK_EQUAL(translator.translate(0x30, 2100, &event), kKeyEventKey);
+    CHECK_EQUAL(event.translation, 0x7f);
+    CHECK_EQUAL(translator.translate(0x20 | kSC_UpBit, 2200, &event), kKeyEventLayer);
+    CHECK_EQUAL(translator.translate(0x2e, 2300, &event), kKeyEventKey);
+    CHECK_EQUAL(event.translation, 0x2e);
+}
+
+int main()
+{
+    testQuickTap();
+    testChatter();
+    testOutsideWindow();
+    testOtherKeys();
+    testChatterOnSpecialKeys();
+    return testResult("DebounceTest");
+}
@@ -0,0 +1,261 @@
+//
+// Checks the table-driven scan code decoder against the decoder it replaced:
+// a straight port of the old extend-count parser from
+// dispatchKeyboardEventWithScancode, run side by side over every sequence of
+// up to three bytes, and over a long pseudo-random stream.  Also checks the
+// batch decoder against decoding the same bytes one at a time.
+//
+
+#include "GenericPS2ScancodeDecoder.h"
+#include "TestSupport.h"
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// The old parser, less the left alt/windows swap, which now happens in the
+// translation table.  The sleep key, which it performed itself, is now a key
+// like any other, and it and volume up have moved off the key codes of the
+// ro and yen keys.
+//
+
+struct ReferenceDecoder
+{
+    int extendCount;
+    
+    ReferenceDecoder() : extendCount(0) {}
+    
+    bool decode(UInt8 scanCode, UInt8 * keyCode, bool * goingDown)
+    {
+        unsigned int code;
+        
+        if (scanCode == kSC_Extend)
+        {
+            extendCount = 1;
+            return false;
+        }
+        
+        if (scanCode == kSC_Pause)
+        {
+            extendCount = 2;
+            return false;
+        }
+        
+        if (extendCount == 0)
+        {
+            code = scanCode & ~kSC_UpBit;
+        }
+        else
+        {
+            extendCount--;
+            if (extendCount)  return false;
+            
+            switch (scanCode & ~kSC_UpBit)
+            {
+                case 0x1D: code = 0x60; break;            // ctrl
+                case 0x38: code = 0x61; break;            // right alt
+                case 0x1C: code = 0x62; break;            // enter
+                case 0x35: code = 0x63; break;            // /
+                case 0x48: code = 0x64; break;            // up arrow
+                case 0x50: code = 0x65; break;            // down arrow
+                case 0x4B: code = 0x66; break;            // left arrow
+                case 0x4D: code = 0x67; break;            // right arrow
+                case 0x52: code = 0x68; break;            // insert
+                case 0x53: code = 0x69; break;            // delete
+                case 0x49: code = 0x6A; break;            // page up
+                case 0x51: code = 0x6B; break;            // page down
+                case 0x47: code = 0x6C; break;            // home
+                case 0x4F: code = 0x6D; break;            // end
+                case 0x37: code = 0x6E; break;            // PrintScreen
+                case 0x45: code = 0x6F; break;            // Pause
+                case 0x5D: code = 0x72; break;            // Application
+                case 0x5B: code = 0x70; break;            // left windows/command
+                case 0x5C: code = 0x71; break;            // right windows/command
+                case 0x30: code = 0x75; break;            // E030 = volume up
+                case 0x2e: code = 0x7e; break;            // E02E = volume down
+                case 0x20: code = 0x7f; break;            // E020 = volume mute
+                case 0x5e: code = 0x7c; break;            // E05E = power
+                case 0x5f: code = 0x74; break;            // E05F = sleep
+                default: return false;
+            }
+        }
+        
+        if (code == 0)  return false;
+        
+        *keyCode   = code;
+        *goingDown = !(scanCode & kSC_UpBit);
+        return true;
+    }
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static unsigned long mismatches = 0;
+
+static void compare(ReferenceDecoder * reference, UInt16 * row, const UInt8 * bytes, int count)
+{
+    for (int index = 0; index < count; index++)
+    {
+        UInt8              keyCode   = 0;
+        bool               goingDown = false;
+        bool               expected  = reference->decode(bytes[index], &keyCode, &goingDown);
+        ScancodeTransition actual    = decodeScancode(row, bytes[index]);
+        bool               isKey     = DECODE_ACTION(actual) == kDecodeActionKey;
+        
+        if (isKey == expected &&
+            (!isKey || (DECODE_KEYCODE(actual) == keyCode && DECODE_GOING_DOWN(actual) == goingDown)))
+            continue;
+        
+        if (mismatches++ < 10)
+        {
+            fprintf(stderr, "mismatch at byte %d of", index);
+            for (int byte = 0; byte < count; byte++)  fprintf(stderr, " %02x", bytes[byte]);
+            fprintf(stderr, ": expected %s %02x, got action %d key %02x\n",
+                    expected ? (goingDown ? "down" : "up") : "nothing", keyCode,
+                    DECODE_ACTION(actual), DECODE_KEYCODE(actual));
+        }
+        testFailures++;
+        return;
+    }
+}
+
+static void testAllShortSequences()
+{
+    UInt8 bytes[3];
+    
+    for (unsigned int sequence = 0; sequence < 0x1000000; sequence++)
+    {
+        ReferenceDecoder reference;
+        UInt16           row = kDecodeRowIdle;
+        
+        bytes[0] = sequence >> 16;
+        bytes[1] = sequence >> 8;
+        bytes[2] = sequence;
+        compare(&reference, &row, bytes, 3);
+    }
+}
+
+static void testRandomStream()
+{
+    //
+    // Biased towards prefixes, so that long runs of them get exercised.
+    //
+    
+    static UInt8     bytes[1 << 20];
+    ReferenceDecoder reference;
+    UInt16           row  = kDecodeRowIdle;
+    UInt32           seed = 12345;
+    
+    for (unsigned int index = 0; index < sizeof(bytes); index++)
+    {
+        seed = seed * 1103515245 + 12345;
+        switch ((seed >> 16) & 7)
+        {
+            case 0:  bytes[index] = kSC_Extend; break;
+            case 1:  bytes[index] = kSC_Pause;  break;
+            default: bytes[index] = seed >> 24; break;
+        }
+    }
+    compare(&reference, &row, bytes, sizeof(bytes));
+}
+
+//
+// Fills bytes with a pseudo-random stream, with one byte in prefixEvery a
+// prefix; if prefixEvery is zero, just make and break codes of plain keys.
+//
+
+static void randomStream(UInt8 * bytes, UInt32 count, UInt32 prefixEvery)
+{
+    UInt32 seed = 12345;
+    
+    for (UInt32 index = 0; index < count; index++)
+    {
+        seed = seed * 1103515245 + 12345;
+        if (!prefixEvery)
+            bytes[index] = (1 + (seed >> 24) % 0x58) | ((seed >> 16) & kSC_UpBit);
+        else if ((seed >> 8) % prefixEvery == 0)
+            bytes[index] = ((seed >> 16) & 1) ? kSC_Extend : kSC_Pause;
+        else
+            bytes[index] = seed >> 24;
+    }
+}
+
+static void testBatch()
+{
+    //
+    // Streams with prefixes everywhere, now and then, and not at all, decoded
+    // in buffers of every length up to 40 bytes, so that words start at every
+    // offset, and in the middle of sequences.
+    //
+    
+    static const UInt32 kPrefixEvery[] = { 4, 64, 0 };
+    static UInt8        bytes[1 << 16];
+    ScancodeTransition  batch[40];
+    
+    for (UInt32 stream = 0; stream < sizeof(kPrefixEvery) / sizeof(kPrefixEvery[0]); stream++)
+    {
+        UInt16 batchRow = kDecodeRowIdle;
+        UInt16 row      = kDecodeRowIdle;
+        UInt32 length   = 0;
+        
+        randomStream(bytes, sizeof(bytes), kPrefixEvery[stream]);
+        for (UInt32 index = 0; index + length <= sizeof(bytes); index += length, length = (length + 1) % 41)
+        {
+            decodeScancodes(&batchRow, bytes + index, length, batch);
+            for (UInt32 offset = 0; offset < length; offset++)
+            {
+                if (batch[offset] == decodeScancode(&row, bytes[index + offset]))  continue;
+                if (mismatches++ < 10)
+                    fprintf(stderr, "batch mismatch at byte %u\n", (unsigned)(index + offset));
+                testFailures++;
+            }
+            CHECK_EQUAL(batchRow, row);
+        }
+    }
+}
+
+static void testKnownSequences()
+{
+    static const UInt8 pause[]       = { 0xE1, 0x1D, 0x45, 0xE1, 0x9D, 0xC5 };
+    static const UInt8 printScreen[] = { 0xE0, 0x2A, 0xE0, 0x37, 0xE0, 0xB7, 0xE0, 0xAA };
+    ScancodeTransition transitions[8];
+    UInt16             row = kDecodeRowIdle;
+    
+    for (unsigned int index = 0; index < sizeof(pause); index++)
+        transitions[index] = decodeScancode(&row, pause[index]);
+    CHECK_EQUAL(row, kDecodeRowIdle);
+    CHECK_EQUAL(DECODE_ACTION(transitions[2]), kDecodeActionKey);
+    CHECK_EQUAL(DECODE_KEYCODE(transitions[2]), 0x6F);
+    CHECK(DECODE_GOING_DOWN(transitions[2]));
+    CHECK_EQUAL(DECODE_ACTION(transitions[5]), kDecodeActionKey);
+    CHECK_EQUAL(DECODE_KEYCODE(transitions[5]), 0x6F);
+    CHECK(!DECODE_GOING_DOWN(transitions[5]));
+    
+    for (unsigned int index = 0; index < sizeof(printScreen); index++)
+        transitions[index] = decodeScancode(&row, printScreen[index]);
+    CHECK_EQUAL(DECODE_ACTION(transitions[1]), kDecodeActionNone);
+    CHECK_EQUAL(DECODE_KEYCODE(transitions[3]), 0x6E);
+    CHECK_EQUAL(DECODE_KEYCODE(transitions[5]), 0x6E);
+    CHECK_EQUAL(DECODE_ACTION(transitions[7]), kDecodeActionNone);
+    
+    // Ro (and ABNT2 /?) is a plain 73, and mustn't be taken for sleep.
+    row = kDecodeRowIdle;
+    CHECK_EQUAL(DECODE_KEYCODE(decodeScancode(&row, 0x73)), 0x73);
+    decodeScancode(&row, 0xE0);
+    CHECK_EQUAL(DECODE_KEYCODE(decodeScancode(&row, 0x5F)), 0x74);
+    
+    // Likewise yen, a plain 7D, and volume up.
+    CHECK_EQUAL(DECODE_KEYCODE(decodeScancode(&row, 0x7D)), 0x7D);
+    decodeScancode(&row, 0xE0);
+    CHECK_EQUAL(DECODE_KEYCODE(decodeScancode(&row, 0x30)), 0x75);
+    
+    // An extended code we don't know is reported, for the anomaly counts.
+    decodeScancode(&row, 0xE0);
+    CHECK_EQUAL(DECODE_ACTION(decodeScancode(&row, 0x10)), kDecodeActionUnknown);
+}
+
+int main()
+{
+    testKnownSequences();
+    testAllShortSequences();
+    testRandomStream();
+    testBatch();
+    return testResult("DecoderTest");
+}
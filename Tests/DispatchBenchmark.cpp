@@ -0,0 +1,228 @@
+//
+// Measures what the per-byte path gains from being specialised and made of
+// direct calls: the same streams go through the key translator and a stub of
+// the driver's dispatch chain (dispatchKey, dispatchTranslatedKey,
+// dispatchKeyboardEvent) twice --
+//
+// o  as the driver used to: translate() testing for debounce windows on
+//    every byte, and every step of the chain a virtual call;
+// o  as it does now: translate<false>() for a configuration without them,
+//    and the chain inlined.
+//
+
+#include <algorithm>
+#include "ScancodeStreams.h"
+#include "TestSupport.h"
+
+#define kStreamBytes            (1 << 20)
+#define kMinimumNanoseconds     400000000ULL
+#define kMinimumRounds          7
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// The dispatch chain, less the parts that need IOKit: dual-role keys pass
+// through, macros expand, and dispatchKeyboardEvent counts and checksums.
+//
+
+struct SinkState
+{
+    SinkState(const StreamConfig * config) : events(0), checksum(0), lastEventTime(0), config(config) {}
+    
+    UInt64               events;
+    UInt64               checksum;
+    UInt64               lastEventTime;
+    const StreamConfig * config;
+};
+
+//
+// The bodies, shared by both sinks; calls back into the sink go through
+// whatever kind of call the sink's methods are.
+//
+
+template <class Sink>
+static inline void sinkDispatchTranslatedKey(Sink * sink, KeyTranslation translation, bool goingDown,
+                                             UInt64 time)
+{
+    SinkState & state = sink->state;
+    
+    if (time > state.lastEventTime)  state.lastEventTime = time;
+    
+    if (translation & kKeyTranslateMacro)
+    {
+        UInt32         count;
+        const UInt16 * step = state.config->macros.sequence(KEY_TRANSLATE_ADB(translation), goingDown, &count);
+    
+        for (; step && count; count--, step++)
+            sink->dispatchKeyboardEvent(*step & ~kMacroStepUp, !(*step & kMacroStepUp), state.lastEventTime);
+        return;
+    }
+    sink->dispatchKeyboardEvent(KEY_TRANSLATE_ADB(translation), goingDown, state.lastEventTime);
+}
+
+static inline void sinkCount(SinkState * state, unsigned int keyCode, bool goingDown, UInt64 time)
+{
+    state->events++;
+    state->checksum = state->checksum * 31 + (keyCode << 1 | goingDown) + time;
+}
+
+class VirtualSink
+{
+public:
+    VirtualSink(const StreamConfig * config) : state(config) {}
+    virtual ~VirtualSink() {}
+    
+    virtual void dispatchKey(const KeyEvent & event, UInt64 time)
+    {
+        dispatchTranslatedKey(event.translation, event.goingDown, time);
+    }
+    
+    virtual void dispatchTranslatedKey(KeyTranslation translation, bool goingDown, UInt64 time)
+    {
+        sinkDispatchTranslatedKey(this, translation, goingDown, time);
+    }
+    
+    virtual void dispatchKeyboardEvent(unsigned int keyCode, bool goingDown, UInt64 time)
+    {
+        sinkCount(&state, keyCode, goingDown, time);
+    }
+    
+    SinkState state;
+};
+
+//
+// Another implementation, which main() could pick, so that the compiler
+// can't see through the virtual calls.
+//
+
+class OtherVirtualSink : public VirtualSink
+{
+public:
+    OtherVirtualSink(const StreamConfig * config) : VirtualSink(config) {}
+    
+    virtual void dispatchKeyboardEvent(unsigned int, bool, UInt64)  { state.events++; }
+};
+
+class DirectSink
+{
+public:
+    DirectSink(const StreamConfig * config) : state(config) {}
+    
+    void dispatchKey(const KeyEvent & event, UInt64 time)
+    {
+        dispatchTranslatedKey(event.translation, event.goingDown, time);
+    }
+    
+    void dispatchTranslatedKey(KeyTranslation translation, bool goingDown, UInt64 time)
+    {
+        sinkDispatchTranslatedKey(this, translation, goingDown, time);
+    }
+    
+    void dispatchKeyboardEvent(unsigned int keyCode, bool goingDown, UInt64 time)
+    {
+        sinkCount(&state, keyCode, goingDown, time);
+    }
+    
+    SinkState state;
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static UInt64 replayVirtual(KeyTranslator * translator, VirtualSink * sink, const ScancodeStream & stream)
+{
+    const UInt8 *  bytes = &stream.bytes[0];
+    const UInt64 * times = &stream.times[0];
+    size_t         count = stream.bytes.size();
+    UInt64         start = hostNanoseconds();
+    
+    for (size_t index = 0; index < count; index++)
+    {
+        KeyEvent event;
+    
+        if (translator->translate(bytes[index], times[index], &event) == kKeyEventKey)
+            sink->dispatchKey(event, times[index]);
+    }
+    return hostNanoseconds() - start;
+}
+
+static UInt64 replayDirect(KeyTranslator * translator, DirectSink * sink, const ScancodeStream & stream)
+{
+    const UInt8 *  bytes = &stream.bytes[0];
+    const UInt64 * times = &stream.times[0];
+    size_t         count = stream.bytes.size();
+    UInt64         start = hostNanoseconds();
+    
+    for (size_t index = 0; index < count; index++)
+    {
+        KeyEvent event;
+    
+        if (translator->translate<false>(bytes[index], times[index], &event) == kKeyEventKey)
+            sink->dispatchKey(event, times[index]);
+    }
+    return hostNanoseconds() - start;
+}
+
+static void resetTranslator(KeyTranslator * translator, const StreamConfig & config, SinkState * state)
+{
+    translator->reset();
+    translator->setTables(config.tables, 2, 0);
+    state->events        = 0;
+    state->checksum      = 0;
+    state->lastEventTime = 0;
+}
+
+static void compare(const ScancodeStream & stream, const StreamConfig & config, VirtualSink * virtualSink)
+{
+    KeyTranslator translator;
+    DirectSink    directSink(&config);
+    UInt64        bestVirtual = ~0ULL;
+    UInt64        bestDirect  = ~0ULL;
+    UInt64        elapsed     = 0;
+    double        count       = stream.bytes.size();
+    
+    //
+    // The best of several rounds of each, taken in turn so that both see the
+    // same machine.
+    //
+    
+    for (int round = 0; elapsed < kMinimumNanoseconds || round < kMinimumRounds; round++)
+    {
+        UInt64 virtualTime;
+        UInt64 directTime;
+    
+        resetTranslator(&translator, config, &virtualSink->state);
+        virtualTime = replayVirtual(&translator, virtualSink, stream);
+        resetTranslator(&translator, config, &directSink.state);
+        directTime = replayDirect(&translator, &directSink, stream);
+    
+        bestVirtual = std::min(bestVirtual, virtualTime);
+        bestDirect  = std::min(bestDirect, directTime);
+        elapsed    += virtualTime + directTime;
+    }
+    
+    CHECK_EQUAL(directSink.state.events, virtualSink->state.events);
+    CHECK_EQUAL(directSink.state.checksum, virtualSink->state.checksum);
+    
+    printf("%-20s %9lu %9llu %8.2f %8.2f %7.1f%%\n", stream.name, (unsigned long)stream.bytes.size(),
+           (unsigned long long)directSink.state.events, bestVirtual / count, bestDirect / count,
+           100.0 * ((double)bestVirtual - bestDirect) / bestVirtual);
+}
+
+int main(int argc, char **)
+{
+    StreamConfig     config;
+    ScancodeStream   streams[4];
+    VirtualSink      virtualSink(&config);
+    OtherVirtualSink otherSink(&config);
+    
+    streamTyping(&streams[0], kStreamBytes);
+    streamExtended(&streams[1], kStreamBytes);
+    streamPausePrintScreen(&streams[2], kStreamBytes);
+    streamRemaps(&streams[3], kStreamBytes);
+    
+    printf("%-20s %9s %9s %8s %8s %8s\n", "stream", "bytes", "events", "virtual", "direct", "gain");
+    printf("%-20s %9s %9s %8s %8s %8s\n", "", "", "", "ns/byte", "ns/byte", "");
+    
+    for (int index = 0; index < 4; index++)
+        compare(streams[index], config, argc > 1000 ? &otherSink : &virtualSink);
+    
+    return testResult("DispatchBenchmark");
+}
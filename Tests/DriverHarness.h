@@ -0,0 +1,132 @@
+#ifndef _DRIVERHARNESS_H
+#define _DRIVERHARNESS_H
+
+#include "GenericPS2Keyboard.h"
+#include "PS2Simulator.h"
+#include "TestSupport.h"
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// The driver on the simulated controller, from init to free, for the tests
+// and benchmarks that run it whole.  Its statistics are read back from its
+// properties, as ioreg reads them.
+//
+// The destructor terminates the driver if it is still attached, releases
+// everything, and checks that nothing leaked and the host kernel saw no
+// misuse.
+//
+
+#define kHarnessIdleLimitNS     10000000000ULL
+
+class DriverHarness
+{
+public:
+    DriverHarness()
+    {
+        _objects = hostKernelStatistics.objects;
+        _bytes   = hostKernelStatistics.bytesAllocated;
+        _errors  = hostKernelStatistics.errors;
+        hostLogReset();
+
+        controller = new ApplePS2Controller;
+        controller->init();
+        device = new ApplePS2KeyboardDevice;
+        device->init();
+        device->attach(controller);
+        keyboard = new GenericPS2Keyboard;
+        keyboard->init(0);
+    }
+
+    ~DriverHarness()
+    {
+        terminate();
+        keyboard->release();
+        device->detach(controller);
+        device->release();
+        controller->release();
+
+        CHECK_EQUAL(hostKernelStatistics.objects, _objects);
+        CHECK_EQUAL(hostKernelStatistics.bytesAllocated, _bytes);
+        CHECK_EQUAL(hostKernelStatistics.errors, _errors);
+    }
+
+    //
+    // Attaches, probes and starts the driver, as the kernel does on a match.
+    //
+
+    bool start()
+    {
+        SInt32 score = 0;
+
+        if (!keyboard->attach(device))  return false;
+        if (!keyboard->probe(device, &score) || !keyboard->start(device))
+        {
+            keyboard->detach(device);
+            return false;
+        }
+        return true;
+    }
+
+    //
+    // Runs events until the controller and keyboard have nothing left to do,
+    // and then anything else due at that time; returns false if that takes
+    // longer than the limit.
+    //
+
+    bool runUntilIdle(UInt64 limitNS = kHarnessIdleLimitNS)
+    {
+        UInt64 limit = hostTime() + limitNS;
+
+        while (!controller->idle())
+            if (!hostRunNext(limit))  break;
+        hostRunUntil(hostTime());
+        return controller->idle();
+    }
+
+    //
+    // Terminates the driver, if it is still attached, and waits for it to
+    // stop and detach.  A driver that terminated itself is waited for too.
+    //
+
+    void terminate()
+    {
+        if (keyboard->getProvider() && !keyboard->isInactive())  keyboard->terminate();
+        while (keyboard->getProvider())
+            if (!hostRunNext())  break;
+    }
+
+    bool running()
+    {
+        return statistic("Start", "Running") != 0;
+    }
+
+    OSDictionary * statistics(const char * group)
+    {
+        static_cast<IORegistryEntry *>(keyboard)->serializeProperties(0);
+        return OSDynamicCast(OSDictionary, keyboard->getProperty(group));
+    }
+
+    UInt64 statistic(const char * group, const char * key)
+    {
+        OSDictionary * dictionary = statistics(group);
+        OSObject *     value      = dictionary ? dictionary->getObject(key) : 0;
+        OSNumber *     number     = OSDynamicCast(OSNumber, value);
+        OSBoolean *    boolean    = OSDynamicCast(OSBoolean, value);
+
+        if (number)   return number->unsigned64BitValue();
+        if (boolean)  return boolean->isTrue();
+        fprintf(stderr, "no statistic \"%s\" in \"%s\"\n", key, group);
+        testFailures++;
+        return 0;
+    }
+
+    ApplePS2Controller *     controller;
+    ApplePS2KeyboardDevice * device;
+    GenericPS2Keyboard *     keyboard;
+
+private:
+    SInt64 _objects;
+    UInt64 _bytes;
+    UInt32 _errors;
+};
+
+#endif /* !_DRIVERHARNESS_H */
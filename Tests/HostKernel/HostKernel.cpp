@@ -0,0 +1,855 @@
+//
+// The host kernel; see HostKernel.h.
+//
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string>
+#include "HostKernel.h"
+
+HostKernelStatistics hostKernelStatistics;
+UInt32               hostFailMallocs;
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// The clock and the event queue.
+//
+
+typedef std::pair<UInt64, UInt64>           HostEventKey;     // when, order
+typedef std::map<HostEventKey, HostEvent *> HostEventQueue;
+
+static HostEventQueue hostEventQueue;
+static UInt64         hostClock;
+static UInt64         hostEventOrder;
+static int            hostGatesClosed;
+
+void HostEvent::schedule(UInt64 when)
+{
+    cancel();
+    _when      = when > hostClock ? when : hostClock;
+    _order     = hostEventOrder++;
+    _scheduled = true;
+    hostEventQueue[HostEventKey(_when, _order)] = this;
+}
+
+void HostEvent::cancel()
+{
+    if (!_scheduled)  return;
+    hostEventQueue.erase(HostEventKey(_when, _order));
+    _scheduled = false;
+}
+
+UInt64 hostTime()
+{
+    return hostClock;
+}
+
+bool hostRunNext(UInt64 limit)
+{
+    HostEventQueue::iterator next = hostEventQueue.begin();
+    HostEvent *              event;
+    
+    if (next == hostEventQueue.end() || next->first.first > limit)  return false;
+    
+    event = next->second;
+    hostEventQueue.erase(next);
+    event->_scheduled = false;
+    if (event->_when > hostClock)  hostClock = event->_when;
+    hostKernelStatistics.events++;
+    event->fire();
+    return true;
+}
+
+void hostRunUntil(UInt64 time)
+{
+    while (hostRunNext(time))  {}
+    if (time > hostClock)  hostClock = time;
+}
+
+void hostWillBlock(const char * what)
+{
+    if (hostGatesClosed)
+        hostKernelError("%s on a work loop, holding its gate", what);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Errors and the log.
+//
+
+#define kHostLogLines           256
+
+static std::vector<std::string> hostLogLines;
+
+void hostKernelError(const char * format, ...)
+{
+    va_list arguments;
+    
+    va_start(arguments, format);
+    fprintf(stderr, "host kernel: ");
+    vfprintf(stderr, format, arguments);
+    fprintf(stderr, "\n");
+    va_end(arguments);
+    hostKernelStatistics.errors++;
+}
+
+void IOLog(const char * format, ...)
+{
+    va_list arguments;
+    char    line[512];
+    
+    va_start(arguments, format);
+    vsnprintf(line, sizeof(line), format, arguments);
+    va_end(arguments);
+    
+    if (hostLogLines.size() >= kHostLogLines)  hostLogLines.erase(hostLogLines.begin());
+    hostLogLines.push_back(line);
+    if (getenv("HOST_KERNEL_LOG"))
+        fprintf(stderr, "%9.3f ms  %s", hostClock / 1000000.0, line);
+}
+
+bool hostLogged(const char * text)
+{
+    for (size_t index = 0; index < hostLogLines.size(); index++)
+        if (strstr(hostLogLines[index].c_str(), text))  return true;
+    return false;
+}
+
+void hostLogReset()
+{
+    hostLogLines.clear();
+}
+
+void hostKernelReset()
+{
+    while (!hostEventQueue.empty())  hostEventQueue.begin()->second->cancel();
+    hostClock       = 0;
+    hostEventOrder  = 0;
+    hostGatesClosed = 0;
+    hostFailMallocs = 0;
+    hostKernelStatistics.events  = 0;
+    hostKernelStatistics.mallocs = 0;
+    hostKernelStatistics.frees   = 0;
+    hostKernelStatistics.errors  = 0;
+    hostLogReset();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// IOLib and the clock.
+//
+
+static std::map<void *, size_t> hostAllocations;
+
+void * IOMalloc(size_t size)
+{
+    void * address;
+    
+    if (hostFailMallocs)
+    {
+        hostFailMallocs--;
+        return 0;
+    }
+    
+    address = malloc(size ? size : 1);
+    hostAllocations[address] = size;
+    hostKernelStatistics.mallocs++;
+    hostKernelStatistics.bytesAllocated += size;
+    return address;
+}
+
+void IOFree(void * address, size_t size)
+{
+    std::map<void *, size_t>::iterator allocation = hostAllocations.find(address);
+    
+    if (!address)  return;
+    if (allocation == hostAllocations.end())
+    {
+        hostKernelError("IOFree of %p, which IOMalloc didn't return", address);
+        return;
+    }
+    if (allocation->second != size)
+        hostKernelError("IOFree of %lu bytes at %p, allocated with %lu",
+                        (unsigned long)size, address, (unsigned long)allocation->second);
+    
+    hostKernelStatistics.frees++;
+    hostKernelStatistics.bytesAllocated -= allocation->second;
+    hostAllocations.erase(allocation);
+    free(address);
+}
+
+void IOSleep(unsigned int milliseconds)
+{
+    hostWillBlock("IOSleep");
+    hostRunUntil(hostClock + milliseconds * 1000000ULL);
+}
+
+void IODelay(unsigned int microseconds)
+{
+    hostWillBlock("IODelay");
+    hostRunUntil(hostClock + microseconds * 1000ULL);
+}
+
+void clock_get_uptime(AbsoluteTime * result)
+{
+    *result = hostClock;
+}
+
+void absolutetime_to_nanoseconds(AbsoluteTime absoluteTime, UInt64 * result)
+{
+    *result = absoluteTime;
+}
+
+void nanoseconds_to_absolutetime(UInt64 nanoseconds, AbsoluteTime * result)
+{
+    *result = nanoseconds;
+}
+
+IOSimpleLock * IOSimpleLockAlloc()
+{
+    IOSimpleLock * lock = (IOSimpleLock *)IOMalloc(sizeof(IOSimpleLock));
+    
+    lock->held = false;
+    return lock;
+}
+
+void IOSimpleLockFree(IOSimpleLock * lock)
+{
+    if (lock->held)  hostKernelError("simple lock freed while held");
+    IOFree(lock, sizeof(IOSimpleLock));
+}
+
+void IOSimpleLockLock(IOSimpleLock * lock)
+{
+    if (lock->held)  hostKernelError("simple lock taken twice");
+    lock->held = true;
+}
+
+void IOSimpleLockUnlock(IOSimpleLock * lock)
+{
+    if (!lock->held)  hostKernelError("simple lock released while not held");
+    lock->held = false;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// libkern containers.
+//
+
+OSObject::OSObject() : _retainCount(1) {}
+OSObject::~OSObject() {}
+const char * OSObject::getClassName() const { return "OSObject"; }
+
+void * OSObject::operator new(size_t size)
+{
+    hostKernelStatistics.objects++;
+    return calloc(1, size);
+}
+
+void OSObject::operator delete(void * memory, size_t)
+{
+    hostKernelStatistics.objects--;
+    ::free(memory);
+}
+
+void OSObject::free()
+{
+    delete this;
+}
+
+void OSObject::retain() const
+{
+    _retainCount++;
+}
+
+void OSObject::release() const
+{
+    if (_retainCount <= 0)
+    {
+        hostKernelError("%s released once too often", getClassName());
+        return;
+    }
+    if (--_retainCount == 0)  const_cast<OSObject *>(this)->free();
+}
+
+OSDefineMetaClassAndStructors(OSString, OSObject)
+
+OSString * OSString::withCString(const char * string)
+{
+    OSString * me = new OSString;
+    
+    me->initWithCString(string);
+    return me;
+}
+
+bool OSString::initWithCString(const char * string)
+{
+    size_t length = strlen(string) + 1;
+    
+    _string = (char *)malloc(length);
+    memcpy(_string, string, length);
+    return true;
+}
+
+void OSString::free()
+{
+    ::free(_string);
+    OSObject::free();
+}
+
+bool OSString::isEqualTo(const char * string) const
+{
+    return strcmp(_string, string) == 0;
+}
+
+OSDefineMetaClassAndStructors(OSSymbol, OSString)
+
+const OSSymbol * OSSymbol::withCString(const char * string)
+{
+    OSSymbol * me = new OSSymbol;
+    
+    me->initWithCString(string);
+    return me;
+}
+
+OSDefineMetaClassAndStructors(OSNumber, OSObject)
+
+OSNumber * OSNumber::withNumber(unsigned long long value, unsigned int numberOfBits)
+{
+    OSNumber * me = new OSNumber;
+    
+    me->_value = numberOfBits < 64 ? value & ((1ULL << numberOfBits) - 1) : value;
+    return me;
+}
+
+OSDefineMetaClassAndStructors(OSBoolean, OSObject)
+
+static OSBoolean hostBooleanTrue;
+static OSBoolean hostBooleanFalse;
+
+OSBoolean * const kOSBooleanTrue  = &hostBooleanTrue;
+OSBoolean * const kOSBooleanFalse = &hostBooleanFalse;
+
+bool OSBoolean::isTrue() const
+{
+    return this == kOSBooleanTrue;
+}
+
+OSDefineMetaClassAndStructors(OSData, OSObject)
+
+OSData * OSData::withBytes(const void * bytes, unsigned int length)
+{
+    OSData * me = new OSData;
+    
+    me->_bytes  = malloc(length ? length : 1);
+    me->_length = length;
+    memcpy(me->_bytes, bytes, length);
+    return me;
+}
+
+void OSData::free()
+{
+    ::free(_bytes);
+    OSObject::free();
+}
+
+OSDefineMetaClassAndStructors(OSCollection, OSObject)
+
+OSDefineMetaClassAndStructors(OSArray, OSCollection)
+
+OSArray * OSArray::withCapacity(unsigned int capacity)
+{
+    OSArray * me = new OSArray;
+    
+    me->_objects.reserve(capacity);
+    return me;
+}
+
+void OSArray::free()
+{
+    for (size_t index = 0; index < _objects.size(); index++)
+        _objects[index]->release();
+    _objects.clear();
+    OSObject::free();
+}
+
+OSObject * OSArray::getObject(unsigned int index) const
+{
+    return index < _objects.size() ? const_cast<OSObject *>(_objects[index]) : 0;
+}
+
+bool OSArray::setObject(const OSObject * object)
+{
+    if (!object)  return false;
+    object->retain();
+    _objects.push_back(object);
+    return true;
+}
+
+OSObject * OSArray::iteratorObject(unsigned int index) const
+{
+    return getObject(index);
+}
+
+OSDefineMetaClassAndStructors(OSDictionary, OSCollection)
+
+OSDictionary * OSDictionary::withCapacity(unsigned int capacity)
+{
+    OSDictionary * me = new OSDictionary;
+    
+    me->_entries.reserve(capacity);
+    return me;
+}
+
+void OSDictionary::free()
+{
+    for (size_t index = 0; index < _entries.size(); index++)
+    {
+        _entries[index].first->release();
+        _entries[index].second->release();
+    }
+    _entries.clear();
+    OSObject::free();
+}
+
+int OSDictionary::find(const char * key) const
+{
+    for (size_t index = 0; index < _entries.size(); index++)
+        if (_entries[index].first->isEqualTo(key))  return (int)index;
+    return -1;
+}
+
+OSObject * OSDictionary::getObject(const char * key) const
+{
+    int index = find(key);
+    
+    return index < 0 ? 0 : const_cast<OSObject *>(_entries[index].second);
+}
+
+OSObject * OSDictionary::getObject(const OSString * key) const
+{
+    return key ? getObject(key->getCStringNoCopy()) : 0;
+}
+
+bool OSDictionary::setObject(const char * key, const OSObject * object)
+{
+    int index = find(key);
+    
+    if (!object)  return false;
+    object->retain();
+    if (index < 0)
+    {
+        _entries.push_back(Entry(OSSymbol::withCString(key), object));
+        return true;
+    }
+    _entries[index].second->release();
+    _entries[index].second = object;
+    return true;
+}
+
+bool OSDictionary::setObject(const OSString * key, const OSObject * object)
+{
+    return key && setObject(key->getCStringNoCopy(), object);
+}
+
+void OSDictionary::removeObject(const char * key)
+{
+    int index = find(key);
+    
+    if (index < 0)  return;
+    _entries[index].first->release();
+    _entries[index].second->release();
+    _entries.erase(_entries.begin() + index);
+}
+
+OSObject * OSDictionary::iteratorObject(unsigned int index) const
+{
+    return index < _entries.size() ? const_cast<OSSymbol *>(_entries[index].first) : 0;
+}
+
+OSDefineMetaClassAndStructors(OSCollectionIterator, OSObject)
+
+OSCollectionIterator * OSCollectionIterator::withCollection(const OSCollection * collection)
+{
+    OSCollectionIterator * me = new OSCollectionIterator;
+    
+    collection->retain();
+    me->_collection = collection;
+    return me;
+}
+
+void OSCollectionIterator::free()
+{
+    _collection->release();
+    OSObject::free();
+}
+
+OSObject * OSCollectionIterator::getNextObject()
+{
+    if (_index >= _collection->getCount())  return 0;
+    return _collection->iteratorObject(_index++);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Services.
+//
+
+OSDefineMetaClassAndStructors(IORegistryEntry, OSObject)
+
+bool IORegistryEntry::init(OSDictionary * dictionary)
+{
+    if (dictionary)
+        dictionary->retain();
+    else
+        dictionary = OSDictionary::withCapacity(16);
+    _properties = dictionary;
+    return true;
+}
+
+void IORegistryEntry::free()
+{
+    if (_properties)  _properties->release();
+    _properties = 0;
+    OSObject::free();
+}
+
+bool IORegistryEntry::setProperty(const char * key, OSObject * object)
+{
+    return _properties && _properties->setObject(key, object);
+}
+
+bool IORegistryEntry::setProperty(const char * key, const char * string)
+{
+    OSString * object = OSString::withCString(string);
+    bool       set    = setProperty(key, object);
+    
+    object->release();
+    return set;
+}
+
+bool IORegistryEntry::setProperty(const char * key, bool value)
+{
+    return setProperty(key, value ? kOSBooleanTrue : kOSBooleanFalse);
+}
+
+bool IORegistryEntry::setProperty(const char * key, unsigned long long value, unsigned int numberOfBits)
+{
+    OSNumber * number = OSNumber::withNumber(value, numberOfBits);
+    bool       set    = setProperty(key, number);
+    
+    number->release();
+    return set;
+}
+
+OSObject * IORegistryEntry::getProperty(const char * key) const
+{
+    return _properties ? _properties->getObject(key) : 0;
+}
+
+void IORegistryEntry::removeProperty(const char * key)
+{
+    if (_properties)  _properties->removeObject(key);
+}
+
+bool IORegistryEntry::serializeProperties(OSSerialize *) const
+{
+    return true;
+}
+
+IOReturn IORegistryEntry::setProperties(OSObject *)
+{
+    return kIOReturnUnsupported;
+}
+
+OSDefineMetaClassAndStructors(IOService, IORegistryEntry)
+
+IOService * IOService::probe(IOService *, SInt32 *)
+{
+    return this;
+}
+
+bool IOService::start(IOService *)
+{
+    _started = true;
+    return true;
+}
+
+void IOService::stop(IOService *)
+{
+    _started = false;
+}
+
+bool IOService::attach(IOService * provider)
+{
+    provider->retain();
+    _provider = provider;
+    return true;
+}
+
+void IOService::detach(IOService * provider)
+{
+    if (provider != _provider)  return;
+    _provider = 0;
+    provider->release();
+}
+
+//
+// The termination thread's work: stop the service if it was started, and
+// detach it.
+//
+
+class HostTermination : public HostEvent
+{
+public:
+    HostTermination(IOService * service) : _service(service)
+    {
+        _service->retain();
+        schedule(hostTime());
+    }
+    
+protected:
+    virtual void fire()
+    {
+        IOService * provider = _service->_provider;
+        
+        if (_service->_started && provider)  _service->stop(provider);
+        if (provider)  _service->detach(provider);
+        _service->release();
+        delete this;
+    }
+    
+private:
+    IOService * _service;
+};
+
+bool IOService::terminate(IOOptionBits)
+{
+    if (_inactive)  return true;
+    _inactive = true;
+    new HostTermination(this);
+    return true;
+}
+
+static IOPMrootDomain hostRootDomain;
+
+IOPMrootDomain * IOService::getPMRootDomain()
+{
+    return &hostRootDomain;
+}
+
+OSDefineMetaClassAndStructors(IOPMrootDomain, IOService)
+
+IOReturn IOPMrootDomain::receivePowerNotification(UInt32 message)
+{
+    hostNotifications |= message;
+    return kIOReturnSuccess;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// The work loop and event sources.
+//
+
+OSDefineMetaClassAndStructors(IOEventSource, OSObject)
+
+bool IOEventSource::init(OSObject * owner, Action action)
+{
+    this->owner   = owner;
+    this->action  = action;
+    this->enabled = true;
+    return true;
+}
+
+void IOEventSource::setWorkLoop(IOWorkLoop * workLoop)
+{
+    this->workLoop = workLoop;
+}
+
+OSDefineMetaClassAndStructors(IOInterruptEventSource, IOEventSource)
+
+IOInterruptEventSource * IOInterruptEventSource::interruptEventSource(OSObject * owner, Action action,
+                                                                      IOService *, int)
+{
+    IOInterruptEventSource * me = new IOInterruptEventSource;
+    
+    me->init(owner, (IOEventSource::Action)action);
+    return me;
+}
+
+void IOInterruptEventSource::interruptOccurred(void *, IOService *, int)
+{
+    _producerCount++;
+    if (workLoop)  workLoop->signalWorkAvailable();
+}
+
+void IOInterruptEventSource::enable()
+{
+    IOEventSource::enable();
+    if (workLoop && _producerCount != _consumerCount)  workLoop->signalWorkAvailable();
+}
+
+bool IOInterruptEventSource::checkForWork()
+{
+    UInt32 count = _producerCount - _consumerCount;
+    
+    if (!enabled || !count)  return false;
+    _consumerCount += count;
+    ((Action)action)(owner, this, (int)count);
+    return _producerCount != _consumerCount;
+}
+
+OSDefineMetaClassAndStructors(IOTimerEventSource, IOEventSource)
+
+IOTimerEventSource * IOTimerEventSource::timerEventSource(OSObject * owner, Action action)
+{
+    IOTimerEventSource * me = new IOTimerEventSource;
+    
+    me->init(owner, (IOEventSource::Action)action);
+    return me;
+}
+
+void IOTimerEventSource::disable()
+{
+    cancelTimeout();
+    IOEventSource::disable();
+}
+
+IOReturn IOTimerEventSource::setTimeoutMS(UInt32 milliseconds)
+{
+    return wakeAtTime(hostTime() + milliseconds * 1000000ULL);
+}
+
+IOReturn IOTimerEventSource::setTimeoutUS(UInt32 microseconds)
+{
+    return wakeAtTime(hostTime() + microseconds * 1000ULL);
+}
+
+IOReturn IOTimerEventSource::wakeAtTime(AbsoluteTime deadline)
+{
+    if (!workLoop || !action)  return kIOReturnNoResources;
+    HostEvent::schedule(deadline);
+    return kIOReturnSuccess;
+}
+
+void IOTimerEventSource::setWorkLoop(IOWorkLoop * workLoop)
+{
+    if (!workLoop)  cancelTimeout();
+    IOEventSource::setWorkLoop(workLoop);
+}
+
+void IOTimerEventSource::fire()
+{
+    IOWorkLoop * gate = workLoop;
+    
+    if (!enabled || !gate)  return;
+    retain();
+    gate->retain();
+    gate->closeGate();
+    ((Action)action)(owner, this);
+    gate->openGate();
+    gate->release();
+    release();
+}
+
+OSDefineMetaClassAndStructors(IOWorkLoop, OSObject)
+
+IOWorkLoop * IOWorkLoop::workLoop()
+{
+    return new IOWorkLoop;
+}
+
+void IOWorkLoop::free()
+{
+    while (!_sources.empty())  removeEventSource(_sources.back());
+    OSObject::free();
+}
+
+IOReturn IOWorkLoop::addEventSource(IOEventSource * source)
+{
+    source->retain();
+    _sources.push_back(source);
+    source->setWorkLoop(this);
+    signalWorkAvailable();
+    return kIOReturnSuccess;
+}
+
+IOReturn IOWorkLoop::removeEventSource(IOEventSource * source)
+{
+    for (size_t index = 0; index < _sources.size(); index++)
+    {
+        if (_sources[index] != source)  continue;
+        _sources.erase(_sources.begin() + index);
+        source->setWorkLoop(0);
+        source->release();
+        return kIOReturnSuccess;
+    }
+    return kIOReturnBadArgument;
+}
+
+IOReturn IOWorkLoop::runAction(Action action, OSObject * target, void * arg0, void * arg1,
+                               void * arg2, void * arg3)
+{
+    IOReturn result;
+    
+    closeGate();
+    result = action(target, arg0, arg1, arg2, arg3);
+    openGate();
+    return result;
+}
+
+void IOWorkLoop::signalWorkAvailable()
+{
+    if (!isScheduled())  schedule(hostTime());
+}
+
+void IOWorkLoop::closeGate()
+{
+    _gateDepth++;
+    hostGatesClosed++;
+}
+
+void IOWorkLoop::openGate()
+{
+    _gateDepth--;
+    hostGatesClosed--;
+}
+
+void IOWorkLoop::fire()
+{
+    bool more = true;
+    
+    retain();
+    closeGate();
+    while (more)
+    {
+        std::vector<IOEventSource *> sources(_sources);
+        
+        more = false;
+        for (size_t index = 0; index < sources.size(); index++)  sources[index]->retain();
+        for (size_t index = 0; index < sources.size(); index++)
+        {
+            if (sources[index]->getWorkLoop() == this && sources[index]->checkForWork())  more = true;
+            sources[index]->release();
+        }
+    }
+    openGate();
+    release();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// The HID system.
+//
+
+OSDefineMetaClassAndStructors(IOHIDevice, IOService)
+
+OSDefineMetaClassAndStructors(IOHIKeyboard, IOHIDevice)
+
+void IOHIKeyboard::dispatchKeyboardEvent(unsigned int keyCode, bool goingDown, AbsoluteTime)
+{
+    if (goingDown)
+        hostKeyDowns++;
+    else
+        hostKeyUps++;
+    hostLastKeyCode = keyCode;
+}
+
+const unsigned char * IOHIKeyboard::defaultKeymapOfLength(UInt32 * length)
+{
+    *length = 0;
+    return 0;
+}
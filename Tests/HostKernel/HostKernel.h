@@ -0,0 +1,693 @@
+#ifndef _HOSTKERNEL_H
+#define _HOSTKERNEL_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <utility>
+#include <vector>
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Host kernel.
+//
+// Enough of the kernel, libkern and IOKit for GenericPS2Keyboard.cpp to build
+// and run on the host, unchanged.  The headers the driver includes (IOKit/...,
+// libkern/..., kern/queue.h) all lead here.
+//
+// Everything runs on one thread, on a simulated clock.  Whatever would happen
+// later or on another thread -- timers, work loop event sources, the PS/2
+// controller working through its requests -- is an event on one queue, in
+// order of simulated time, and running the queue moves the clock to each
+// event in turn.  A blocking call (IOSleep, submitRequestAndBlock) runs the
+// queue until it can return, which is what the rest of the system would
+// have been doing meanwhile.  AbsoluteTime is in nanoseconds.
+//
+// Misuse that a real kernel would punish (freeing with the wrong size, taking
+// a simple lock twice, blocking on the work loop) is counted as an error and
+// reported, so that tests fail on it.
+//
+
+typedef uint8_t     UInt8;
+typedef uint16_t    UInt16;
+typedef uint32_t    UInt32;
+typedef uint64_t    UInt64;
+typedef int8_t      SInt8;
+typedef int16_t     SInt16;
+typedef int32_t     SInt32;
+typedef int64_t     SInt64;
+
+typedef UInt64      AbsoluteTime;
+typedef int         IOReturn;
+typedef int         kern_return_t;
+typedef UInt32      IOOptionBits;
+
+#define kIOReturnSuccess        0
+#define kIOReturnError          ((IOReturn)0xe00002bc)
+#define kIOReturnNoMemory       ((IOReturn)0xe00002bd)
+#define kIOReturnNoResources    ((IOReturn)0xe00002be)
+#define kIOReturnBadArgument    ((IOReturn)0xe00002c2)
+#define kIOReturnUnsupported    ((IOReturn)0xe00002c7)
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// The simulated clock and the event queue.
+//
+
+class HostEvent
+{
+public:
+    HostEvent() : _scheduled(false), _when(0), _order(0) {}
+    virtual ~HostEvent()                { cancel(); }
+
+    void   schedule(UInt64 when);       // replaces a pending one; never earlier than now
+    void   cancel();
+    bool   isScheduled() const          { return _scheduled; }
+    UInt64 deadline() const             { return _when; }
+
+protected:
+    virtual void fire() = 0;
+
+private:
+    friend bool hostRunNext(UInt64 limit);
+
+    bool   _scheduled;
+    UInt64 _when;
+    UInt64 _order;                      // events due at the same time fire in order
+};
+
+//
+// An event that calls a member function of its owner.
+//
+
+template <class Owner>
+class HostCall : public HostEvent
+{
+public:
+    typedef void (Owner::*Handler)();
+
+    HostCall(Owner * owner, Handler handler) : _owner(owner), _handler(handler) {}
+
+protected:
+    virtual void fire()                 { (_owner->*_handler)(); }
+
+private:
+    Owner * _owner;
+    Handler _handler;
+};
+
+UInt64 hostTime();
+
+//
+// Fires the next event due by limit, moving the clock to it; returns false,
+// leaving the clock alone, if there is none.
+//
+
+bool hostRunNext(UInt64 limit = ~0ULL);
+
+//
+// Fires every event due by the given time, and moves the clock to it.
+//
+
+void hostRunUntil(UInt64 time);
+
+//
+// Counters, and the errors described above.
+//
+
+struct HostKernelStatistics
+{
+    UInt64 events;                      // fired
+    UInt64 mallocs;                     // IOMalloc
+    UInt64 frees;                       // IOFree
+    UInt64 bytesAllocated;              // outstanding
+    SInt64 objects;                     // OSObjects alive on the heap
+    UInt32 errors;
+};
+
+extern HostKernelStatistics hostKernelStatistics;
+
+//
+// The next this many IOMallocs fail, for tests of the allocation failure
+// paths.
+//
+
+extern UInt32 hostFailMallocs;
+
+void hostKernelError(const char * format, ...) __attribute__((format(printf, 1, 2)));
+
+//
+// IOLog keeps the last lines logged, and prints them as well if the
+// HOST_KERNEL_LOG environment variable is set.
+//
+
+bool hostLogged(const char * text);
+void hostLogReset();
+
+//
+// Starts over: an empty queue and log, the clock at zero, and zero counters.
+// Only between tests, with nothing scheduled that anyone still expects.
+//
+
+void hostKernelReset();
+
+//
+// Called before anything that blocks; it is an error to block on a work
+// loop, holding its gate.
+//
+
+void hostWillBlock(const char * what);
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// kern, libkern and IOLib.
+//
+
+struct queue_entry
+{
+    struct queue_entry * next;
+    struct queue_entry * prev;
+};
+
+typedef struct queue_entry queue_chain_t;
+
+void   IOLog(const char * format, ...) __attribute__((format(printf, 1, 2)));
+void * IOMalloc(size_t size);
+void   IOFree(void * address, size_t size);
+void   IOSleep(unsigned int milliseconds);
+void   IODelay(unsigned int microseconds);
+
+void   clock_get_uptime(AbsoluteTime * result);
+void   absolutetime_to_nanoseconds(AbsoluteTime absoluteTime, UInt64 * result);
+void   nanoseconds_to_absolutetime(UInt64 nanoseconds, AbsoluteTime * result);
+
+static inline SInt32 OSIncrementAtomic(volatile SInt32 * address)
+{
+    return __sync_fetch_and_add(address, 1);
+}
+
+static inline SInt32 OSAddAtomic(SInt32 amount, volatile SInt32 * address)
+{
+    return __sync_fetch_and_add(address, amount);
+}
+
+static inline bool OSCompareAndSwap(UInt32 oldValue, UInt32 newValue, volatile UInt32 * address)
+{
+    return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+
+static inline bool OSCompareAndSwapPtr(void * oldValue, void * newValue, void * volatile * address)
+{
+    return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+
+static inline UInt32 OSBitOrAtomic(UInt32 mask, volatile UInt32 * address)
+{
+    return __sync_fetch_and_or(address, mask);
+}
+
+static inline UInt32 OSBitAndAtomic(UInt32 mask, volatile UInt32 * address)
+{
+    return __sync_fetch_and_and(address, mask);
+}
+
+struct IOSimpleLock
+{
+    bool held;
+};
+
+IOSimpleLock * IOSimpleLockAlloc();
+void           IOSimpleLockFree(IOSimpleLock * lock);
+void           IOSimpleLockLock(IOSimpleLock * lock);
+void           IOSimpleLockUnlock(IOSimpleLock * lock);
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// libkern containers.  Objects are reference counted as in the kernel; the
+// memory of a new one is zeroed.  Symbols aren't unique, and compare by
+// their strings.
+//
+
+class OSSerialize;
+
+#define OSDeclareDefaultStructors(className) \
+    public: \
+        className(); \
+        virtual ~className(); \
+        virtual const char * getClassName() const;
+
+#define OSDefineMetaClassAndStructors(className, superclassName) \
+    className::className() {} \
+    className::~className() {} \
+    const char * className::getClassName() const { return #className; }
+
+#define OSMetaClassDeclareReservedUnused(className, index)
+
+#define OSDynamicCast(type, object) \
+    dynamic_cast<type *>(const_cast<OSObject *>(static_cast<const OSObject *>(object)))
+
+class OSObject
+{
+    OSDeclareDefaultStructors(OSObject);
+
+public:
+    static void * operator new(size_t size);
+    static void   operator delete(void * memory, size_t size);
+
+    virtual void free();
+    virtual void retain() const;
+    virtual void release() const;
+    int          getRetainCount() const     { return _retainCount; }
+
+private:
+    mutable int _retainCount;
+};
+
+class OSString : public OSObject
+{
+    OSDeclareDefaultStructors(OSString);
+
+public:
+    static OSString * withCString(const char * string);
+
+    virtual void free();
+    const char *  getCStringNoCopy() const  { return _string; }
+    unsigned int  getLength() const         { return (unsigned int)strlen(_string); }
+    bool          isEqualTo(const char * string) const;
+
+protected:
+    bool initWithCString(const char * string);
+
+private:
+    char * _string;
+};
+
+class OSSymbol : public OSString
+{
+    OSDeclareDefaultStructors(OSSymbol);
+
+public:
+    static const OSSymbol * withCString(const char * string);
+};
+
+class OSNumber : public OSObject
+{
+    OSDeclareDefaultStructors(OSNumber);
+
+public:
+    static OSNumber * withNumber(unsigned long long value, unsigned int numberOfBits);
+
+    UInt8  unsigned8BitValue() const        { return (UInt8)_value; }
+    UInt16 unsigned16BitValue() const       { return (UInt16)_value; }
+    UInt32 unsigned32BitValue() const       { return (UInt32)_value; }
+    UInt64 unsigned64BitValue() const       { return _value; }
+
+private:
+    UInt64 _value;
+};
+
+class OSBoolean : public OSObject
+{
+    OSDeclareDefaultStructors(OSBoolean);
+
+public:
+    bool isTrue() const;
+    bool isFalse() const                    { return !isTrue(); }
+
+    virtual void retain() const             {}
+    virtual void release() const            {}
+};
+
+extern OSBoolean * const kOSBooleanTrue;
+extern OSBoolean * const kOSBooleanFalse;
+
+class OSData : public OSObject
+{
+    OSDeclareDefaultStructors(OSData);
+
+public:
+    static OSData * withBytes(const void * bytes, unsigned int length);
+
+    virtual void  free();
+    const void *  getBytesNoCopy() const    { return _bytes; }
+    unsigned int  getLength() const         { return _length; }
+
+private:
+    void *       _bytes;
+    unsigned int _length;
+};
+
+class OSCollection : public OSObject
+{
+    OSDeclareDefaultStructors(OSCollection);
+
+public:
+    virtual unsigned int getCount() const = 0;
+
+protected:
+    friend class OSCollectionIterator;
+
+    //
+    // What an iterator returns at the index: objects, or a dictionary's keys.
+    //
+
+    virtual OSObject * iteratorObject(unsigned int index) const = 0;
+};
+
+class OSArray : public OSCollection
+{
+    OSDeclareDefaultStructors(OSArray);
+
+public:
+    static OSArray * withCapacity(unsigned int capacity);
+
+    virtual void         free();
+    virtual unsigned int getCount() const   { return (unsigned int)_objects.size(); }
+    OSObject *           getObject(unsigned int index) const;
+    bool                 setObject(const OSObject * object);
+
+protected:
+    virtual OSObject * iteratorObject(unsigned int index) const;
+
+private:
+    std::vector<const OSObject *> _objects;
+};
+
+class OSDictionary : public OSCollection
+{
+    OSDeclareDefaultStructors(OSDictionary);
+
+public:
+    static OSDictionary * withCapacity(unsigned int capacity);
+
+    virtual void         free();
+    virtual unsigned int getCount() const   { return (unsigned int)_entries.size(); }
+    OSObject *           getObject(const char * key) const;
+    OSObject *           getObject(const OSString * key) const;
+    bool                 setObject(const char * key, const OSObject * object);
+    bool                 setObject(const OSString * key, const OSObject * object);
+    void                 removeObject(const char * key);
+
+protected:
+    virtual OSObject * iteratorObject(unsigned int index) const;
+
+private:
+    typedef std::pair<const OSSymbol *, const OSObject *> Entry;
+
+    int find(const char * key) const;
+
+    std::vector<Entry> _entries;
+};
+
+class OSCollectionIterator : public OSObject
+{
+    OSDeclareDefaultStructors(OSCollectionIterator);
+
+public:
+    static OSCollectionIterator * withCollection(const OSCollection * collection);
+
+    virtual void free();
+    OSObject *   getNextObject();
+    void         reset()                    { _index = 0; }
+
+private:
+    const OSCollection * _collection;
+    unsigned int         _index;
+};
+
+//
+// The kernel's OSMemberFunctionCast: the address of the function a member
+// function pointer calls on the given object, to be called with the object
+// as its first argument.  This is the Itanium C++ ABI, as the kernel's.
+//
+
+template <class Function, class Object, class Member>
+static inline Function hostMemberFunction(const Object * object, Member member)
+{
+    union
+    {
+        Member    member;
+        uintptr_t parts[2];             // function or 1 + vtable offset, this adjustment
+    } map;
+
+    typedef char MemberIsTwoWords[sizeof(Member) == sizeof(map.parts) ? 1 : -1] __attribute__((unused));
+
+    map.member = member;
+    if (map.parts[0] & 1)
+    {
+        const char * vtable = *(const char * const *)((const char *)object + map.parts[1]);
+        return (Function)*(void * const *)(vtable + map.parts[0] - 1);
+    }
+    return (Function)map.parts[0];
+}
+
+#define OSMemberFunctionCast(type, object, member) hostMemberFunction<type>(object, member)
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// IOKit services.  terminate() stops and detaches the service later, from
+// the event queue, as the kernel does from its termination thread.
+//
+
+class IOService;
+class IOPMrootDomain;
+class IOWorkLoop;
+
+#define kIOServiceAsynchronous  0x00000001
+
+class IORegistryEntry : public OSObject
+{
+    OSDeclareDefaultStructors(IORegistryEntry);
+
+public:
+    virtual bool       init(OSDictionary * dictionary = 0);
+    virtual void       free();
+    virtual bool       setProperty(const char * key, OSObject * object);
+    bool               setProperty(const char * key, const char * string);
+    bool               setProperty(const char * key, bool value);
+    bool               setProperty(const char * key, unsigned long long value, unsigned int numberOfBits);
+    virtual OSObject * getProperty(const char * key) const;
+    virtual void       removeProperty(const char * key);
+    virtual bool       serializeProperties(OSSerialize * serialize) const;
+    virtual IOReturn   setProperties(OSObject * properties);
+    const char *       getName() const      { return getClassName(); }
+
+private:
+    OSDictionary * _properties;
+};
+
+class IOService : public IORegistryEntry
+{
+    OSDeclareDefaultStructors(IOService);
+
+public:
+    virtual IOService * probe(IOService * provider, SInt32 * score);
+    virtual bool        start(IOService * provider);
+    virtual void        stop(IOService * provider);
+    virtual bool        attach(IOService * provider);
+    virtual void        detach(IOService * provider);
+    virtual bool        terminate(IOOptionBits options = 0);
+    bool                isInactive() const  { return _inactive; }
+    IOService *         getProvider() const { return _provider; }
+    IOPMrootDomain *    getPMRootDomain();
+
+private:
+    friend class HostTermination;
+
+    IOService * _provider;
+    bool        _inactive;
+    bool        _started;
+};
+
+#define kIOPMSleepNow           (1 << 0)
+#define kIOPMPowerButton        (1 << 3)
+#define kIOPMDisplaySleepNow    (1 << 14)
+
+class IOPMrootDomain : public IOService
+{
+    OSDeclareDefaultStructors(IOPMrootDomain);
+
+public:
+    IOReturn receivePowerNotification(UInt32 message);
+
+    UInt32 hostNotifications;           // the messages received, OR'd
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// The work loop and its event sources.  Interrupt event sources run their
+// actions from the work loop's event, timers from their own; both hold the
+// work loop's gate, as runAction does.  Anything else that wants the gate
+// while it is held means the driver blocked on its work loop.
+//
+
+class IOEventSource : public OSObject
+{
+    OSDeclareDefaultStructors(IOEventSource);
+
+public:
+    typedef void (*Action)(OSObject * owner, ...);
+
+    virtual void enable()                   { enabled = true; }
+    virtual void disable()                  { enabled = false; }
+    bool         isEnabled() const          { return enabled; }
+    IOWorkLoop * getWorkLoop() const        { return workLoop; }
+
+protected:
+    friend class IOWorkLoop;
+
+    virtual bool init(OSObject * owner, Action action);
+    virtual void setWorkLoop(IOWorkLoop * workLoop);
+    virtual bool checkForWork()             { return false; }
+
+    OSObject *   owner;
+    Action       action;
+    bool         enabled;
+    IOWorkLoop * workLoop;
+};
+
+class IOInterruptEventSource : public IOEventSource
+{
+    OSDeclareDefaultStructors(IOInterruptEventSource);
+
+public:
+    typedef void (*Action)(OSObject * owner, IOInterruptEventSource * sender, int count);
+
+    static IOInterruptEventSource * interruptEventSource(OSObject * owner, Action action,
+                                                         IOService * provider = 0, int intIndex = 0);
+
+    virtual void interruptOccurred(void * refcon, IOService * nub, int source);
+
+    virtual void enable();
+
+protected:
+    virtual bool checkForWork();
+
+private:
+    volatile UInt32 _producerCount;
+    UInt32          _consumerCount;
+};
+
+class IOTimerEventSource : public IOEventSource, private HostEvent
+{
+    OSDeclareDefaultStructors(IOTimerEventSource);
+
+public:
+    typedef void (*Action)(OSObject * owner, IOTimerEventSource * sender);
+
+    static IOTimerEventSource * timerEventSource(OSObject * owner, Action action = 0);
+
+    virtual void     disable();
+    virtual IOReturn setTimeoutMS(UInt32 milliseconds);
+    virtual IOReturn setTimeoutUS(UInt32 microseconds);
+    virtual IOReturn wakeAtTime(AbsoluteTime deadline);
+    virtual void     cancelTimeout()        { HostEvent::cancel(); }
+
+protected:
+    virtual void setWorkLoop(IOWorkLoop * workLoop);
+    virtual void fire();
+};
+
+class IOWorkLoop : public OSObject, private HostEvent
+{
+    OSDeclareDefaultStructors(IOWorkLoop);
+
+public:
+    typedef IOReturn (*Action)(OSObject * target, void * arg0, void * arg1, void * arg2, void * arg3);
+
+    static IOWorkLoop * workLoop();
+
+    virtual void     free();
+    virtual IOReturn addEventSource(IOEventSource * source);
+    virtual IOReturn removeEventSource(IOEventSource * source);
+    virtual IOReturn runAction(Action action, OSObject * target,
+                               void * arg0 = 0, void * arg1 = 0, void * arg2 = 0, void * arg3 = 0);
+    void             signalWorkAvailable();
+
+    //
+    // The gate, for the event sources.
+    //
+
+    void closeGate();
+    void openGate();
+
+protected:
+    virtual void fire();
+
+private:
+    std::vector<IOEventSource *> _sources;
+    int                          _gateDepth;
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// The HID system.  IOHIKeyboard counts what is dispatched to it; setAlphaLock
+// and setNumLock are how the HID system drives the LEDs.
+//
+
+class IOHIDevice : public IOService
+{
+    OSDeclareDefaultStructors(IOHIDevice);
+};
+
+class IOHIKeyboard : public IOHIDevice
+{
+    OSDeclareDefaultStructors(IOHIKeyboard);
+
+public:
+    virtual void   dispatchKeyboardEvent(unsigned int keyCode, bool goingDown, AbsoluteTime time);
+    virtual void   setAlphaLock(bool locked)    { setAlphaLockFeedback(locked); }
+    virtual void   setNumLock(bool locked)      { setNumLockFeedback(locked); }
+    virtual UInt32 deviceType()                 { return 0; }
+    virtual UInt32 interfaceID()                { return 0; }
+
+    UInt32       hostKeyDowns;
+    UInt32       hostKeyUps;
+    unsigned int hostLastKeyCode;
+
+protected:
+    virtual const unsigned char * defaultKeymapOfLength(UInt32 * length);
+    virtual void                  setAlphaLockFeedback(bool)  {}
+    virtual void                  setNumLockFeedback(bool)    {}
+    virtual UInt32                maxKeyCodes()               { return 0; }
+};
+
+#define kIOHIDVendorIDKey               "VendorID"
+#define kIOHIDProductIDKey              "ProductID"
+#define kIOHIDManufacturerKey           "Manufacturer"
+#define kIOHIDProductKey                "Product"
+
+#define NX_EVS_DEVICE_INTERFACE_ACE     2
+
+#define NX_ASCIISET                     0
+#define NX_SYMBOLSET                    1
+
+#define NX_MODIFIERKEY_ALPHALOCK        0
+#define NX_MODIFIERKEY_SHIFT            1
+#define NX_MODIFIERKEY_CONTROL          2
+#define NX_MODIFIERKEY_ALTERNATE        3
+#define NX_MODIFIERKEY_COMMAND          4
+#define NX_MODIFIERKEY_NUMERICPAD       5
+#define NX_MODIFIERKEY_HELP             6
+#define NX_MODIFIERKEY_SECONDARYFN      7
+#define NX_MODIFIERKEY_NUMLOCK          8
+#define NX_MODIFIERKEY_RSHIFT           9
+#define NX_MODIFIERKEY_RCONTROL         10
+#define NX_MODIFIERKEY_RALTERNATE       11
+#define NX_MODIFIERKEY_RCOMMAND         12
+
+#define NX_KEYTYPE_SOUND_UP             0
+#define NX_KEYTYPE_SOUND_DOWN           1
+#define NX_KEYTYPE_BRIGHTNESS_UP        2
+#define NX_KEYTYPE_BRIGHTNESS_DOWN      3
+#define NX_KEYTYPE_CAPS_LOCK            4
+#define NX_KEYTYPE_HELP                 5
+#define NX_POWER_KEY                    6
+#define NX_KEYTYPE_MUTE                 7
+#define NX_UP_ARROW_KEY                 8
+#define NX_DOWN_ARROW_KEY               9
+#define NX_KEYTYPE_NUM_LOCK             10
+#define NX_KEYTYPE_PLAY                 16
+#define NX_KEYTYPE_NEXT                 17
+#define NX_KEYTYPE_PREVIOUS             18
+#define NX_KEYTYPE_FAST                 19
+#define NX_KEYTYPE_REWIND               20
+
+#endif /* !_HOSTKERNEL_H */
@@ -0,0 +1,2 @@
+// Host stand-in; see HostKernel.h.
+#include "../../HostKernel.h"
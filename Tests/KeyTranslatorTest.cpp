@@ -0,0 +1,182 @@
+//
+// Checks the key translator's key state: a key's release is translated as
+// it was pressed, and only a key that is down can be released, so a release
+// that arrives after a flush or a table switch does nothing.  Also the
+// layers, and what carries over a table switch.
+//
+
+#include "GenericPS2KeyTranslator.h"
+#include "TestSupport.h"
+
+#define kKey            0x1e    // A
+#define kOtherKey       0x1f    // S
+
+static KeyTranslation oldTables[KBV_NUM_KEYCODES];
+static KeyTranslation newTables[KBV_NUM_KEYCODES];
+
+static void setUp(KeyTranslator * translator)
+{
+    for (int keyCode = 0; keyCode < KBV_NUM_KEYCODES; keyCode++)
+    {
+        oldTables[keyCode] = keyCode;
+        newTables[keyCode] = keyCode;
+    }
+    oldTables[kKey] = kKeyTranslateMacro | 1;
+    newTables[kKey] = kKeyTranslateMacro | 2;
+    translator->reset();
+    translator->setTables(oldTables, 1, 0);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static void testReleaseAfterSwitch()
+{
+    //
+    // A macro key held across a table switch is released by the flush before
+    // it, with the old macro; its real release later does nothing, rather
+    // than run the Up steps of whatever the new tables have at that index.
+    //
+    
+    KeyTranslator translator;
+    KeyEvent      event;
+    
+    setUp(&translator);
+    CHECK_EQUAL(translator.translate(kKey, 1, &event), kKeyEventKey);
+    CHECK_EQUAL(event.translation, kKeyTranslateMacro | 1);
+    
+    CHECK_EQUAL(translator.flush(&event), kKeyEventKey);
+    CHECK_EQUAL(event.keyCode, kKey);
+    CHECK(!event.goingDown);
+    CHECK_EQUAL(event.translation, kKeyTranslateMacro | 1);
+    CHECK_EQUAL(translator.flush(&event), kKeyEventNone);
+    translator.setTables(newTables, 1, 0);
+    
+    CHECK_EQUAL(translator.translate(kKey | kSC_UpBit, 2, &event), kKeyEventNone);
+    CHECK(!translator.isKeyDown(kKey));
+    
+    CHECK_EQUAL(translator.translate(kKey, 3, &event), kKeyEventKey);
+    CHECK_EQUAL(event.translation, kKeyTranslateMacro | 2);
+    CHECK_EQUAL(translator.translate(kKey | kSC_UpBit, 4, &event), kKeyEventKey);
+    CHECK_EQUAL(event.translation, kKeyTranslateMacro | 2);
+}
+
+static void testStrayRelease()
+{
+    //
+    // A release of a key never pressed, or released twice.
+    //
+    
+    KeyTranslator translator;
+    KeyEvent      event;
+    
+    setUp(&translator);
+    CHECK_EQUAL(translator.translate(kOtherKey | kSC_UpBit, 1, &event), kKeyEventNone);
+    CHECK_EQUAL(translator.translate(kOtherKey, 2, &event), kKeyEventKey);
+    CHECK_EQUAL(translator.translate(kOtherKey | kSC_UpBit, 3, &event), kKeyEventKey);
+    CHECK_EQUAL(translator.translate(kOtherKey | kSC_UpBit, 4, &event), kKeyEventNone);
+}
+
+static void testHighestLayer()
+{
+    //
+    // Every layer the tables can have, up to the last bit of the layer mask,
+    // can be held and toggled.
+    //
+    
+    static KeyTranslation layered[kKeymapMaxLayers * KBV_NUM_KEYCODES];
+    
+    KeyTranslator translator;
+    KeyEvent      event;
+    UInt32        top = kKeymapMaxLayers - 1;
+    
+    for (UInt32 layer = 0; layer < kKeymapMaxLayers; layer++)
+    {
+        KeyTranslation * table = layered + layer * KBV_NUM_KEYCODES;
+        
+        for (int keyCode = 0; keyCode < KBV_NUM_KEYCODES; keyCode++)  table[keyCode] = keyCode;
+        table[kKey]      = kKeyTranslateLayerMomentary | top;
+        table[kOtherKey] = kKeyTranslateLayerToggle | top;
+        table[0x30]      = layer;
+    }
+    translator.reset();
+    translator.setTables(layered, kKeymapMaxLayers, 0);
+    
+    CHECK_EQUAL(translator.translate(kKey, 1, &event), kKeyEventLayer);
+    CHECK_EQUAL(translator.translate(0x30, 2, &event), kKeyEventKey);
+    CHECK_EQUAL(event.translation, top);
+    CHECK_EQUAL(translator.translate(0x30 | kSC_UpBit, 3, &event), kKeyEventKey);
+    CHECK_EQUAL(translator.translate(kKey | kSC_UpBit, 4, &event), kKeyEventLayer);
+    CHECK_EQUAL(translator.translate(0x30, 5, &event), kKeyEventKey);
+    CHECK_EQUAL(event.translation, 0);
+    CHECK_EQUAL(translator.translate(0x30 | kSC_UpBit, 6, &event), kKeyEventKey);
+    
+    CHECK_EQUAL(translator.translate(kOtherKey, 7, &event), kKeyEventLayer);
+    CHECK_EQUAL(translator.translate(kOtherKey | kSC_UpBit, 8, &event), kKeyEventLayer);
+    CHECK_EQUAL(translator.translate(0x30, 9, &event), kKeyEventKey);
+    CHECK_EQUAL(event.translation, top);
+}
+
+static void testSequenceAcrossSwitch()
+{
+    //
+    // Flushing and switching tables between E0 and the byte that follows it
+    // doesn't turn E0 48, up arrow, into keypad 8.
+    //
+    
+    KeyTranslator translator;
+    KeyEvent      event;
+    
+    setUp(&translator);
+    CHECK_EQUAL(translator.translate(kSC_Extend, 1, &event), kKeyEventNone);
+    CHECK_EQUAL(translator.flush(&event), kKeyEventNone);
+    translator.setTables(newTables, 1, 0);
+    CHECK(!translator.sequenceIdle());
+    CHECK_EQUAL(translator.translate(0x48, 2, &event), kKeyEventKey);
+    CHECK_EQUAL(event.keyCode, 0x64);
+    
+    translator.abandonSequence();
+    CHECK(translator.sequenceIdle());
+}
+
+static void testToggleAcrossSwitch()
+{
+    //
+    // A toggled layer stays on across a switch to tables that still have it,
+    // and goes off with one to tables that don't.
+    //
+    
+    static KeyTranslation layered[2 * KBV_NUM_KEYCODES];
+    
+    KeyTranslator translator;
+    KeyEvent      event;
+    
+    for (int keyCode = 0; keyCode < 2 * KBV_NUM_KEYCODES; keyCode++)
+        layered[keyCode] = keyCode % KBV_NUM_KEYCODES;
+    layered[kKey]                    = kKeyTranslateLayerToggle | 1;
+    layered[KBV_NUM_KEYCODES + kKey] = kKeyTranslateLayerToggle | 1;
+    layered[KBV_NUM_KEYCODES + 0x30] = 0x7f;
+    translator.reset();
+    translator.setTables(layered, 2, 0);
+    
+    CHECK_EQUAL(translator.translate(kKey, 1, &event), kKeyEventLayer);
+    CHECK_EQUAL(translator.translate(kKey | kSC_UpBit, 2, &event), kKeyEventLayer);
+    translator.setTables(layered, 2, 0);
+    CHECK_EQUAL(translator.translate(0x30, 3, &event), kKeyEventKey);
+    CHECK_EQUAL(event.translation, 0x7f);
+    CHECK_EQUAL(translator.translate(0x30 | kSC_UpBit, 4, &event), kKeyEventKey);
+    
+    translator.setTables(layered, 1, 0);
+    translator.setTables(layered, 2, 0);
+    CHECK_EQUAL(translator.translate(0x30, 5, &event), kKeyEventKey);
+    CHECK_EQUAL(event.translation, 0x30);
+}
+
+int main()
+{
+    testReleaseAfterSwitch();
+    testStrayRelease();
+    testHighestLayer();
+    testSequenceAcrossSwitch();
+    testToggleAcrossSwitch();
+    return testResult("KeyTranslatorTest");
+}
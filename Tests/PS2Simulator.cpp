@@ -0,0 +1,839 @@
+//
+// The simulated 8042 controller and keyboard, and ApplePS2KeyboardDevice on
+// top of them; see PS2Simulator.h.
+//
+
+#include <string.h>
+#include "PS2Simulator.h"
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// The keyboard.
+//
+
+SimulatedKeyboard::SimulatedKeyboard(ApplePS2Controller * controller)
+    : _controller(controller),
+      _receiveEvent(this, &SimulatedKeyboard::received),
+      _sendEvent(this, &SimulatedKeyboard::sent),
+      _responseEvent(this, &SimulatedKeyboard::responded),
+      _resetEvent(this, &SimulatedKeyboard::resetDone),
+      _typeEvent(this, &SimulatedKeyboard::typed),
+      _receiving(0),
+      _argumentFor(0),
+      _scanning(false),
+      _powered(true)
+{
+    restoreDefaults();
+}
+
+void SimulatedKeyboard::restoreDefaults()
+{
+    _leds        = 0;
+    _typematic   = 0x2b;
+    _argumentFor = 0;
+}
+
+bool SimulatedKeyboard::idle() const
+{
+    return !_receiveEvent.isScheduled() && !_sendEvent.isScheduled() &&
+           !_responseEvent.isScheduled() && !_resetEvent.isScheduled() && _typing.empty();
+}
+
+void SimulatedKeyboard::receive(UInt8 byte)
+{
+    //
+    // The controller holds the clock low to send, which makes us give up a
+    // byte we were sending; it goes again once the line is free.
+    //
+    
+    _sendEvent.cancel();
+    _receiving = byte;
+    _controller->statistics.bytesToKeyboard++;
+    _receiveEvent.schedule(hostTime() + _controller->timing.wireByteNS);
+}
+
+void SimulatedKeyboard::received()
+{
+    PS2Faults & faults = _controller->faults;
+    UInt8       byte   = _receiving;
+    
+    if (!_powered || faults.absent)
+    {
+        sendNext();
+        return;
+    }
+    
+    if (faults.lostCommands)
+    {
+        faults.lostCommands--;
+        sendNext();
+        return;
+    }
+    
+    if (faults.resends)
+    {
+        faults.resends--;
+        respond(kSC_Resend);
+        return;
+    }
+    
+    if (_argumentFor)
+    {
+        if (_argumentFor == kDP_SetKeyboardLEDs)
+            _leds = byte & 0x07;
+        else
+            _typematic = byte & 0x7f;
+        _argumentFor = 0;
+        respond(kSC_Acknowledge);
+        return;
+    }
+    
+    switch (byte)
+    {
+        case kDP_SetKeyboardLEDs:
+        case kDP_SetKeyboardTypematic:
+            _argumentFor = byte;
+            respond(kSC_Acknowledge);
+            break;
+        case kDP_TestKeyboardEcho:
+            respond(kDP_TestKeyboardEcho);
+            break;
+        case kDP_GetId:             // a translated MF2 keyboard
+            respond(kSC_Acknowledge);
+            respond(0xab);
+            respond(0x41);
+            break;
+        case kDP_Enable:
+            _scanning = true;
+            respond(kSC_Acknowledge);
+            break;
+        case kDP_SetDefaultsAndDisable:
+            restoreDefaults();
+            _scanning = false;
+            respond(kSC_Acknowledge);
+            break;
+        case kDP_SetDefaults:
+            restoreDefaults();
+            respond(kSC_Acknowledge);
+            break;
+        case kDP_Reset:
+            restoreDefaults();
+            _scanning = false;
+            _output.clear();
+            respond(kSC_Acknowledge);
+            _resetEvent.schedule(hostTime() + _controller->timing.resetNS);
+            break;
+        default:
+            respond(kSC_Resend);
+            break;
+    }
+}
+
+void SimulatedKeyboard::respond(UInt8 byte)
+{
+    _responses.push_back(byte);
+    if (!_responseEvent.isScheduled())
+        _responseEvent.schedule(hostTime() + _controller->timing.keyboardResponseNS);
+}
+
+void SimulatedKeyboard::responded()
+{
+    //
+    // A response goes out ahead of any key data, unless a fault slips some
+    // in first.
+    //
+    
+    PS2Faults & faults = _controller->faults;
+    
+    _output.insert(_output.begin(), _responses.begin(), _responses.end());
+    _output.insert(_output.begin(), faults.beforeResponse.begin(), faults.beforeResponse.end());
+    faults.beforeResponse.clear();
+    _responses.clear();
+    sendNext();
+}
+
+void SimulatedKeyboard::resetDone()
+{
+    _scanning = true;
+    _output.push_back(kSC_Reset);
+    sendNext();
+}
+
+void SimulatedKeyboard::sendNext()
+{
+    //
+    // Nothing goes out while a command is arriving or being answered.
+    //
+    
+    if (!_powered || _output.empty() || _receiveEvent.isScheduled() || _responseEvent.isScheduled() ||
+        _sendEvent.isScheduled() || !_controller->canTakeKeyboardByte())
+        return;
+    
+    _sendEvent.schedule(hostTime() + _controller->timing.wireByteNS);
+}
+
+void SimulatedKeyboard::sent()
+{
+    UInt8 byte;
+    
+    //
+    // If the controller filled its output buffer meanwhile, we try again
+    // when it is read.
+    //
+    
+    if (!_controller->canTakeKeyboardByte())  return;
+    
+    byte = _output.front();
+    _output.pop_front();
+    _controller->statistics.bytesFromKeyboard++;
+    _controller->keyboardByte(byte);
+    sendNext();
+}
+
+void SimulatedKeyboard::type(UInt8 byte, UInt64 when)
+{
+    std::deque<std::pair<UInt64, UInt8> >::iterator position = _typing.end();
+    
+    while (position != _typing.begin() && (position - 1)->first > when)  position--;
+    _typing.insert(position, std::make_pair(when, byte));
+    _typeEvent.schedule(_typing.front().first);
+}
+
+void SimulatedKeyboard::typed()
+{
+    UInt64 now = hostTime();
+    
+    while (!_typing.empty() && _typing.front().first <= now)
+    {
+        UInt8 byte = _typing.front().second;
+    
+        _typing.pop_front();
+        if (!_powered || !_scanning)
+        {
+            _controller->statistics.keysLost++;
+        }
+        else if (_output.size() >= kPS2KeyboardBufferSize)
+        {
+            _controller->statistics.keysLost++;
+            _output.back() = 0xff;     // overrun (set 1)
+        }
+        else
+        {
+            _output.push_back(byte);
+        }
+    }
+    
+    if (!_typing.empty())  _typeEvent.schedule(_typing.front().first);
+    sendNext();
+}
+
+void SimulatedKeyboard::powerOff()
+{
+    _powered = false;
+    _receiveEvent.cancel();
+    _sendEvent.cancel();
+    _responseEvent.cancel();
+    _resetEvent.cancel();
+    _output.clear();
+    _responses.clear();
+    _scanning = false;
+}
+
+void SimulatedKeyboard::powerOn()
+{
+    //
+    // The controller resets the keyboard, and leaves it disabled, as at probe.
+    //
+    
+    _powered = true;
+    restoreDefaults();
+    _scanning = false;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// The controller.
+//
+
+ApplePS2Controller::ApplePS2Controller()
+    : statistics(),
+      keyboard(this),
+      _stepEvent(this, &ApplePS2Controller::step),
+      _interruptEvent(this, &ApplePS2Controller::deliverInterrupt),
+      _current(0),
+      _index(0),
+      _requestStarted(0),
+      _readDeadline(0),
+      _reading(false),
+      _readCommandByte(false),
+      _resends(0),
+      _lastKeyboardByte(0),
+      _commandByte(kCB_EnableKeyboardIRQ | kCB_SystemFlag | kCB_TranslateMode),
+      _sleepCommandByte(0),
+      _commandByteNext(false),
+      _wakeCommandByteSet(false),
+      _wakeCommandByte(0),
+      _outputFull(false),
+      _output(0),
+      _callbackDepth(0),
+      _interruptTarget(0),
+      _interruptAction(0),
+      _powerTarget(0),
+      _powerAction(0)
+{
+}
+
+ApplePS2Controller::~ApplePS2Controller()
+{
+}
+
+const char * ApplePS2Controller::getClassName() const
+{
+    return "ApplePS2Controller";
+}
+
+void ApplePS2Controller::free()
+{
+    if (_interruptAction)
+    {
+        hostKernelError("interrupt action still installed at free");
+        uninstallInterruptAction();
+    }
+    
+    if (_powerAction)
+    {
+        hostKernelError("power control action still installed at free");
+        uninstallPowerControlAction();
+    }
+    
+    if (!_allocated.empty())
+        hostKernelError("%u request(s) never freed", (unsigned)_allocated.size());
+    for (std::set<PS2Request *>::iterator request = _allocated.begin(); request != _allocated.end(); request++)
+        IOFree(*request, sizeof(PS2Request));
+    _allocated.clear();
+    
+    IOService::free();
+}
+
+void ApplePS2Controller::installInterruptAction(OSObject * target, PS2InterruptAction action)
+{
+    if (_interruptAction)  hostKernelError("interrupt action installed twice");
+    target->retain();
+    if (_interruptTarget)  _interruptTarget->release();
+    _interruptTarget = target;
+    _interruptAction = action;
+    scheduleInterrupt();
+}
+
+void ApplePS2Controller::uninstallInterruptAction()
+{
+    _interruptAction = 0;
+    if (_interruptTarget)  _interruptTarget->release();
+    _interruptTarget = 0;
+}
+
+void ApplePS2Controller::installPowerControlAction(OSObject * target, PS2PowerControlAction action)
+{
+    if (_powerAction)  hostKernelError("power control action installed twice");
+    target->retain();
+    if (_powerTarget)  _powerTarget->release();
+    _powerTarget = target;
+    _powerAction = action;
+}
+
+void ApplePS2Controller::uninstallPowerControlAction()
+{
+    _powerAction = 0;
+    if (_powerTarget)  _powerTarget->release();
+    _powerTarget = 0;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+PS2Request * ApplePS2Controller::allocateRequest()
+{
+    //
+    // The real one may block, so a call from a completion routine or the
+    // interrupt action is counted: the driver says it never makes one.
+    //
+    
+    PS2Request * request;
+    
+    hostWillBlock("allocateRequest");
+    if (_callbackDepth)  statistics.allocationsInCallbacks++;
+    statistics.allocations++;
+    
+    request = (PS2Request *)IOMalloc(sizeof(PS2Request));
+    memset(request, 0, sizeof(PS2Request));
+    _allocated.insert(request);
+    return request;
+}
+
+void ApplePS2Controller::freeRequest(PS2Request * request)
+{
+    if (!_allocated.count(request))
+    {
+        hostKernelError("freeRequest of %p, which isn't allocated", request);
+        return;
+    }
+    
+    if (_inFlight.count(request))
+    {
+        hostKernelError("freeRequest of %p, which is still in flight", request);
+        return;
+    }
+    
+    _allocated.erase(request);
+    statistics.frees++;
+    IOFree(request, sizeof(PS2Request));
+}
+
+bool ApplePS2Controller::submitRequest(PS2Request * request)
+{
+    if (!_allocated.count(request))
+    {
+        hostKernelError("submitRequest of %p, which isn't allocated", request);
+        return false;
+    }
+    
+    if (_inFlight.count(request))
+    {
+        hostKernelError("submitRequest of %p, which is already in flight", request);
+        return false;
+    }
+    
+    if (request->commandsCount > kMaxCommands)
+    {
+        hostKernelError("submitRequest of %p, with %u commands", request, request->commandsCount);
+        return false;
+    }
+    
+    _inFlight.insert(request);
+    _queue.push_back(request);
+    if (!_current && !_stepEvent.isScheduled())  _stepEvent.schedule(hostTime());
+    return true;
+}
+
+void ApplePS2Controller::submitRequestAndBlock(PS2Request * request)
+{
+    //
+    // The caller's thread sleeps while everything else goes on; here, that is
+    // running the events until the request is done.
+    //
+    
+    UInt64 started = hostTime();
+    
+    hostWillBlock("submitRequestAndBlock");
+    if (_callbackDepth)
+        hostKernelError("submitRequestAndBlock from a completion routine or the interrupt action");
+    
+    statistics.requestsBlocking++;
+    _blocking.insert(request);
+    if (!submitRequest(request))
+    {
+        _blocking.erase(request);
+        return;
+    }
+    
+    while (_blocking.count(request))
+    {
+        if (!hostRunNext())
+        {
+            hostKernelError("submitRequestAndBlock of %p never completes", request);
+            break;
+        }
+    }
+    
+    statistics.blockedNS += hostTime() - started;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::step()
+{
+    //
+    // Works through the current request, one command per call for those that
+    // take time, starting the next request once it is done.
+    //
+    
+    UInt64 now = hostTime();
+    
+    if (!_current)
+    {
+        //
+        // A byte on its way to the interrupt action goes first.
+        //
+    
+        if (_queue.empty() || _interruptEvent.isScheduled())  return;
+    
+        _current = _queue.front();
+        _queue.pop_front();
+        _index           = 0;
+        _requestStarted  = now;
+        _reading         = false;
+        _readCommandByte = false;
+        _resends         = 0;
+    }
+    
+    while (_index < _current->commandsCount)
+    {
+        PS2Command * command = &_current->commands[_index];
+        UInt8        byte;
+    
+        switch (command->command)
+        {
+            case kPS2C_WriteCommandPort:
+                writeCommandPort(command->inOrOut);
+                _index++;
+                _stepEvent.schedule(now + timing.commandPortNS);
+                return;
+    
+            case kPS2C_WriteDataPort:
+                if (_commandByteNext)
+                {
+                    _commandByteNext = false;
+                    setCommandByte(command->inOrOut);
+                    _index++;
+                    _stepEvent.schedule(now + timing.commandPortNS);
+                    return;
+                }
+    
+                if (keyboard.receiving())
+                {
+                    _stepEvent.schedule(keyboard.receiveDone());
+                    return;
+                }
+    
+                _lastKeyboardByte = command->inOrOut;
+                keyboard.receive(command->inOrOut);
+                _index++;
+                _stepEvent.schedule(now + timing.commandPortNS);
+                return;
+    
+            case kPS2C_ReadDataPort:
+            case kPS2C_ReadDataPortAndCompare:
+                if (!_outputFull)
+                {
+                    if (!_reading)
+                    {
+                        _reading      = true;
+                        _readDeadline = now + timing.readTimeoutNS;
+                    }
+    
+                    if (now < _readDeadline)
+                    {
+                        _stepEvent.schedule(_readDeadline);
+                        return;
+                    }
+    
+                    statistics.readTimeouts++;
+                    finishRequest(true);
+                    return;
+                }
+    
+                _reading = false;
+                byte     = takeOutput();
+    
+                if (command->command == kPS2C_ReadDataPort)
+                {
+                    command->inOrOut = byte;
+                    _index++;
+                    break;
+                }
+    
+                if (byte == command->inOrOut)
+                {
+                    _index++;
+                    break;
+                }
+    
+                if (byte == kSC_Resend && command->inOrOut != kSC_Resend && _resends < kPS2MaxResends &&
+                    _index && _current->commands[_index - 1].command == kPS2C_WriteDataPort)
+                {
+                    _resends++;
+                    statistics.resends++;
+                    keyboard.receive(_lastKeyboardByte);
+                    _stepEvent.schedule(now + timing.commandPortNS);
+                    return;
+                }
+    
+                finishRequest(true);
+                return;
+    
+            default:
+                hostKernelError("command %d isn't simulated", command->command);
+                finishRequest(true);
+                return;
+        }
+    }
+    
+    finishRequest(false);
+}
+
+void ApplePS2Controller::finishRequest(bool failed)
+{
+    PS2Request * request = _current;
+    UInt64       now     = hostTime();
+    
+    if (failed)
+    {
+        request->commandsCount = _index;
+        statistics.requestsCutShort++;
+    }
+    statistics.requests++;
+    statistics.commands += _index + (failed ? 1 : 0);
+    statistics.busyNS   += now - _requestStarted;
+    
+    _current = 0;
+    _reading = false;
+    _inFlight.erase(request);
+    
+    //
+    // Another driver's change to the command byte, made between a request
+    // that read it and the next.
+    //
+    
+    if (!failed && _readCommandByte && faults.commandByteRaces)
+    {
+        faults.commandByteRaces--;
+        setCommandByte(_commandByte ^ kCB_EnableMouseIRQ);
+    }
+    
+    if (_blocking.erase(request))
+    {
+        // (its caller wakes up)
+    }
+    else if (request->completionAction)
+    {
+        _callbackDepth++;
+        request->completionAction(request->completionTarget, request->completionParam);
+        _callbackDepth--;
+    }
+    else
+    {
+        _allocated.erase(request);
+        statistics.frees++;
+        IOFree(request, sizeof(PS2Request));
+    }
+    
+    scheduleInterrupt();
+    if (!_current && !_queue.empty() && !_stepEvent.isScheduled())  _stepEvent.schedule(now);
+}
+
+void ApplePS2Controller::writeCommandPort(UInt8 byte)
+{
+    switch (byte)
+    {
+        case kCP_GetCommandByte:
+            _readCommandByte = true;
+            _controllerOutput.push_back(_commandByte);
+            fillOutput();
+            break;
+        case kCP_SetCommandByte:
+            _readCommandByte = false;
+            _commandByteNext = true;
+            break;
+        case kCP_DisableKeyboardClock:
+            setCommandByte(_commandByte | kCB_DisableKeyboardClock);
+            break;
+        case kCP_EnableKeyboardClock:
+            setCommandByte(_commandByte & ~kCB_DisableKeyboardClock);
+            break;
+        default:
+            hostKernelError("controller command %02x isn't simulated", byte);
+            break;
+    }
+}
+
+void ApplePS2Controller::setCommandByte(UInt8 commandByte)
+{
+    _commandByte = commandByte;
+    fillOutput();
+    if (!_current)  scheduleInterrupt();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// The output buffer.  The controller's own bytes go in ahead of the
+// keyboard's, which only sends while the buffer is empty.
+//
+
+bool ApplePS2Controller::canTakeKeyboardByte() const
+{
+    return !_outputFull && _controllerOutput.empty() && !(_commandByte & kCB_DisableKeyboardClock);
+}
+
+void ApplePS2Controller::keyboardByte(UInt8 byte)
+{
+    output(byte);
+}
+
+void ApplePS2Controller::output(UInt8 byte)
+{
+    _output     = byte;
+    _outputFull = true;
+    
+    if (!_current)
+        scheduleInterrupt();
+    else if (_reading)
+        _stepEvent.schedule(hostTime());
+}
+
+UInt8 ApplePS2Controller::takeOutput()
+{
+    UInt8 byte = _output;
+    
+    _outputFull = false;
+    fillOutput();
+    return byte;
+}
+
+void ApplePS2Controller::fillOutput()
+{
+    if (_outputFull)  return;
+    
+    if (!_controllerOutput.empty())
+    {
+        UInt8 byte = _controllerOutput.front();
+    
+        _controllerOutput.pop_front();
+        output(byte);
+        return;
+    }
+    
+    keyboard.sendNext();
+}
+
+void ApplePS2Controller::scheduleInterrupt()
+{
+    if (_outputFull && (_commandByte & kCB_EnableKeyboardIRQ) && !_interruptEvent.isScheduled())
+        _interruptEvent.schedule(hostTime() + timing.interruptNS);
+}
+
+void ApplePS2Controller::deliverInterrupt()
+{
+    //
+    // A request that started meanwhile reads the byte instead.
+    //
+    
+    if (!_current && _outputFull && (_commandByte & kCB_EnableKeyboardIRQ))
+    {
+        UInt8 byte = takeOutput();
+    
+        if (_interruptAction)
+        {
+            statistics.interrupts++;
+            _callbackDepth++;
+            _interruptAction(_interruptTarget, byte);
+            _callbackDepth--;
+        }
+        else
+        {
+            statistics.bytesDropped++;
+        }
+    }
+    
+    if (!_current && !_queue.empty() && !_stepEvent.isScheduled())  _stepEvent.schedule(hostTime());
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool ApplePS2Controller::idle() const
+{
+    return !_current && _queue.empty() && !_stepEvent.isScheduled() && !_interruptEvent.isScheduled() &&
+           keyboard.idle();
+}
+
+void ApplePS2Controller::setWakeCommandByte(UInt8 commandByte)
+{
+    _wakeCommandByteSet = true;
+    _wakeCommandByte    = commandByte;
+}
+
+void ApplePS2Controller::sleep()
+{
+    //
+    // The drivers hear first; the controller finishes what they queued before
+    // it powers down.
+    //
+    
+    callPowerAction(kPS2C_DisableDevice);
+    while (!_queue.empty() || _current)
+        if (!hostRunNext())  break;
+    
+    _sleepCommandByte = _commandByte;
+    _interruptEvent.cancel();
+    _controllerOutput.clear();
+    _outputFull = false;
+    keyboard.powerOff();
+}
+
+void ApplePS2Controller::wake()
+{
+    _commandByte        = _wakeCommandByteSet ? _wakeCommandByte : _sleepCommandByte;
+    _wakeCommandByteSet = false;
+    keyboard.powerOn();
+    callPowerAction(kPS2C_EnableDevice);
+}
+
+void ApplePS2Controller::callPowerAction(UInt32 whatToDo)
+{
+    if (_powerAction)  _powerAction(_powerTarget, whatToDo);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// ApplePS2KeyboardDevice, which hands everything to its controller.
+//
+
+OSDefineMetaClassAndStructors(ApplePS2KeyboardDevice, IOService);
+
+bool ApplePS2KeyboardDevice::attach(IOService * provider)
+{
+    if (!IOService::attach(provider))  return false;
+    
+    _controller = OSDynamicCast(ApplePS2Controller, provider);
+    return _controller != 0;
+}
+
+void ApplePS2KeyboardDevice::detach(IOService * provider)
+{
+    _controller = 0;
+    IOService::detach(provider);
+}
+
+void ApplePS2KeyboardDevice::installInterruptAction(OSObject * target, PS2InterruptAction action)
+{
+    _controller->installInterruptAction(target, action);
+}
+
+void ApplePS2KeyboardDevice::uninstallInterruptAction()
+{
+    _controller->uninstallInterruptAction();
+}
+
+PS2Request * ApplePS2KeyboardDevice::allocateRequest()
+{
+    return _controller->allocateRequest();
+}
+
+void ApplePS2KeyboardDevice::freeRequest(PS2Request * request)
+{
+    _controller->freeRequest(request);
+}
+
+bool ApplePS2KeyboardDevice::submitRequest(PS2Request * request)
+{
+    return _controller->submitRequest(request);
+}
+
+void ApplePS2KeyboardDevice::submitRequestAndBlock(PS2Request * request)
+{
+    _controller->submitRequestAndBlock(request);
+}
+
+void ApplePS2KeyboardDevice::installPowerControlAction(OSObject * target, PS2PowerControlAction action)
+{
+    _controller->installPowerControlAction(target, action);
+}
+
+void ApplePS2KeyboardDevice::uninstallPowerControlAction()
+{
+    _controller->uninstallPowerControlAction();
+}
@@ -0,0 +1,238 @@
+#ifndef _PS2SIMULATOR_H
+#define _PS2SIMULATOR_H
+
+#include <deque>
+#include <set>
+#include <vector>
+#include "HostKernel.h"
+#include "ApplePS2KeyboardDevice.h"
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// A simulated 8042 controller with a keyboard on its keyboard port, for
+// running the driver on the host kernel (HostKernel/HostKernel.h).
+//
+// ApplePS2KeyboardDevice is the real interface, implemented on top of the
+// simulated ApplePS2Controller, which works through the requests submitted
+// to it one at a time, in order, as the real one does:
+//
+// o  A write to the command port takes the controller commandPortNS.  It
+//    implements the command byte commands (20, 60) and the keyboard clock
+//    ones (AD, AE); its responses go to the output buffer ahead of anything
+//    from the keyboard.
+// o  A write to the data port goes to the keyboard, the byte taking
+//    wireByteNS on the wire, unless it follows a 60, in which case it is the
+//    new command byte.
+// o  A read takes the next byte from the output buffer, waiting up to
+//    readTimeoutNS for one.  A compare that fails, or a read that times out,
+//    ends the request there: commandsCount becomes the index of the command
+//    that failed.  A resend (FE) read in answer to a byte sent to the
+//    keyboard makes the controller send the byte again, up to kPS2MaxResends
+//    times.
+// o  A finished request goes to its completion routine or, if it has none,
+//    is freed.  A blocking request just wakes its caller.
+// o  Between requests, a byte in the output buffer goes to the interrupt
+//    action, if the keyboard IRQ is enabled in the command byte; during a
+//    request, it waits for the request's reads.
+//
+// The keyboard acknowledges commands keyboardResponseNS after they arrive,
+// answers echo and identify, resets with an AA after resetNS, and sends key
+// bytes, already translated to set 1, only while enabled.  It only sends
+// while the output buffer is empty and its clock enabled.  A command
+// interrupts a key byte on the wire, and the response goes out ahead of
+// queued key data; but a key byte that reached the output buffer first is
+// read by the request, which is how key data ends up interleaved with
+// responses.
+//
+// Faults can be injected: resends, lost commands, a keyboard that doesn't
+// answer at all, key bytes slipped in ahead of a response, another driver
+// changing the command byte between a read of it and the next request, and
+// a different command byte after wake.
+//
+
+#define kPS2MaxResends          3
+#define kPS2KeyboardBufferSize  16
+
+struct PS2Timing
+{
+    PS2Timing() : commandPortNS(20000), wireByteNS(1000000), keyboardResponseNS(250000),
+                  readTimeoutNS(20000000), interruptNS(10000), resetNS(500000000) {}
+
+    UInt64 commandPortNS;       // a controller command, or a command byte write
+    UInt64 wireByteNS;          // a byte between controller and keyboard, either way
+    UInt64 keyboardResponseNS;  // a command's arrival to its response being queued
+    UInt64 readTimeoutNS;       // the longest a read waits for a byte
+    UInt64 interruptNS;         // a byte's arrival to the interrupt action
+    UInt64 resetNS;             // the keyboard's self test after a reset
+};
+
+struct PS2Statistics
+{
+    UInt32 requests;                // completed, blocking ones included
+    UInt32 requestsBlocking;
+    UInt32 requestsCutShort;        // commandsCount truncated
+    UInt32 commands;                // executed, the failed one included
+    UInt32 bytesToKeyboard;         // resends included
+    UInt32 bytesFromKeyboard;
+    UInt32 resends;
+    UInt32 readTimeouts;
+    UInt32 interrupts;              // bytes delivered to the interrupt action
+    UInt32 bytesDropped;            // with no interrupt action installed
+    UInt32 keysLost;                // typed while the keyboard was disabled, or overrun
+    UInt32 allocations;             // allocateRequest
+    UInt32 allocationsInCallbacks;  // ... from a completion routine or the interrupt action
+    UInt32 frees;                   // freeRequest, and fire-and-forget requests
+    UInt64 busyNS;                  // the controller working on requests
+    UInt64 blockedNS;               // callers in submitRequestAndBlock
+};
+
+struct PS2Faults
+{
+    PS2Faults() : absent(false), resends(0), lostCommands(0), commandByteRaces(0) {}
+
+    bool               absent;              // the keyboard never answers
+    UInt32             resends;             // answer the next bytes with FE
+    UInt32             lostCommands;        // ignore the next bytes
+    UInt32             commandByteRaces;    // requests that read the command byte, and don't set it
+    std::vector<UInt8> beforeResponse;      // slipped in ahead of the next response
+};
+
+class ApplePS2Controller;
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+class SimulatedKeyboard
+{
+public:
+    SimulatedKeyboard(ApplePS2Controller * controller);
+
+    void   receive(UInt8 byte);                // a byte from the controller starts down the wire
+    bool   receiving() const               { return _receiveEvent.isScheduled(); }
+    UInt64 receiveDone() const             { return _receiveEvent.deadline(); }
+    void   sendNext();                         // sends a queued byte, if the controller can take one
+    bool   idle() const;
+
+    void   type(UInt8 byte, UInt64 when);      // a key byte, set 1
+    void   powerOff();
+    void   powerOn();
+
+    bool   scanning() const                { return _scanning; }
+    UInt8  leds() const                    { return _leds; }
+    UInt8  typematic() const               { return _typematic; }
+
+private:
+    void   received();
+    void   sent();
+    void   respond(UInt8 byte);
+    void   responded();
+    void   resetDone();
+    void   typed();
+    void   restoreDefaults();
+
+    ApplePS2Controller *                       _controller;
+    HostCall<SimulatedKeyboard>                _receiveEvent;
+    HostCall<SimulatedKeyboard>                _sendEvent;
+    HostCall<SimulatedKeyboard>                _responseEvent;
+    HostCall<SimulatedKeyboard>                _resetEvent;
+    HostCall<SimulatedKeyboard>                _typeEvent;
+    UInt8                                      _receiving;
+    std::deque<UInt8>                          _output;
+    std::vector<UInt8>                         _responses;
+    std::deque<std::pair<UInt64, UInt8> >      _typing;
+    UInt8                                      _argumentFor;
+    UInt8                                      _leds;
+    UInt8                                      _typematic;
+    bool                                       _scanning;
+    bool                                       _powered;
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+class ApplePS2Controller : public IOService
+{
+    OSDeclareDefaultStructors(ApplePS2Controller);
+
+public:
+    virtual void free();
+
+    //
+    // The ApplePS2KeyboardDevice interface.
+    //
+
+    void         installInterruptAction(OSObject * target, PS2InterruptAction action);
+    void         uninstallInterruptAction();
+    PS2Request * allocateRequest();
+    void         freeRequest(PS2Request * request);
+    bool         submitRequest(PS2Request * request);
+    void         submitRequestAndBlock(PS2Request * request);
+    void         installPowerControlAction(OSObject * target, PS2PowerControlAction action);
+    void         uninstallPowerControlAction();
+
+    //
+    // For the keyboard.
+    //
+
+    bool         canTakeKeyboardByte() const;
+    void         keyboardByte(UInt8 byte);
+
+    //
+    // For the tests: the power transitions, as the controller makes them for
+    // system sleep and wake, or just the call to the power control action;
+    // whether it has anything left to do; and the state of the hardware.
+    // wake() restores the command byte from before sleep, unless
+    // setWakeCommandByte gave it another.
+    //
+
+    void         sleep();
+    void         wake();
+    void         callPowerAction(UInt32 whatToDo);
+    void         setWakeCommandByte(UInt8 commandByte);
+    bool         idle() const;
+    UInt32       requestsOutstanding() const  { return _allocated.size(); }
+    UInt8        commandByte() const          { return _commandByte; }
+    void         setCommandByte(UInt8 commandByte);
+
+    PS2Timing         timing;
+    PS2Statistics     statistics;
+    PS2Faults         faults;
+    SimulatedKeyboard keyboard;
+
+private:
+    void         step();
+    void         finishRequest(bool failed);
+    void         writeCommandPort(UInt8 byte);
+    void         output(UInt8 byte);
+    UInt8        takeOutput();
+    void         fillOutput();
+    void         scheduleInterrupt();
+    void         deliverInterrupt();
+
+    HostCall<ApplePS2Controller> _stepEvent;
+    HostCall<ApplePS2Controller> _interruptEvent;
+    std::deque<PS2Request *>     _queue;
+    std::set<PS2Request *>       _allocated;
+    std::set<PS2Request *>       _inFlight;
+    std::set<PS2Request *>       _blocking;
+    PS2Request *                 _current;
+    UInt32                       _index;
+    UInt64                       _requestStarted;
+    UInt64                       _readDeadline;
+    bool                         _reading;
+    bool                         _readCommandByte;
+    UInt32                       _resends;
+    UInt8                        _lastKeyboardByte;
+    UInt8                        _commandByte;
+    UInt8                        _sleepCommandByte;
+    bool                         _commandByteNext;
+    bool                         _wakeCommandByteSet;
+    UInt8                        _wakeCommandByte;
+    std::deque<UInt8>            _controllerOutput;
+    bool                         _outputFull;
+    UInt8                        _output;
+    UInt32                       _callbackDepth;
+    OSObject *                   _interruptTarget;
+    PS2InterruptAction           _interruptAction;
+    OSObject *                   _powerTarget;
+    PS2PowerControlAction        _powerAction;
+};
+
+#endif /* !_PS2SIMULATOR_H */
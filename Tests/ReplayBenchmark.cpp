@@ -0,0 +1,319 @@
+//
+// Replays scan code streams through the decode and remap path -- the key
+// translator and the default translation tables -- into a stub
+// dispatchKeyboardEvent, and reports the cost per byte, the event rate, and
+// the distribution of the time from the first byte of a key's sequence to
+// its event being dispatched.
+//
+// Then, for each synthetic stream, compares decoding a byte at a time with
+// the batch decoder: the decoder on its own, over the whole stream, and with
+// translation, in buffers the size of the work loop's batches.
+//
+// Traces saved from the "Scan code trace" property can be replayed too:
+//
+//   ReplayBenchmark [trace ...]
+//
+
+#include <algorithm>
+#include "ScancodeStreams.h"
+#include "TestSupport.h"
+
+#define kStreamBytes            (1 << 20)
+#define kMinimumNanoseconds     200000000ULL
+#define kBatchBytes             32      // kScancodeBatchSize, as the work loop takes them
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Stands in for IOHIKeyboard::dispatchKeyboardEvent, and for the part of
+// dispatchTranslatedKey that expands macros.
+//
+
+class ReplaySink
+{
+public:
+    ReplaySink(const StreamConfig * config) : events(0), checksum(0), _config(config) {}
+    
+    void dispatchKeyboardEvent(unsigned int keyCode, bool goingDown, UInt64 time)
+    {
+        events++;
+        checksum = checksum * 31 + (keyCode << 1 | goingDown) + time;
+    }
+    
+    void dispatchTranslatedKey(KeyTranslation translation, bool goingDown, UInt64 time)
+    {
+        if (translation & kKeyTranslateMacro)
+        {
+            UInt32         count;
+            const UInt16 * step = _config->macros.sequence(KEY_TRANSLATE_ADB(translation), goingDown, &count);
+            
+            for (; step && count; count--, step++)
+                dispatchKeyboardEvent(*step & ~kMacroStepUp, !(*step & kMacroStepUp), time);
+            return;
+        }
+        dispatchKeyboardEvent(KEY_TRANSLATE_ADB(translation), goingDown, time);
+    }
+    
+    UInt64 events;
+    UInt64 checksum;
+    
+private:
+    const StreamConfig * _config;
+};
+
+static inline void replayByte(KeyTranslator * translator, ReplaySink * sink, UInt8 byte, UInt64 time)
+{
+    KeyEvent event;
+    
+    if (translator->translate(byte, time, &event) == kKeyEventKey)
+        sink->dispatchTranslatedKey(event.translation, event.goingDown, time);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static UInt64 clockOverhead()
+{
+    std::vector<UInt64> samples;
+    
+    for (int index = 0; index < 10001; index++)
+    {
+        UInt64 start = hostNanoseconds();
+        samples.push_back(hostNanoseconds() - start);
+    }
+    std::sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+}
+
+static UInt64 percentile(const std::vector<UInt64> & sorted, double fraction)
+{
+    if (sorted.empty())  return 0;
+    return sorted[(size_t)(fraction * (sorted.size() - 1))];
+}
+
+static void replay(const ScancodeStream & stream, const StreamConfig & config, bool synthetic)
+{
+    KeyTranslator       translator;
+    ReplaySink          sink(&config);
+    const UInt8 *       bytes = &stream.bytes[0];
+    const UInt64 *      times = &stream.times[0];
+    size_t              count = stream.bytes.size();
+    UInt64              iterations = 0;
+    UInt64              elapsed    = 0;
+    UInt64              events     = 0;
+    std::vector<UInt64> latencies;
+    
+    //
+    // Throughput: the whole stream, as many times as fit in the minimum time.
+    //
+    
+    while (elapsed < kMinimumNanoseconds || iterations < 3)
+    {
+        UInt64 start;
+        
+        translator.reset();
+        translator.setTables(config.tables, 2, 0);
+        sink.events = 0;
+        
+        start = hostNanoseconds();
+        for (size_t index = 0; index < count; index++)
+            replayByte(&translator, &sink, bytes[index], times[index]);
+        elapsed += hostNanoseconds() - start;
+        
+        events = sink.events;
+        iterations++;
+    }
+    
+    //
+    // Every key of a synthetic stream is released by its end.
+    //
+    
+    for (UInt32 keyCode = 0; synthetic && keyCode < KBV_NUM_KEYCODES; keyCode++)
+        CHECK(!translator.isKeyDown(keyCode));
+    
+    //
+    // Latency: once more, reading the clock at the first byte of each
+    // sequence and at each event.
+    //
+    
+    translator.reset();
+    translator.setTables(config.tables, 2, 0);
+    latencies.reserve(events);
+    
+    UInt64 sequenceStart = 0;
+    for (size_t index = 0; index < count; index++)
+    {
+        UInt64 before = sink.events;
+        
+        if (translator.sequenceIdle())  sequenceStart = hostNanoseconds();
+        replayByte(&translator, &sink, bytes[index], times[index]);
+        if (sink.events != before)  latencies.push_back(hostNanoseconds() - sequenceStart);
+    }
+    std::sort(latencies.begin(), latencies.end());
+    
+    printf("%-20s %9lu %9llu %8.2f %9.2f %6llu %6llu %6llu %6llu %8llu\n",
+           stream.name, (unsigned long)count, (unsigned long long)events,
+           (double)elapsed / (iterations * count),
+           events * iterations * 1000.0 / elapsed,
+           (unsigned long long)percentile(latencies, 0.5),
+           (unsigned long long)percentile(latencies, 0.9),
+           (unsigned long long)percentile(latencies, 0.99),
+           (unsigned long long)percentile(latencies, 0.999),
+           (unsigned long long)(latencies.empty() ? 0 : latencies.back()));
+    CHECK(events > 0);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// A byte at a time against the batch decoder.  Each pass leaves what it
+// decoded, or the checksum of what it dispatched, in the run, so that the
+// passes can be checked against each other.
+//
+
+struct DecodeRun
+{
+    const ScancodeStream *          stream;
+    const StreamConfig *            config;
+    std::vector<ScancodeTransition> transitions;
+    UInt64                          checksum;
+};
+
+typedef void (*DecodePass)(DecodeRun * run);
+
+static void decodeBytes(DecodeRun * run)
+{
+    const UInt8 * bytes = &run->stream->bytes[0];
+    UInt16        row   = kDecodeRowIdle;
+    
+    for (size_t index = 0; index < run->transitions.size(); index++)
+        run->transitions[index] = decodeScancode(&row, bytes[index]);
+}
+
+static void decodeBuffer(DecodeRun * run)
+{
+    UInt16 row = kDecodeRowIdle;
+    
+    decodeScancodes(&row, &run->stream->bytes[0], run->transitions.size(), &run->transitions[0]);
+}
+
+static void translateBytes(DecodeRun * run)
+{
+    KeyTranslator translator;
+    ReplaySink    sink(run->config);
+    
+    translator.reset();
+    translator.setTables(run->config->tables, 2, 0);
+    for (size_t index = 0; index < run->stream->bytes.size(); index++)
+        replayByte(&translator, &sink, run->stream->bytes[index], run->stream->times[index]);
+    run->checksum = sink.checksum;
+}
+
+static void translateBatches(DecodeRun * run)
+{
+    //
+    // The stream's tables have no debounce windows.
+    //
+    
+    KeyTranslator      translator;
+    ReplaySink         sink(run->config);
+    ScancodeTransition transitions[kBatchBytes];
+    KeyEvent           event;
+    size_t             count = run->stream->bytes.size();
+    
+    translator.reset();
+    translator.setTables(run->config->tables, 2, 0);
+    for (size_t start = 0; start < count; start += kBatchBytes)
+    {
+        UInt32 length = count - start < kBatchBytes ? count - start : kBatchBytes;
+        
+        translator.decode(&run->stream->bytes[start], length, transitions);
+        for (UInt32 index = 0; index < length; index++)
+        {
+            UInt64 time = run->stream->times[start + index];
+            
+            if (translator.translateTransition<false>(transitions[index], time, &event) == kKeyEventKey)
+                sink.dispatchTranslatedKey(event.translation, event.goingDown, time);
+        }
+    }
+    run->checksum = sink.checksum;
+}
+
+static double nsPerByte(DecodePass pass, DecodeRun * run)
+{
+    UInt64 iterations = 0;
+    UInt64 elapsed    = 0;
+    
+    while (elapsed < kMinimumNanoseconds || iterations < 3)
+    {
+        UInt64 start = hostNanoseconds();
+        
+        pass(run);
+        elapsed += hostNanoseconds() - start;
+        iterations++;
+    }
+    return (double)elapsed / (iterations * run->stream->bytes.size());
+}
+
+static void compareDecoding(const ScancodeStream & stream, const StreamConfig & config)
+{
+    DecodeRun run;
+    double    bytesNS;
+    double    bufferNS;
+    double    translateNS;
+    double    batchesNS;
+    
+    run.stream   = &stream;
+    run.config   = &config;
+    run.checksum = 0;
+    run.transitions.resize(stream.bytes.size());
+    
+    bytesNS = nsPerByte(decodeBytes, &run);
+    std::vector<ScancodeTransition> expected(run.transitions);
+    bufferNS = nsPerByte(decodeBuffer, &run);
+    CHECK(run.transitions == expected);
+    
+    translateNS = nsPerByte(translateBytes, &run);
+    UInt64 checksum = run.checksum;
+    batchesNS = nsPerByte(translateBatches, &run);
+    CHECK_EQUAL(run.checksum, checksum);
+    
+    printf("%-20s %9.2f %9.2f %9.2f %9.2f\n", stream.name, bytesNS, bufferNS, translateNS, batchesNS);
+}
+
+int main(int argc, char ** argv)
+{
+    StreamConfig   config;
+    ScancodeStream streams[5];
+    
+    streamTyping(&streams[0], kStreamBytes);
+    streamExtended(&streams[1], kStreamBytes);
+    streamPausePrintScreen(&streams[2], kStreamBytes);
+    streamRemaps(&streams[3], kStreamBytes);
+    streamScanner(&streams[4], kStreamBytes);
+    
+    printf("%-20s %9s %9s %8s %9s %6s %6s %6s %6s %8s\n", "stream", "bytes", "events",
+           "ns/byte", "Mevents/s", "p50", "p90", "p99", "p99.9", "max");
+    printf("%-20s %9s %9s %8s %9s %6s %6s %6s %6s %8s\n", "", "", "",
+           "", "", "ns", "ns", "ns", "ns", "ns");
+    
+    for (UInt32 index = 0; index < STREAM_COUNT(streams); index++)
+        replay(streams[index], config, true);
+    
+    for (int arg = 1; arg < argc; arg++)
+    {
+        ScancodeStream recorded;
+        
+        if (!streamFromTrace(&recorded, argv[arg]) || recorded.bytes.empty())
+        {
+            fprintf(stderr, "%s: not a scan code trace\n", argv[arg]);
+            testFailures++;
+            continue;
+        }
+        replay(recorded, config, false);
+    }
+    
+    printf("(latencies include a clock read, about %llu ns)\n",
+           (unsigned long long)clockOverhead());
+    
+    printf("\n%-20s %19s %19s\n", "", "decode (ns/byte)", "and translate");
+    printf("%-20s %9s %9s %9s %9s\n", "stream", "per byte", "batch", "per byte", "batch");
+    for (UInt32 index = 0; index < STREAM_COUNT(streams); index++)
+        compareDecoding(streams[index], config);
+    return testResult("ReplayBenchmark");
+}
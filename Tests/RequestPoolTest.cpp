@@ -0,0 +1,143 @@
+//
+// Checks that the driver's asynchronous commands come from the request pool
+// it fills at start: on the simulated controller, which counts every
+// allocateRequest, LED updates, typing, keyboard reset recovery, failed
+// commands and power changes allocate nothing, and nothing is ever
+// allocated from a completion routine or the interrupt action.  With the
+// pool empty, commands are deferred until a request comes back.
+//
+
+#include "DriverHarness.h"
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static void testStartFillsPool()
+{
+    DriverHarness harness;
+    
+    CHECK(harness.start());
+    CHECK_EQUAL(harness.controller->statistics.allocations, kRequestPoolSize);
+    CHECK(harness.runUntilIdle());
+    CHECK(harness.running());
+    CHECK_EQUAL(harness.controller->statistics.allocations, kRequestPoolSize);
+    CHECK_EQUAL(harness.controller->statistics.allocationsInCallbacks, 0);
+}
+
+static void testAsyncPathsDontAllocate()
+{
+    DriverHarness harness;
+    UInt32        allocations;
+    
+    harness.keyboard->setProperty("Suppress typematic repeat", true);
+    CHECK(harness.start());
+    harness.runUntilIdle();
+    allocations = harness.controller->statistics.allocations;
+    
+    //
+    // Lock changes, alone and in bursts.
+    //
+    
+    harness.keyboard->setAlphaLock(true);
+    harness.runUntilIdle();
+    for (int index = 0; index < 64; index++)
+    {
+        harness.keyboard->setAlphaLock(index & 1);
+        harness.keyboard->setNumLock(index & 2);
+    }
+    harness.runUntilIdle();
+    CHECK_EQUAL(harness.controller->keyboard.leds(), 0x06);
+    
+    //
+    // Typing, with lock changes in between.
+    //
+    
+    for (int key = 0; key < 50; key++)
+    {
+        harness.controller->keyboard.type(0x1e, hostTime() + key * 10000000ULL);
+        harness.controller->keyboard.type(0x9e, hostTime() + key * 10000000ULL + 5000000);
+    }
+    for (int toggle = 0; toggle < 10; toggle++)
+    {
+        hostRunUntil(hostTime() + 47000000);
+        harness.keyboard->setNumLock(toggle & 1);
+    }
+    harness.runUntilIdle();
+    CHECK_EQUAL(harness.keyboard->hostKeyDowns, 50);
+    
+    //
+    // An overrun and the keyboard resetting, after which the driver restores
+    // its LEDs and typematic rate.
+    //
+    
+    harness.controller->keyboard.type(0xff, hostTime() + 1000000);
+    harness.controller->keyboard.type(kSC_Reset, hostTime() + 2000000);
+    harness.runUntilIdle();
+    CHECK_EQUAL(harness.statistic("Anomalies", "Keyboard resets"), 1);
+    CHECK_EQUAL(harness.controller->keyboard.typematic(), kTypematicSlowest);
+    
+    //
+    // An LED update the keyboard never acknowledges.
+    //
+    
+    harness.controller->faults.resends = kPS2MaxResends + 1;
+    harness.keyboard->setAlphaLock(false);
+    harness.runUntilIdle();
+    CHECK_EQUAL(harness.statistic("Anomalies", "Commands cut short"), 1);
+    
+    //
+    // The keyboard disabled on sleep.
+    //
+    
+    harness.controller->callPowerAction(kPS2C_DisableDevice);
+    harness.runUntilIdle();
+    CHECK(!harness.controller->keyboard.scanning());
+    
+    CHECK_EQUAL(harness.controller->statistics.allocations, allocations);
+    CHECK_EQUAL(harness.controller->statistics.allocationsInCallbacks, 0);
+    CHECK_EQUAL(harness.controller->statistics.requestsBlocking, 0);
+    CHECK_EQUAL(harness.statistic("LED updates", "Request pool misses"), 0);
+}
+
+static void testPoolExhausted()
+{
+    //
+    // With the keyboard not answering, each request holds its pool entry for
+    // a read timeout; one more command than the pool holds is deferred, and
+    // goes out when a request comes back.
+    //
+    
+    DriverHarness harness;
+    UInt32        allocations;
+    UInt32        requests;
+    
+    CHECK(harness.start());
+    harness.runUntilIdle();
+    allocations = harness.controller->statistics.allocations;
+    requests    = harness.controller->statistics.requests;
+    
+    harness.controller->faults.absent = true;
+    harness.keyboard->setAlphaLock(true);
+    for (int index = 0; index < kRequestPoolSize; index++)
+        harness.controller->callPowerAction(kPS2C_DisableDevice);
+    CHECK_EQUAL(harness.statistic("LED updates", "Request pool misses"), 1);
+    
+    harness.controller->faults.absent = false;
+    harness.runUntilIdle();
+    CHECK_EQUAL(harness.controller->statistics.requests - requests, kRequestPoolSize + 1);
+    CHECK(!harness.controller->keyboard.scanning());
+    CHECK_EQUAL(harness.controller->statistics.allocations, allocations);
+    CHECK_EQUAL(harness.controller->statistics.allocationsInCallbacks, 0);
+    
+    harness.terminate();
+    CHECK(!hostLogged("request still outstanding at stop"));
+}
+
+int main()
+{
+    testStartFillsPool();
+    testAsyncPathsDontAllocate();
+    testPoolExhausted();
+    
+    CHECK_EQUAL(hostKernelStatistics.errors, 0);
+    return testResult("RequestPoolTest");
+}
@@ -0,0 +1,139 @@
+//
+// Stress tests the scan code ring and capture, with a producer and a
+// consumer on their own threads as the interrupt action and the work loop
+// would be: nothing may be lost, duplicated or reordered, and every entry
+// must arrive with its own time.
+//
+
+#include <pthread.h>
+#include <sched.h>
+#include "GenericPS2ScancodeRing.h"
+#include "TestSupport.h"
+
+#define kEntries        2000000ULL
+#define kBatch          32
+
+static ScancodeRing<256>     ring;
+static ScancodeCapture<1024> capture;
+static volatile bool         producing;
+
+static void * produce(void *)
+{
+    for (UInt64 time = 0; time < kEntries; time++)
+    {
+        while (!ring.push((UInt8)(time * 7), time))
+            sched_yield();  // full; let the consumer catch up
+        capture.record((UInt8)(time * 7), time);
+        if (time % 97 == 0)  sched_yield();     // interleave, even on one CPU
+    }
+    producing = false;
+    return 0;
+}
+
+static void testRing()
+{
+    pthread_t         producer;
+    ScancodeRingEntry batch[kBatch];
+    UInt64            expected = 0;
+    UInt64            batches  = 0;
+    UInt64            errors   = 0;
+    
+    ring.reset();
+    capture.reset();
+    producing = true;
+    pthread_create(&producer, 0, produce, 0);
+    
+    while (expected < kEntries)
+    {
+        UInt32 max   = 1 + batches % kBatch;
+        UInt32 count = ring.pop(batch, max);
+        
+        CHECK(count <= max);
+        for (UInt32 index = 0; index < count; index++, expected++)
+        {
+            if (batch[index].time != expected || batch[index].scanCode != (UInt8)(expected * 7))
+            {
+                if (errors++ < 10)
+                    fprintf(stderr, "entry %llu: got time %llu code %02x\n",
+                            (unsigned long long)expected, (unsigned long long)batch[index].time,
+                            batch[index].scanCode);
+                expected = batch[index].time;
+            }
+        }
+        if (count)
+            batches++;
+        else
+            sched_yield();
+    }
+    
+    pthread_join(producer, 0);
+    CHECK_EQUAL(errors, 0);
+    CHECK_EQUAL(ring.count(), 0);
+    CHECK_EQUAL(ring.pop(batch, kBatch), 0);
+    printf("ring: %llu entries in %llu batches\n",
+           (unsigned long long)kEntries, (unsigned long long)batches);
+}
+
+static void * produceCaptureOnly(void *)
+{
+    for (UInt64 time = 0; time < kEntries; time++)
+        capture.record((UInt8)(time * 7), time);
+    producing = false;
+    return 0;
+}
+
+static void testCapture()
+{
+    //
+    // Snapshots taken while the writer runs flat out must be runs of
+    // consecutive entries, each with its own scan code.
+    //
+    
+    static ScancodeRingEntry snapshot[1024];
+    pthread_t                producer;
+    UInt64                   snapshots = 0;
+    UInt64                   errors    = 0;
+    
+    capture.reset();
+    producing = true;
+    pthread_create(&producer, 0, produceCaptureOnly, 0);
+    
+    while (producing)
+    {
+        UInt32 count = capture.snapshot(snapshot);
+        
+        CHECK(count <= 1024);
+        for (UInt32 index = 0; index < count; index++)
+        {
+            if (snapshot[index].scanCode != (UInt8)(snapshot[index].time * 7) ||
+                (index && snapshot[index].time != snapshot[index - 1].time + 1))
+            {
+                if (errors++ < 10)
+                    fprintf(stderr, "snapshot entry %u: time %llu code %02x\n", index,
+                            (unsigned long long)snapshot[index].time, snapshot[index].scanCode);
+                break;
+            }
+        }
+        snapshots++;
+        sched_yield();
+    }
+    
+    pthread_join(producer, 0);
+    CHECK_EQUAL(errors, 0);
+    
+    //
+    // Even at rest, the oldest slot is the one the writer would store into
+    // next, so a full capture gives up that entry.
+    //
+    
+    CHECK_EQUAL(capture.snapshot(snapshot), 1023);
+    CHECK_EQUAL(snapshot[1022].time, kEntries - 1);
+    printf("capture: %llu snapshots while writing\n", (unsigned long long)snapshots);
+}
+
+int main()
+{
+    testRing();
+    testCapture();
+    return testResult("ScancodeRingTest");
+}
@@ -0,0 +1,312 @@
+#ifndef _SCANCODESTREAMS_H
+#define _SCANCODESTREAMS_H
+
+#include <stdio.h>
+#include <vector>
+#include "GenericPS2KeyTranslator.h"
+#include "GenericPS2ScancodeTrace.h"
+#include "ApplePS2ToADBMap.h"
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Scan code streams for the benchmarks.
+//
+// A stream is the raw bytes from the keyboard with their arrival times, in
+// nanoseconds.  The synthetic streams are generated from a fixed seed, so
+// every run replays the same bytes; recorded ones are read from traces in
+// the GenericPS2ScancodeTrace.h format.
+//
+
+struct ScancodeStream
+{
+    const char *        name;
+    std::vector<UInt8>  bytes;
+    std::vector<UInt64> times;
+
+    void add(UInt8 byte, UInt64 time)
+    {
+        bytes.push_back(byte);
+        times.push_back(time);
+    }
+};
+
+class StreamRandom
+{
+public:
+    StreamRandom() : _seed(20240601) {}
+
+    UInt32 next(UInt32 limit)
+    {
+        _seed = _seed * 1103515245 + 12345;
+        return (_seed >> 8) % limit;
+    }
+
+private:
+    UInt32 _seed;
+};
+
+//
+// Appends keys to a stream, with gap nanoseconds between bytes.
+//
+
+class StreamBuilder
+{
+public:
+    StreamBuilder(ScancodeStream * stream, UInt64 gap) : _stream(stream), _time(1000000000ULL), _gap(gap) {}
+
+    void byte(UInt8 byte)
+    {
+        _time += _gap;
+        _stream->add(byte, _time);
+    }
+
+    void make(UInt8 scanCode)           { byte(scanCode); }
+    void release(UInt8 scanCode)        { byte(scanCode | kSC_UpBit); }
+    void makeExtended(UInt8 scanCode)   { byte(kSC_Extend); byte(scanCode); }
+    void releaseExtended(UInt8 scanCode) { byte(kSC_Extend); byte(scanCode | kSC_UpBit); }
+
+    void idle(UInt64 nanoseconds)       { _time += nanoseconds; }
+
+    void tap(UInt8 scanCode)            { make(scanCode); release(scanCode); }
+    void tapExtended(UInt8 scanCode)    { makeExtended(scanCode); releaseExtended(scanCode); }
+
+private:
+    ScancodeStream * _stream;
+    UInt64           _time;
+    UInt64           _gap;
+};
+
+static const UInt8 kStreamLetters[] =
+{
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19,     // q-p
+    0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26,           // a-l
+    0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32,                       // z-m
+    0x39, 0x39, 0x39                                                // space
+};
+
+#define STREAM_COUNT(a)  (sizeof(a) / sizeof((a)[0]))
+
+//
+// Plain typing: letters and spaces, some shifted, some held long enough to
+// repeat.
+//
+
+static inline void streamTyping(ScancodeStream * stream, UInt32 bytes)
+{
+    StreamBuilder builder(stream, 1000000);
+    StreamRandom  random;
+
+    stream->name = "typing";
+    while (stream->bytes.size() < bytes)
+    {
+        UInt8 key   = kStreamLetters[random.next(STREAM_COUNT(kStreamLetters))];
+        bool  shift = random.next(8) == 0;
+
+        if (shift)  builder.make(0x2a);
+        builder.make(key);
+        if (random.next(32) == 0)
+            for (UInt32 repeat = random.next(8); repeat; repeat--)  builder.make(key);
+        builder.release(key);
+        if (shift)  builder.release(0x2a);
+    }
+}
+
+//
+// Heavy E0 traffic: the gray navigation keys, right control and alt, and
+// the same keys wrapped in the fake shifts keyboards send with num lock on.
+//
+
+static inline void streamExtended(ScancodeStream * stream, UInt32 bytes)
+{
+    static const UInt8 navigation[] = { 0x48, 0x50, 0x4b, 0x4d, 0x47, 0x4f, 0x49, 0x51, 0x52, 0x53 };
+    StreamBuilder      builder(stream, 1000000);
+    StreamRandom       random;
+
+    stream->name = "extended";
+    while (stream->bytes.size() < bytes)
+    {
+        UInt8 key = navigation[random.next(STREAM_COUNT(navigation))];
+
+        switch (random.next(4))
+        {
+            case 0:     // num lock on: E0 2A E0 xx E0 (xx|80) E0 AA
+                builder.makeExtended(0x2a);
+                builder.tapExtended(key);
+                builder.releaseExtended(0x2a);
+                break;
+            case 1:     // right control or alt chord
+                builder.makeExtended(random.next(2) ? 0x1d : 0x38);
+                builder.tapExtended(key);
+                builder.releaseExtended(0x1d);
+                builder.releaseExtended(0x38);
+                break;
+            default:
+                builder.tapExtended(key);
+                break;
+        }
+    }
+}
+
+//
+// Pause and PrintScreen, the longest sequences, between some typing.
+//
+
+static inline void streamPausePrintScreen(ScancodeStream * stream, UInt32 bytes)
+{
+    static const UInt8 pause[]       = { 0xE1, 0x1D, 0x45, 0xE1, 0x9D, 0xC5 };
+    static const UInt8 printScreen[] = { 0xE0, 0x2A, 0xE0, 0x37, 0xE0, 0xB7, 0xE0, 0xAA };
+    StreamBuilder      builder(stream, 1000000);
+    StreamRandom       random;
+
+    stream->name = "pause/printscreen";
+    while (stream->bytes.size() < bytes)
+    {
+        switch (random.next(3))
+        {
+            case 0:
+                for (UInt32 index = 0; index < STREAM_COUNT(pause); index++)  builder.byte(pause[index]);
+                break;
+            case 1:
+                for (UInt32 index = 0; index < STREAM_COUNT(printScreen); index++)  builder.byte(printScreen[index]);
+                break;
+            default:
+                builder.tap(kStreamLetters[random.next(STREAM_COUNT(kStreamLetters))]);
+                break;
+        }
+    }
+}
+
+//
+// The remapped keys: caps lock, the function keys (media keys by default,
+// including F3's macro) and the same keys with Insert held as fn.
+//
+
+static inline void streamRemaps(ScancodeStream * stream, UInt32 bytes)
+{
+    static const UInt8 functionKeys[] = { 0x3b, 0x3c, 0x3d, 0x3e, 0x3f, 0x40, 0x41, 0x42, 0x43, 0x44, 0x57, 0x58 };
+    StreamBuilder      builder(stream, 1000000);
+    StreamRandom       random;
+
+    stream->name = "capslock/fn remaps";
+    while (stream->bytes.size() < bytes)
+    {
+        switch (random.next(4))
+        {
+            case 0:
+                builder.make(0x3a);
+                builder.tap(kStreamLetters[random.next(STREAM_COUNT(kStreamLetters))]);
+                builder.release(0x3a);
+                break;
+            case 1:
+                builder.makeExtended(0x52);
+                builder.tap(functionKeys[random.next(STREAM_COUNT(functionKeys))]);
+                builder.tap(functionKeys[random.next(STREAM_COUNT(functionKeys))]);
+                builder.releaseExtended(0x52);
+                break;
+            default:
+                builder.tap(functionKeys[random.next(STREAM_COUNT(functionKeys))]);
+                break;
+        }
+    }
+}
+
+//
+// A keyboard-wedge barcode scanner: bursts of 20-60 digits a few hundred
+// microseconds apart, each scan ended by enter, with a pause between scans.
+//
+
+static inline void streamScanner(ScancodeStream * stream, UInt32 bytes)
+{
+    static const UInt8 digits[] = { 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b };
+    StreamBuilder      builder(stream, 250000);
+    StreamRandom       random;
+
+    stream->name = "scanner bursts";
+    while (stream->bytes.size() < bytes)
+    {
+        for (UInt32 length = 20 + random.next(41); length; length--)
+            builder.tap(digits[random.next(STREAM_COUNT(digits))]);
+        builder.tap(0x1c);      // enter
+        builder.idle(500000000);
+    }
+}
+
+//
+// Reads a recorded trace; returns false if the file isn't one.
+//
+
+static inline bool streamFromTrace(ScancodeStream * stream, const char * path)
+{
+    std::vector<UInt8>  data;
+    ScancodeTraceReader reader;
+    FILE *              file = fopen(path, "rb");
+    UInt8               buffer[65536];
+    size_t              length;
+    UInt64              time;
+    UInt8               byte;
+
+    if (!file)  return false;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        data.insert(data.end(), buffer, buffer + length);
+    fclose(file);
+
+    stream->name = path;
+    if (data.empty() || !reader.begin(&data[0], data.size()))  return false;
+    while (reader.next(&time, &byte))  stream->add(byte, time);
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Translation tables, built as buildConfig builds the default configuration:
+// PS2ToADBMap, caps lock as control, the function keys as media keys with
+// Insert and Application as a momentary fn layer that restores them, and
+// the Mission Control macro.
+//
+
+struct StreamConfig
+{
+    KeyTranslation tables[2 * KBV_NUM_KEYCODES];
+    KeyMacroArena  macros;
+
+    StreamConfig()
+    {
+        static const UInt16 missionControlDown[] = { 0x3e, 0x7e };
+        static const UInt16 missionControlUp[]   = { 0x3e | kMacroStepUp, 0x7e | kMacroStepUp };
+        KeyTranslation *    base = tables;
+        KeyTranslation *    fn   = tables + KBV_NUM_KEYCODES;
+
+        macros.reset();
+        macros.add(missionControlDown, 2, missionControlUp, 2);
+
+        for (int keyCode = 0; keyCode < KBV_NUM_KEYCODES; keyCode++)
+        {
+            base[keyCode] = PS2ToADBMap[keyCode];
+            if (base[keyCode] == 0x39)  base[keyCode] = 0x3b;
+            fn[keyCode] = base[keyCode];
+
+            if (base[keyCode] == 0x72 || base[keyCode] == 0x6e)
+                base[keyCode] = kKeyTranslateLayerMomentary | 1;
+            else
+                base[keyCode] = remapFunctionKeys(base[keyCode]);
+        }
+    }
+
+    static KeyTranslation remapFunctionKeys(KeyTranslation adbKeyCode)
+    {
+        switch (adbKeyCode)
+        {
+            case 0x7a: return 0x91;
+            case 0x78: return 0x90;
+            case 0x63: return kKeyTranslateMacro | kMacroMissionControl;
+            case 0x76: return 0x6f;
+            case 0x62: return 0xa1;
+            case 0x64: return 0xa2;
+            case 0x65: return 0xa3;
+            case 0x6d: return 0x4a;
+            case 0x67: return 0x49;
+            case 0x6f: return 0x48;
+            default:   return adbKeyCode;
+        }
+    }
+};
+
+#endif /* !_SCANCODESTREAMS_H */
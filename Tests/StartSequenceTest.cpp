@@ -0,0 +1,229 @@
+//
+// Checks the asynchronous bring-up on the simulated controller: start()
+// returns without waiting for the keyboard, retries a command byte that
+// changes under it, and terminates the driver when the keyboard doesn't
+// answer or the sequence runs past its timeout.
+//
+// For comparison, it replays the probe and start the driver used to have,
+// which waited on the keyboard, through the same device interface, and
+// prints how long each kept the caller blocked.
+//
+
+#include "DriverHarness.h"
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// The old probe and start: a blocking echo, then LEDs and enable sent
+// fire-and-forget around a blocking test-and-set of the command byte.
+//
+
+static bool legacyProbe(ApplePS2Controller * controller)
+{
+    PS2Request * request = controller->allocateRequest();
+    bool         success;
+    
+    request->commands[0].command = kPS2C_WriteDataPort;
+    request->commands[0].inOrOut = kDP_TestKeyboardEcho;
+    request->commands[1].command = kPS2C_ReadDataPortAndCompare;
+    request->commands[1].inOrOut = kDP_TestKeyboardEcho;
+    request->commandsCount = 2;
+    controller->submitRequestAndBlock(request);
+    success = (request->commandsCount == 2);
+    controller->freeRequest(request);
+    return success;
+}
+
+static void legacySendFireAndForget(ApplePS2Controller * controller, const UInt8 * bytes, UInt8 count)
+{
+    PS2Request * request = controller->allocateRequest();
+    
+    for (UInt8 index = 0; index < count; index++)
+    {
+        request->commands[2 * index].command     = kPS2C_WriteDataPort;
+        request->commands[2 * index].inOrOut     = bytes[index];
+        request->commands[2 * index + 1].command = kPS2C_ReadDataPortAndCompare;
+        request->commands[2 * index + 1].inOrOut = kSC_Acknowledge;
+    }
+    request->commandsCount = 2 * count;
+    controller->submitRequest(request);
+}
+
+static void legacySetCommandByte(ApplePS2Controller * controller, UInt8 setBits, UInt8 clearBits)
+{
+    PS2Request * request = controller->allocateRequest();
+    UInt8        commandByte;
+    
+    do
+    {
+        request->commands[0].command = kPS2C_WriteCommandPort;
+        request->commands[0].inOrOut = kCP_GetCommandByte;
+        request->commands[1].command = kPS2C_ReadDataPort;
+        request->commands[1].inOrOut = 0;
+        request->commandsCount = 2;
+        controller->submitRequestAndBlock(request);
+        commandByte = request->commands[1].inOrOut;
+    
+        request->commands[0].command = kPS2C_WriteCommandPort;
+        request->commands[0].inOrOut = kCP_GetCommandByte;
+        request->commands[1].command = kPS2C_ReadDataPortAndCompare;
+        request->commands[1].inOrOut = commandByte;
+        request->commands[2].command = kPS2C_WriteCommandPort;
+        request->commands[2].inOrOut = kCP_SetCommandByte;
+        request->commands[3].command = kPS2C_WriteDataPort;
+        request->commands[3].inOrOut = (commandByte & ~clearBits) | setBits;
+        request->commandsCount = 4;
+        controller->submitRequestAndBlock(request);
+    }
+    while (request->commandsCount != 4);
+    
+    controller->freeRequest(request);
+}
+
+static bool legacyStart(ApplePS2Controller * controller)
+{
+    static const UInt8 kLEDs[]   = { kDP_SetKeyboardLEDs, 0 };
+    static const UInt8 kEnable[] = { kDP_Enable };
+    
+    if (!legacyProbe(controller))  return false;
+    
+    legacySendFireAndForget(controller, kLEDs, 2);
+    legacySetCommandByte(controller, kCB_EnableKeyboardIRQ | kCB_TranslateMode, kCB_DisableKeyboardClock);
+    legacySendFireAndForget(controller, kEnable, 1);
+    return true;
+}
+
+//
+// Runs the old start on a bare controller, and returns how long it blocked.
+//
+
+static UInt64 legacyBlockedNS(bool keyboardPresent)
+{
+    ApplePS2Controller * controller = new ApplePS2Controller;
+    UInt64               blockedNS;
+    
+    controller->init();
+    controller->faults.absent = !keyboardPresent;
+    CHECK_EQUAL(legacyStart(controller), keyboardPresent);
+    while (!controller->idle())  hostRunNext();
+    if (keyboardPresent)  CHECK(controller->keyboard.scanning());
+    blockedNS = controller->statistics.blockedNS;
+    controller->release();
+    return blockedNS;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+//
+// Starts the driver, checks that start() took no simulated time and blocked
+// on nothing, and runs the bring-up to its end.  Returns the simulated time
+// from start to the end of the sequence.
+//
+
+static UInt64 startUnblocked(DriverHarness & harness)
+{
+    UInt64 started = hostTime();
+    
+    CHECK(harness.start());
+    CHECK_EQUAL(hostTime(), started);
+    CHECK_EQUAL(harness.controller->statistics.requestsBlocking, 0);
+    CHECK_EQUAL(harness.statistic("Start", "Blocked in start (us)"), 0);
+    harness.runUntilIdle();
+    return hostTime() - started;
+}
+
+static void checkTerminated(DriverHarness & harness, const char * message)
+{
+    harness.terminate();
+    CHECK(hostLogged(message));
+    CHECK(!harness.keyboard->getProvider());
+    CHECK(!harness.controller->keyboard.scanning());
+    CHECK_EQUAL(harness.controller->requestsOutstanding(), 0);
+    CHECK(!hostLogged("request still outstanding at stop"));
+}
+
+static void testBlockingRemoved()
+{
+    PS2Timing timing;
+    UInt64    presentNS;
+    UInt64    absentNS;
+    UInt64    oldPresentNS = legacyBlockedNS(true);
+    UInt64    oldAbsentNS  = legacyBlockedNS(false);
+    
+    {
+        DriverHarness harness;
+    
+        presentNS = startUnblocked(harness);
+        CHECK(harness.running());
+        CHECK_EQUAL(harness.controller->statistics.blockedNS, 0);
+    }
+    {
+        DriverHarness harness;
+    
+        harness.controller->faults.absent = true;
+        absentNS = startUnblocked(harness);
+        CHECK(!harness.running());
+        checkTerminated(harness, "keyboard bring-up failed: no response to echo");
+    }
+    
+    printf("%-20s %14s %14s %14s\n", "keyboard", "old blocked", "now blocked", "now done after");
+    printf("%-20s %14.2f %14.2f %14.2f  ms\n", "present", oldPresentNS / 1e6, 0.0, presentNS / 1e6);
+    printf("%-20s %14.2f %14.2f %14.2f  ms\n", "absent", oldAbsentNS / 1e6, 0.0, absentNS / 1e6);
+    
+    //
+    // The old start waited on the echo and the two command byte requests,
+    // and the LED update queued ahead of them; without a keyboard, on a read
+    // timeout.
+    //
+    
+    CHECK(oldPresentNS > 4 * timing.wireByteNS);
+    CHECK(oldAbsentNS >= timing.readTimeoutNS);
+}
+
+static void testCommandByteRetried()
+{
+    DriverHarness harness;
+    
+    harness.controller->faults.commandByteRaces = 3;
+    startUnblocked(harness);
+    CHECK(harness.running());
+    CHECK_EQUAL(harness.statistic("Start", "Command byte retries"), 3);
+    CHECK(harness.controller->keyboard.scanning());
+}
+
+static void testCommandByteKeptChanging()
+{
+    DriverHarness harness;
+    
+    harness.controller->faults.commandByteRaces = kStartRetries + 1;
+    startUnblocked(harness);
+    CHECK(!harness.running());
+    checkTerminated(harness, "keyboard bring-up failed: command byte kept changing");
+}
+
+static void testTimedOut()
+{
+    //
+    // A controller that takes longer to give up on a read than the whole
+    // bring-up is allowed.
+    //
+    
+    DriverHarness harness;
+    UInt64        started = hostTime();
+    
+    harness.controller->faults.absent        = true;
+    harness.controller->timing.readTimeoutNS = 5000000000ULL;
+    startUnblocked(harness);
+    checkTerminated(harness, "keyboard bring-up timed out");
+    CHECK(!hostLogged("keyboard bring-up failed"));
+    CHECK(hostTime() - started >= kStartTimeoutMS * 1000000ULL);
+}
+
+int main()
+{
+    testBlockingRemoved();
+    testCommandByteRetried();
+    testCommandByteKeptChanging();
+    testTimedOut();
+    
+    CHECK_EQUAL(hostKernelStatistics.errors, 0);
+    return testResult("StartSequenceTest");
+}
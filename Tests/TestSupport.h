@@ -0,0 +1,59 @@
+#ifndef _TESTSUPPORT_H
+#define _TESTSUPPORT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Host test support.
+//
+// Each test is its own executable, built against the driver's headers; it
+// prints what failed, and exits non-zero if anything did.
+//
+
+static int testFailures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            testFailures++; \
+        } \
+    } while (0)
+
+#define CHECK_EQUAL(actual, expected) \
+    do { \
+        unsigned long long _actual   = (unsigned long long)(actual); \
+        unsigned long long _expected = (unsigned long long)(expected); \
+        if (_actual != _expected) \
+        { \
+            fprintf(stderr, "%s:%d: %s is 0x%llx, expected 0x%llx\n", \
+                    __FILE__, __LINE__, #actual, _actual, _expected); \
+            testFailures++; \
+        } \
+    } while (0)
+
+static inline int testResult(const char * name)
+{
+    if (testFailures)
+        fprintf(stderr, "%s: %d failure(s)\n", name, testFailures);
+    else
+        printf("%s: passed\n", name);
+    return testFailures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//
+// Monotonic nanoseconds, for the benchmarks.
+//
+
+static inline unsigned long long hostNanoseconds()
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+#endif /* !_TESTSUPPORT_H */